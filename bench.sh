@@ -0,0 +1,140 @@
+#!/bin/sh
+# bench.sh -- throughput of every generator and write path, as CSV or JSON
+#
+#   kernel   keystream fill/xor per engine and buffer size (kernel-bench)
+#   shred    end to end to /dev/null, into a pipe read by dd and to a file
+#            on tmpfs for a few -g/-b/-t/-r settings
+#   filter   rc4filter encrypting a file on tmpfs to another, streamed,
+#            mapped and in the chunked format with and without tags (-a),
+#            and decrypting the chunked files again, and batch mode (-B)
+#            encrypting a directory of 64k files in place
+#
+# Environment: BENCH_FORMAT=csv|json (csv), BENCH_SIZE bytes written per
+# shred/rc4filter run (256m), BENCH_DIR a tmpfs directory (/dev/shm),
+# BENCH_KERNEL_BYTES bytes per kernel measurement (32m).
+
+FORMAT=${BENCH_FORMAT:-csv}
+SIZE=${BENCH_SIZE:-268435456}
+DIR=${BENCH_DIR:-/dev/shm}
+KBYTES=${BENCH_KERNEL_BYTES:-32m}
+HERE=$(dirname "$0")
+
+[ -d "$DIR" ] && [ -w "$DIR" ] || DIR=${TMPDIR:-/tmp}
+OUT="$DIR/bench.$$"
+trap 'rm -rf "$OUT" "$OUT.in" "$OUT.enc" "$OUT.d"' EXIT INT TERM
+
+now() {
+	date +%s.%N
+}
+
+# row SUITE ENGINE IMPL OP BUFSIZE BYTES SECONDS
+row() {
+	awk -v s="$1" -v e="$2" -v i="$3" -v o="$4" -v b="$5" -v n="$6" -v t="$7" \
+		'BEGIN { printf "%s,%s,%s,%s,%d,%d,%.6f,,%.1f\n", s, e, i, o, b, n, t,
+				 (t > 0) ? n / t / 1000000 : 0 }'
+}
+
+# shred_run TARGET-NAME DEST GEN BUFSIZE THREADS REPS, a DEST of - is stdout
+# into a pipe that dd reads
+shred_run() {
+	blocks=$(( SIZE / $4 ))
+	if [ "$2" = - ]; then
+		res=$( { "$HERE/shred" -g "$3" -b "$4" -t "$5" -r "$6" -n "$blocks" |
+				dd of=/dev/null bs=1M 2>/dev/null; } 2>&1 |
+				awk '/^Finished/ { print $2, $(NF-2) }')
+	else
+		res=$("$HERE/shred" -g "$3" -b "$4" -t "$5" -r "$6" -n "$blocks" "$2" \
+				2>&1 >/dev/null | awk '/^Finished/ { print $2, $(NF-2) }')
+	fi
+	set -- "$1" "$2" "$3" "$4" "$5" "$6" $res
+	rm -f "$OUT"
+	[ -n "$8" ] || { echo "shred failed: -g $3 -b $4 -t $5 -r $6" >&2; return; }
+	row shred "$3" "-t $5 -r $6" "$1" "$4" $(( $7 * $4 )) "${8%s}"
+}
+
+# filter_run BUFSIZE IMPL, IMPL stream reads and writes through the buffer,
+# mmap maps both files, chunked writes the chunked format on every CPU and
+# chunked-mac does too with a tag after every chunk, a BUFSIZE of 0 leaves
+# rc4filter's default
+filter_run() {
+	[ "$2" = stream ] && set -- "$1" "$2" -s
+	[ "$2" = chunked ] && set -- "$1" "$2" -c
+	[ "$2" = chunked-mac ] && set -- "$1" "$2" -a
+	bs="-b $1"
+	[ "$1" = 0 ] && bs=
+	t0=$(now)
+	"$HERE/rc4filter" -p bench $bs $3 "$OUT.in" "$OUT.enc" || return
+	t1=$(now)
+	row filter rc4 "$2" encrypt "$1" "$SIZE" \
+		"$(awk -v a="$t0" -v b="$t1" 'BEGIN { print b - a }')"
+}
+
+# filter_decrypt IMPL, decrypt what the last filter_run wrote
+filter_decrypt() {
+	t0=$(now)
+	"$HERE/rc4filter" -p bench -d "$OUT.enc" "$OUT" || return
+	t1=$(now)
+	rm -f "$OUT"
+	row filter rc4 "$1" decrypt 0 "$SIZE" \
+		"$(awk -v a="$t0" -v b="$t1" 'BEGIN { print b - a }')"
+}
+
+# filter_batch FILESIZE, batch encrypt SIZE bytes of FILESIZE byte files
+filter_batch() {
+	mkdir -p "$OUT.d"
+	i=0
+	while [ $(( i * $1 )) -lt "$SIZE" ]; do
+		dd if="$OUT.in" of="$OUT.d/$i" bs="$1" skip="$i" count=1 2>/dev/null
+		i=$(( i + 1 ))
+	done
+	t0=$(now)
+	"$HERE/rc4filter" -p bench -B "$OUT.d" 2>/dev/null || return
+	t1=$(now)
+	rm -rf "$OUT.d"
+	row filter rc4 batch encrypt "$1" "$SIZE" \
+		"$(awk -v a="$t0" -v b="$t1" 'BEGIN { print b - a }')"
+}
+
+run() {
+	echo "suite,engine,impl,op,bufsize,bytes,seconds,bytes_per_cycle,mb_s"
+	"$HERE/kernel-bench" -c -n "$KBYTES" | tail -n +2
+
+	for gen in rc4 chacha8 chacha20 xoshiro; do
+		for bs in 4096 1048576; do
+			shred_run null /dev/null $gen $bs 1 8192
+			shred_run pipe - $gen $bs 1 8192
+			shred_run tmpfs "$OUT" $gen $bs 1 8192
+		done
+		shred_run null /dev/null $gen 4096 2 8192
+		shred_run null /dev/null $gen 4096 4 8192
+		shred_run null /dev/null $gen 4096 1 16
+	done
+
+	"$HERE/shred" -g xoshiro -b 1m -n $(( SIZE / 1048576 )) "$OUT.in" 2>/dev/null
+	for bs in 4096 65536 1048576; do
+		filter_run $bs stream
+	done
+	filter_run 0 mmap
+	filter_run 0 chunked
+	filter_decrypt chunked
+	filter_run 0 chunked-mac
+	filter_decrypt chunked-mac
+	filter_batch 65536
+}
+
+if [ "$FORMAT" = json ]; then
+	run | awk -F, 'NR == 1 { split($0, h, ","); print "["; next }
+		{
+			printf "%s  {", (NR > 2) ? ",\n" : ""
+			for(i = 1; i <= NF; i++)	{
+				v = $i
+				if(v == "") v = "null"
+				else if(v !~ /^[0-9.]+$/) v = "\"" v "\""
+				printf "%s\"%s\": %s", (i > 1) ? ", " : "", h[i], v
+			}
+			printf "}"
+		}
+		END { print "\n]" }'
+else
+	run
+fi
@@ -0,0 +1,282 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chacha.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#endif
+
+/* Generate @nblocks blocks of keystream from @in into @out, starting at
+ * block counter @ctr; the counter in @in itself is ignored
+ */
+typedef void (*chacha_blocks_fn)(const uint32_t in[16], int rounds,
+								 uint64_t ctr, unsigned char *out,
+								 size_t nblocks);
+
+#define ROTL32(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QR(a, b, c, d)	do {							\
+		a += b; d ^= a; d = ROTL32(d, 16);				\
+		c += d; b ^= c; b = ROTL32(b, 12);				\
+		a += b; d ^= a; d = ROTL32(d, 8);				\
+		c += d; b ^= c; b = ROTL32(b, 7);				\
+	} while(0)
+
+#define DOUBLE_ROUND(x)	do {							\
+		QR(x[0], x[4], x[8],  x[12]);					\
+		QR(x[1], x[5], x[9],  x[13]);					\
+		QR(x[2], x[6], x[10], x[14]);					\
+		QR(x[3], x[7], x[11], x[15]);					\
+		QR(x[0], x[5], x[10], x[15]);					\
+		QR(x[1], x[6], x[11], x[12]);					\
+		QR(x[2], x[7], x[8],  x[13]);					\
+		QR(x[3], x[4], x[9],  x[14]);					\
+	} while(0)
+
+static void store_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t load_le32(const unsigned char *p)
+{
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+		   (uint32_t)p[3] << 24;
+}
+
+static void blocks_generic(const uint32_t in[16], int rounds, uint64_t ctr,
+						   unsigned char *out, size_t nblocks)
+{
+	uint32_t x[16];
+	int i;
+
+	for(; nblocks > 0; nblocks--, ctr++, out += CHACHA_BLOCK)	{
+		for(i = 0; i < 16; i++)
+			x[i] = in[i];
+		x[12] = ctr;
+		x[13] = ctr >> 32;
+
+		for(i = 0; i < rounds; i += 2)
+			DOUBLE_ROUND(x);
+
+		for(i = 0; i < 16; i++)	{
+			uint32_t v = x[i] + in[i];
+
+			if(i == 12)
+				v = x[i] + (uint32_t)ctr;
+			else if(i == 13)
+				v = x[i] + (uint32_t)(ctr >> 32);
+			store_le32(out + 4 * i, v);
+		}
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+/* W blocks side by side, one block per vector lane: word i of every block
+ * lives in x[i].  Same source for each width, only the target differs.
+ */
+#define CHACHA_VEC(NAME, W, TARGET)										\
+typedef uint32_t NAME##_v __attribute__((vector_size(4 * (W))));		\
+__attribute__((target(TARGET)))											\
+static void NAME(const uint32_t in[16], int rounds, uint64_t ctr,		\
+				 unsigned char *out, size_t nblocks)					\
+{																		\
+	NAME##_v x[16], orig[16];											\
+	uint32_t tmp[16][W];												\
+	int i, l;															\
+																		\
+	for(; nblocks >= (W); nblocks -= (W), ctr += (W),					\
+						  out += CHACHA_BLOCK * (W))	{				\
+		for(i = 0; i < 16; i++)	{										\
+			NAME##_v b = { 0 };											\
+			orig[i] = b + in[i];										\
+		}																\
+		for(l = 0; l < (W); l++)	{									\
+			tmp[12][l] = (uint32_t)(ctr + l);							\
+			tmp[13][l] = (uint32_t)((ctr + l) >> 32);					\
+		}																\
+		memcpy(&orig[12], tmp[12], sizeof(orig[12]));					\
+		memcpy(&orig[13], tmp[13], sizeof(orig[13]));					\
+		for(i = 0; i < 16; i++)											\
+			x[i] = orig[i];												\
+																		\
+		for(i = 0; i < rounds; i += 2)									\
+			DOUBLE_ROUND(x);											\
+																		\
+		for(i = 0; i < 16; i++)	{										\
+			x[i] += orig[i];											\
+			memcpy(tmp[i], &x[i], sizeof(x[i]));						\
+		}																\
+		/* x86 is little-endian, words go out as they are */			\
+		for(l = 0; l < (W); l++)										\
+			for(i = 0; i < 16; i++)										\
+				memcpy(out + CHACHA_BLOCK * l + 4 * i, &tmp[i][l], 4);	\
+	}																	\
+	if(nblocks > 0)														\
+		blocks_generic(in, rounds, ctr, out, nblocks);					\
+}
+
+CHACHA_VEC(blocks_sse2, 4, "sse2")
+CHACHA_VEC(blocks_avx2, 8, "avx2")
+CHACHA_VEC(blocks_avx512, 16, "avx512f")
+#endif
+
+static const struct chacha_impl	{
+	const char *name;
+	chacha_blocks_fn fn;
+	size_t width;
+} impls[] = {
+#ifdef HAVE_X86_SIMD
+	{ "avx512", blocks_avx512, 16 },
+	{ "avx2", blocks_avx2, 8 },
+	{ "sse2", blocks_sse2, 4 },
+#endif
+	{ "generic", blocks_generic, 1 },
+};
+
+static const struct chacha_impl *impl = NULL;
+
+static int cpu_has(const char *name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if(!strcmp(name, "avx512"))
+		return __builtin_cpu_supports("avx512f");
+	if(!strcmp(name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	if(!strcmp(name, "sse2"))
+		return __builtin_cpu_supports("sse2");
+#endif
+	return !strcmp(name, "generic");
+}
+
+/* Best kernel this CPU runs */
+static const struct chacha_impl *pick_impl(void)
+{
+	size_t i;
+
+	if(impl == NULL)	{
+		for(i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)	{
+			if(cpu_has(impls[i].name))	{
+				impl = &impls[i];
+				break;
+			}
+		}
+	}
+	return impl;
+}
+
+const char *chacha_impl(void)
+{
+	return pick_impl()->name;
+}
+
+/* Use kernel @name if the CPU has it (for testing and benchmarks) */
+void chacha_force_impl(const char *name)
+{
+	size_t i;
+
+	for(i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+		if(!strcmp(impls[i].name, name) && cpu_has(name))
+			impl = &impls[i];
+}
+
+/* Key with up to 32 bytes of @key (cycled if shorter), the next 8 bytes if
+ * there are any make the nonce.  @rounds must be 8, 12 or 20.
+ */
+void chacha_init(struct chacha_ctx *ctx, const unsigned char *key, size_t klen,
+				 int rounds)
+{
+	static const unsigned char sigma[16] = "expand 32-byte k";
+	unsigned char k[40];
+	size_t i;
+
+	memset(ctx, 0, sizeof(struct chacha_ctx));
+	ctx->rounds = rounds;
+
+	memset(k, 0, sizeof(k));
+	for(i = 0; i < 32 && klen > 0; i++)
+		k[i] = key[i % klen];
+	for(i = 32; i < klen && i < 40; i++)
+		k[i] = key[i];
+
+	for(i = 0; i < 4; i++)
+		ctx->input[i] = load_le32(sigma + 4 * i);
+	for(i = 0; i < 8; i++)
+		ctx->input[4 + i] = load_le32(k + 4 * i);
+	ctx->input[12] = ctx->input[13] = 0;
+	ctx->input[14] = load_le32(k + 32);
+	ctx->input[15] = load_le32(k + 36);
+	memset(k, 0, sizeof(k));
+}
+
+/* Mix @l bytes of @k into the key, the block counter keeps running */
+void chacha_rekey(struct chacha_ctx *ctx, const unsigned char *k, size_t l)
+{
+	unsigned char mix[32];
+	size_t i;
+
+	if(l == 0)
+		return;
+	memset(mix, 0, sizeof(mix));
+	for(i = 0; i < l || i < sizeof(mix); i++)
+		mix[i % sizeof(mix)] ^= k[i % l];
+	for(i = 0; i < 8; i++)
+		ctx->input[4 + i] ^= load_le32(mix + 4 * i);
+	memset(mix, 0, sizeof(mix));
+}
+
+static uint64_t get_ctr(struct chacha_ctx *ctx)
+{
+	return ctx->input[12] | (uint64_t)ctx->input[13] << 32;
+}
+
+static void set_ctr(struct chacha_ctx *ctx, uint64_t ctr)
+{
+	ctx->input[12] = ctr;
+	ctx->input[13] = ctr >> 32;
+}
+
+/* Write @n bytes of keystream to @buf, carrying on from the last call */
+void chacha_fill_buf(struct chacha_ctx *ctx, unsigned char *buf, size_t n)
+{
+	const struct chacha_impl *k = pick_impl();
+	size_t batch = CHACHA_BLOCK * k->width;
+	size_t take, nblocks;
+
+	/* Leftovers from last time first */
+	if(ctx->ks_pos < ctx->ks_len)	{
+		take = ctx->ks_len - ctx->ks_pos;
+		if(take > n)
+			take = n;
+		memcpy(buf, ctx->ks + ctx->ks_pos, take);
+		ctx->ks_pos += take;
+		buf += take;
+		n -= take;
+	}
+
+	/* Whole batches straight into the buffer */
+	nblocks = (n / batch) * k->width;
+	if(nblocks > 0)	{
+		k->fn(ctx->input, ctx->rounds, get_ctr(ctx), buf, nblocks);
+		set_ctr(ctx, get_ctr(ctx) + nblocks);
+		buf += nblocks * CHACHA_BLOCK;
+		n -= nblocks * CHACHA_BLOCK;
+	}
+
+	/* And the tail out of one more batch, keeping the rest */
+	if(n > 0)	{
+		k->fn(ctx->input, ctx->rounds, get_ctr(ctx), ctx->ks, k->width);
+		set_ctr(ctx, get_ctr(ctx) + k->width);
+		ctx->ks_len = batch;
+		memcpy(buf, ctx->ks, n);
+		ctx->ks_pos = n;
+	}
+}
@@ -0,0 +1,29 @@
+#ifndef CHACHA_H_
+#define CHACHA_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* ChaCha keystream (original 64-bit counter / 64-bit nonce layout) with
+ * 8, 12 or 20 rounds.  Blocks are generated several at a time with SSE2,
+ * AVX2 or AVX-512 when the CPU has it, picked at runtime; the keystream is
+ * the same whichever path is used and however the buffer is chunked.
+ */
+#define CHACHA_BLOCK    64
+#define CHACHA_MAXW     16
+
+struct chacha_ctx {
+    uint32_t input[16];
+    int rounds;
+    size_t ks_pos, ks_len;          /* unused keystream left in ks */
+    unsigned char ks[CHACHA_BLOCK * CHACHA_MAXW];
+};
+
+void chacha_init(struct chacha_ctx *ctx, const unsigned char *key, size_t klen,
+                 int rounds);
+void chacha_rekey(struct chacha_ctx *ctx, const unsigned char *k, size_t l);
+void chacha_fill_buf(struct chacha_ctx *ctx, unsigned char *buf, size_t n);
+const char *chacha_impl(void);
+void chacha_force_impl(const char *name);
+
+#endif
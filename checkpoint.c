@@ -0,0 +1,128 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC	"shred-checkpoint 1"
+
+/* Make the rename of a file in @path's directory durable */
+static void sync_dir(const char *path)
+{
+	char *copy = strdup(path);
+	int fd;
+
+	if(copy == NULL)
+		return;
+	if((fd = open(dirname(copy), O_RDONLY | O_DIRECTORY)) >= 0)	{
+		fsync(fd);
+		close(fd);
+	}
+	free(copy);
+}
+
+/* Write @c to a temporary next to @path, sync it and rename it over @path,
+ * so a crash leaves either the old checkpoint or the new one.  Returns -1
+ * with errno set on failure.
+ */
+int checkpoint_save(const char *path, const struct checkpoint *c)
+{
+	char tmp[4096];
+	FILE *fp;
+	int err;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if((fp = fopen(tmp, "w")) == NULL)
+		return -1;
+
+	fprintf(fp, CHECKPOINT_MAGIC "\n"
+			"destination %s\n"
+			"generator %s\n"
+			"passes %s\n"
+			"block %zu\n"
+			"total %zu\n"
+			"skip %lld\n"
+			"pass %d\n"
+			"offset %lld\n",
+			c->dest, c->gen, c->passes, c->block, c->total,
+			(long long)c->skip, c->pass, (long long)c->offset);
+
+	if(fflush(fp) != 0 || fsync(fileno(fp)) != 0)	{
+		err = errno;
+		fclose(fp);
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	if(fclose(fp) != 0 || rename(tmp, path) != 0)	{
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	sync_dir(path);
+	return 0;
+}
+
+/* Read the checkpoint at @path into @c, -1 with errno set (EINVAL if it
+ * isn't a checkpoint) on failure
+ */
+int checkpoint_load(const char *path, struct checkpoint *c)
+{
+	char line[2048], key[64], val[1024];
+	long long n;
+	int seen = 0;
+	FILE *fp;
+
+	if((fp = fopen(path, "r")) == NULL)
+		return -1;
+
+	memset(c, 0, sizeof(*c));
+	if(fgets(line, sizeof(line), fp) == NULL ||
+	   strncmp(line, CHECKPOINT_MAGIC "\n", sizeof(line)) != 0)	{
+		fclose(fp);
+		errno = EINVAL;
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), fp) != NULL)	{
+		val[0] = '\0';
+		if(sscanf(line, "%63s %1023[^\n]", key, val) < 1)
+			continue;
+		n = strtoll(val, NULL, 10);
+
+		if(!strcmp(key, "destination"))
+			snprintf(c->dest, sizeof(c->dest), "%s", val);
+		else if(!strcmp(key, "generator"))
+			snprintf(c->gen, sizeof(c->gen), "%s", val);
+		else if(!strcmp(key, "passes"))
+			snprintf(c->passes, sizeof(c->passes), "%s", val);
+		else if(!strcmp(key, "block"))
+			c->block = n;
+		else if(!strcmp(key, "total"))
+			c->total = n;
+		else if(!strcmp(key, "skip"))
+			c->skip = n;
+		else if(!strcmp(key, "pass"))
+			c->pass = n;
+		else if(!strcmp(key, "offset"))
+			c->offset = n;
+		else
+			continue;
+		seen++;
+	}
+	fclose(fp);
+
+	if(seen < 8)	{
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* How far a shred got, and with what settings, so a later run can pick up
+ * at the last offset known to be on the device.  Kept as a small text file
+ * of "key value" lines, replaced atomically on every save.
+ */
+struct checkpoint	{
+	char dest[1024];
+	char gen[64];
+	char passes[256];
+	size_t block;
+	size_t total;
+	off_t skip;
+	int pass;
+	off_t offset;
+};
+
+int checkpoint_save(const char *path, const struct checkpoint *c);
+int checkpoint_load(const char *path, struct checkpoint *c);
+
+#endif
@@ -0,0 +1,461 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "container.h"
+#include "entropy.h"
+
+/* Data is MACed this little at a time, right after it is encrypted, so the
+ * core runs the RC4 and Poly1305 dependency chains side by side
+ */
+#define MAC_STEP	32
+
+/* Chunk index whose key tags the header, no file has that many chunks */
+#define HEADER_INDEX	UINT64_MAX
+
+/* Bits a magic may be off by and still be taken for one */
+#define MAGIC_SLACK		8
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	int i;
+
+	for(i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Set @ctx up to encrypt chunk @index from its start */
+static void chunk_key(const struct container *c, uint64_t index,
+					  struct rc4_ctx *ctx)
+{
+	unsigned char tag[CONTAINER_NONCE + 8], drop[CONTAINER_DROP];
+	int i;
+
+	memcpy(ctx, &c->root, sizeof(*ctx));
+	memcpy(tag, c->nonce, CONTAINER_NONCE);
+	for(i = 0; i < 8; i++)
+		tag[CONTAINER_NONCE + i] = index >> (8 * i);
+	rc4_shuffle_key(ctx, tag, sizeof(tag));
+	rc4_fill_buf(ctx, drop, sizeof(drop));
+}
+
+/* Tag the header in @c->hdr is closed with, from everything before it */
+static void header_tag(const struct container *c, unsigned char *tag)
+{
+	unsigned char key[POLY1305_KEY];
+	struct poly1305_ctx mac;
+	struct rc4_ctx ctx;
+
+	chunk_key(c, HEADER_INDEX, &ctx);
+	rc4_fill_buf(&ctx, key, sizeof(key));
+	poly1305_init(&mac, key);
+	poly1305_update(&mac, c->hdr, CONTAINER_HDR - POLY1305_TAG);
+	poly1305_finish(&mac, tag);
+	memset(key, 0, sizeof(key));
+}
+
+/* A new container of @chunk byte chunks under the passphrase key @root,
+ * with a fresh nonce so no two files share chunk keys
+ */
+void container_new(struct container *c, const struct rc4_ctx *root,
+				   size_t chunk, uint32_t flags)
+{
+	memset(c, 0, sizeof(*c));
+	c->chunk = chunk;
+	c->flags = flags;
+	entropy_bytes(c->nonce, sizeof(c->nonce));
+	memcpy(&c->root, root, sizeof(c->root));
+
+	memcpy(c->hdr, CONTAINER_MAGIC, 8);
+	put32(c->hdr + 8, c->chunk);
+	put32(c->hdr + 12, c->flags);
+	memcpy(c->hdr + 16, c->nonce, CONTAINER_NONCE);
+	header_tag(c, c->hdr + CONTAINER_HDR - POLY1305_TAG);
+}
+
+void container_encode(const struct container *c, unsigned char *hdr)
+{
+	memcpy(hdr, c->hdr, CONTAINER_HDR);
+}
+
+/* Bits the first 8 bytes of @hdr (@len of them) are off the magic by */
+static int magic_distance(const unsigned char *hdr, size_t len)
+{
+	int i, d = 0;
+
+	if(len < 8)
+		return 64;
+	for(i = 0; i < 8; i++)
+		d += __builtin_popcount(hdr[i] ^ (unsigned char)CONTAINER_MAGIC[i]);
+	return d;
+}
+
+/* Read the header in the first @len bytes of a file, returns 1 if they
+ * don't start with one (a legacy stream), -1 if it is one this version
+ * can't read and -2 if its tag doesn't match.  A magic a few bits off is
+ * taken for a damaged header, not legacy: 8 random bytes come that close
+ * about once in 3 * 10^9.
+ */
+int container_decode(struct container *c, const struct rc4_ctx *root,
+					 const unsigned char *hdr, size_t len)
+{
+	unsigned char tag[POLY1305_TAG];
+	int d = magic_distance(hdr, len);
+
+	if(d > MAGIC_SLACK)
+		return 1;
+	if(d != 0 || len < CONTAINER_HDR)
+		return -1;
+
+	memset(c, 0, sizeof(*c));
+	memcpy(c->hdr, hdr, CONTAINER_HDR);
+	memcpy(c->nonce, hdr + 16, CONTAINER_NONCE);
+	memcpy(&c->root, root, sizeof(c->root));
+	header_tag(c, tag);
+	if(poly1305_verify(tag, hdr + CONTAINER_HDR - POLY1305_TAG) != 0)
+		return -2;
+
+	c->chunk = get32(hdr + 8);
+	c->flags = get32(hdr + 12);
+	if(c->chunk == 0 || c->chunk > CONTAINER_MAX_CHUNK || (c->flags & ~CONTAINER_MAC) != 0)
+		return -1;
+	return 0;
+}
+
+/* Bytes after every chunk for its tag */
+size_t container_tag(const struct container *c)
+{
+	return (c->flags & CONTAINER_MAC) ? POLY1305_TAG : 0;
+}
+
+/* Chunks that @len bytes of data are cut into */
+uint64_t container_chunks(const struct container *c, uint64_t len)
+{
+	uint64_t n = (len + c->chunk - 1) / c->chunk;
+
+	return (n == 0 && (c->flags & CONTAINER_MAC)) ? 1 : n;
+}
+
+/* Size of the container holding @len bytes of data */
+uint64_t container_size(const struct container *c, uint64_t len)
+{
+	return CONTAINER_HDR + len + container_chunks(c, len) * container_tag(c);
+}
+
+/* Data in a container file of @size bytes, -1 if none with this header can
+ * be that long, which means it was cut short
+ */
+int64_t container_data(const struct container *c, uint64_t size)
+{
+	uint64_t body, stride, n;
+	size_t tag = container_tag(c);
+
+	if(size < CONTAINER_HDR)
+		return -1;
+	body = size - CONTAINER_HDR;
+	if(tag == 0)
+		return body;
+
+	stride = c->chunk + tag;
+	n = (body + stride - 1) / stride;
+	if(n == 0 || body - (n - 1) * stride < tag)
+		return -1;
+	return body - n * tag;
+}
+
+/* Key a chunk's MAC and feed it the header, which comes before the data */
+static void mac_start(const struct container *c, struct poly1305_ctx *mac,
+					  struct rc4_ctx *ctx)
+{
+	unsigned char key[POLY1305_KEY];
+
+	rc4_fill_buf(ctx, key, sizeof(key));
+	poly1305_init(mac, key);
+	poly1305_update(mac, c->hdr, CONTAINER_HDR);
+	memset(key, 0, sizeof(key));
+}
+
+/* What follows a chunk's ciphertext into its MAC */
+static void mac_finish(struct poly1305_ctx *mac, uint64_t index, bool last,
+					   size_t len, unsigned char *tag)
+{
+	unsigned char trailer[16];
+	uint64_t l = len | ((uint64_t)last << 63);
+	int i;
+
+	for(i = 0; i < 8; i++)	{
+		trailer[i] = index >> (8 * i);
+		trailer[8 + i] = l >> (8 * i);
+	}
+	poly1305_update(mac, trailer, sizeof(trailer));
+	poly1305_finish(mac, tag);
+}
+
+/* Encrypt the @len bytes of chunk @index at @src to @dst (which may be
+ * @src) and, with CONTAINER_MAC, put its tag right after them.  @last is
+ * set on the file's last chunk.
+ */
+void container_seal(const struct container *c, uint64_t index, bool last,
+					unsigned char *dst, const unsigned char *src, size_t len)
+{
+	struct poly1305_ctx mac;
+	struct rc4_ctx ctx;
+	size_t off, n;
+
+	chunk_key(c, index, &ctx);
+	if(!(c->flags & CONTAINER_MAC))	{
+		rc4_xor_copy(&ctx, dst, src, len);
+		return;
+	}
+
+	mac_start(c, &mac, &ctx);
+	for(off = 0; off < len; off += n)	{
+		n = (len - off < MAC_STEP) ? len - off : MAC_STEP;
+		rc4_xor_copy(&ctx, dst + off, src + off, n);
+		poly1305_update(&mac, dst + off, n);
+	}
+	mac_finish(&mac, index, last, len, dst + len);
+}
+
+/* Decrypt the @len bytes of chunk @index at @src to @dst (which may be
+ * @src), -1 if the tag following them doesn't match.  @dst holds garbage
+ * then.
+ */
+int container_open(const struct container *c, uint64_t index, bool last,
+				   unsigned char *dst, const unsigned char *src, size_t len)
+{
+	unsigned char tag[POLY1305_TAG];
+	struct poly1305_ctx mac;
+	struct rc4_ctx ctx;
+	size_t off, n;
+
+	chunk_key(c, index, &ctx);
+	if(!(c->flags & CONTAINER_MAC))	{
+		rc4_xor_copy(&ctx, dst, src, len);
+		return 0;
+	}
+
+	mac_start(c, &mac, &ctx);
+	for(off = 0; off < len; off += n)	{
+		n = (len - off < MAC_STEP) ? len - off : MAC_STEP;
+		poly1305_update(&mac, src + off, n);
+		rc4_xor_copy(&ctx, dst + off, src + off, n);
+	}
+	mac_finish(&mac, index, last, len, tag);
+	return poly1305_verify(tag, src + len);
+}
+
+#ifdef TEST
+
+#define TEST_CHUNK	64
+#define TEST_MAX	(4 * TEST_CHUNK + 1)
+
+static unsigned char data[TEST_MAX], file[CONTAINER_HDR + TEST_MAX +
+										  (TEST_MAX / TEST_CHUNK + 1) * POLY1305_TAG];
+
+/* Seal @len bytes of data into file the way rc4filter lays it out,
+ * returns the file's size
+ */
+static uint64_t seal_file(const struct container *c, uint64_t len)
+{
+	uint64_t k, n = container_chunks(c, len), stride = c->chunk + container_tag(c);
+	size_t clen;
+
+	container_encode(c, file);
+	for(k = 0; k < n; k++)	{
+		clen = (k == n - 1) ? len - k * c->chunk : c->chunk;
+		container_seal(c, k, k == n - 1, file + CONTAINER_HDR + k * stride,
+					   data + k * c->chunk, clen);
+	}
+	return container_size(c, len);
+}
+
+/* Open chunk @k of a sealed file holding @len bytes into @out, as its last
+ * chunk or not
+ */
+static int open_chunk(const struct container *c, uint64_t len, uint64_t k,
+					  bool last, unsigned char *out)
+{
+	uint64_t stride = c->chunk + container_tag(c);
+	size_t clen = (len - k * c->chunk < c->chunk) ? len - k * c->chunk : c->chunk;
+
+	return container_open(c, k, last, out, file + CONTAINER_HDR + k * stride,
+						  clen);
+}
+
+/* Seal @len bytes and open the file again from its header alone, every
+ * chunk on its own as a range decrypt would, then check the chunks don't
+ * open as one another or with the last flag wrong
+ */
+static int check_round_trip(const struct rc4_ctx *root, uint64_t len,
+							uint32_t flags)
+{
+	static unsigned char out[TEST_MAX];
+	struct container c, d;
+	uint64_t size, n, k;
+	int fails = 0;
+
+	container_new(&c, root, TEST_CHUNK, flags);
+	size = seal_file(&c, len);
+	n = container_chunks(&c, len);
+
+	if(container_decode(&d, root, file, size) != 0)	{
+		printf("FAIL: header of %llu bytes, flags %u doesn't decode\n",
+			   (unsigned long long)len, flags);
+		return 1;
+	}
+	if(container_data(&d, size) != (int64_t)len)	{
+		printf("FAIL: %llu bytes, flags %u: container_data() says %lld\n",
+			   (unsigned long long)len, flags,
+			   (long long)container_data(&d, size));
+		fails++;
+	}
+
+	memset(out, 0, sizeof(out));
+	for(k = n; k-- > 0; )
+		if(open_chunk(&d, len, k, k == n - 1, out + k * d.chunk) != 0)	{
+			printf("FAIL: %llu bytes, flags %u: chunk %llu doesn't open\n",
+				   (unsigned long long)len, flags, (unsigned long long)k);
+			fails++;
+		}
+	if(memcmp(out, data, len) != 0)	{
+		printf("FAIL: %llu bytes, flags %u don't round trip\n",
+			   (unsigned long long)len, flags);
+		fails++;
+	}
+
+	if(!(flags & CONTAINER_MAC))
+		return fails;
+
+	/* The last chunk has to be the last, and nothing else */
+	for(k = 0; k < n; k++)
+		if(open_chunk(&d, len, k, k != n - 1, out) == 0)	{
+			printf("FAIL: %llu bytes: chunk %llu opens with last %s\n",
+				   (unsigned long long)len, (unsigned long long)k,
+				   (k != n - 1) ? "set" : "clear");
+			fails++;
+		}
+	/* A chunk moved to another index */
+	if(n > 1 && container_open(&d, 0, false, out, file + CONTAINER_HDR +
+							   d.chunk + POLY1305_TAG, d.chunk) == 0)	{
+		printf("FAIL: %llu bytes: chunk 1 opens as chunk 0\n",
+			   (unsigned long long)len);
+		fails++;
+	}
+	return fails;
+}
+
+/* Every bit of the header counts: flipped it is damaged or fails its tag,
+ * never taken for a legacy stream or for a good header
+ */
+static int check_header(const struct rc4_ctx *root, const struct rc4_ctx *wrong)
+{
+	unsigned char hdr[CONTAINER_HDR];
+	struct container c, d;
+	int bit, kind, fails = 0;
+
+	container_new(&c, root, TEST_CHUNK, CONTAINER_MAC);
+	container_encode(&c, hdr);
+	for(bit = 0; bit < CONTAINER_HDR * 8; bit++)	{
+		hdr[bit / 8] ^= 1 << (bit % 8);
+		kind = container_decode(&d, root, hdr, sizeof(hdr));
+		if(kind >= 0 || (bit < 64 && kind != -1))	{
+			printf("FAIL: header with bit %d flipped decodes as %d\n", bit,
+				   kind);
+			fails++;
+		}
+		hdr[bit / 8] ^= 1 << (bit % 8);
+	}
+
+	if((kind = container_decode(&d, wrong, hdr, sizeof(hdr))) != -2)	{
+		printf("FAIL: header under another passphrase decodes as %d\n", kind);
+		fails++;
+	}
+	if((kind = container_decode(&d, root, hdr, CONTAINER_HDR - 1)) != -1)	{
+		printf("FAIL: header cut short decodes as %d\n", kind);
+		fails++;
+	}
+	if((kind = container_decode(&d, root, hdr, 7)) != 1)	{
+		printf("FAIL: 7 byte file decodes as %d, not legacy\n", kind);
+		fails++;
+	}
+	memset(hdr, 0xa5, sizeof(hdr));
+	if((kind = container_decode(&d, root, hdr, sizeof(hdr))) != 1)	{
+		printf("FAIL: legacy stream decodes as %d\n", kind);
+		fails++;
+	}
+	return fails;
+}
+
+/* Sizes no container of TEST_CHUNK byte chunks can have */
+static int check_truncated(const struct rc4_ctx *root)
+{
+	struct container c;
+	uint64_t stride = TEST_CHUNK + POLY1305_TAG;
+	const uint64_t sizes[] = {
+		0, CONTAINER_HDR - 1,
+		CONTAINER_HDR,							/* a MAC file has a chunk */
+		CONTAINER_HDR + POLY1305_TAG - 1,		/* short of the first tag */
+		CONTAINER_HDR + stride + 1,				/* a byte into chunk 1 */
+		CONTAINER_HDR + stride + POLY1305_TAG - 1
+	};
+	size_t i;
+	int fails = 0;
+
+	container_new(&c, root, TEST_CHUNK, CONTAINER_MAC);
+	for(i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+		if(container_data(&c, sizes[i]) != -1)	{
+			printf("FAIL: container_data(%llu) is %lld, not -1\n",
+				   (unsigned long long)sizes[i],
+				   (long long)container_data(&c, sizes[i]));
+			fails++;
+		}
+
+	/* Without tags any size past the header is some length of data */
+	container_new(&c, root, TEST_CHUNK, 0);
+	if(container_data(&c, CONTAINER_HDR - 1) != -1 ||
+	   container_data(&c, CONTAINER_HDR + 1) != 1)	{
+		printf("FAIL: container_data() of an untagged file\n");
+		fails++;
+	}
+	return fails;
+}
+
+/* Round trips at and around the chunk boundaries, with and without tags,
+ * then damaged headers and files cut short
+ */
+int main(void)
+{
+	const uint64_t lens[] = {
+		0, 1, TEST_CHUNK - 1, TEST_CHUNK, TEST_CHUNK + 1,
+		2 * TEST_CHUNK, 3 * TEST_CHUNK + 17, TEST_MAX
+	};
+	struct rc4_ctx root, wrong;
+	size_t i;
+	int fails = 0;
+
+	entropy_seed(1);
+	rc4_init_key(&root, (unsigned char *)"container", 9);
+	rc4_init_key(&wrong, (unsigned char *)"containes", 9);
+	for(i = 0; i < sizeof(data); i++)
+		data[i] = i * 7 + 3;
+
+	for(i = 0; i < sizeof(lens) / sizeof(*lens); i++)	{
+		fails += check_round_trip(&root, lens[i], 0);
+		fails += check_round_trip(&root, lens[i], CONTAINER_MAC);
+	}
+	fails += check_header(&root, &wrong);
+	fails += check_truncated(&root);
+
+	printf("%s: containers round trip and damage is caught\n",
+		   fails ? "FAIL" : "OK");
+	return fails != 0;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef CONTAINER_H_
+#define CONTAINER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "rc4.h"
+#include "poly1305.h"
+
+/* rc4filter's seekable format: a CONTAINER_HDR byte header followed by the
+ * data cut into chunks of the size in the header, the last one short.
+ * Chunk k is XORed with the keystream of its own key, the passphrase's key
+ * schedule with the file's random nonce and k mixed in and the first
+ * CONTAINER_DROP bytes thrown away, so chunks can be encrypted in any
+ * order and any one read without the ones before it.
+ *
+ * The header ends in a Poly1305 tag over the rest of it, keyed like a
+ * chunk's with index 2^64 - 1, so no bit of it (the flags included) can be
+ * changed without the passphrase.  With CONTAINER_MAC every chunk is
+ * followed by a Poly1305 tag over the header, its ciphertext, its index
+ * and its length (with the top bit set on the last chunk, so a file cut
+ * short at a chunk boundary doesn't pass), keyed with the first
+ * POLY1305_KEY bytes of the chunk's keystream.  Such a file has at least
+ * one chunk, if an empty one.
+ *
+ * Header, integers little-endian:
+ *     0  magic "rc4chnk2"
+ *     8  chunk size, 32 bits
+ *    12  flags, 32 bits
+ *    16  nonce, 16 bytes
+ *    32  header tag, 16 bytes
+ */
+#define CONTAINER_MAGIC		"rc4chnk2"
+#define CONTAINER_HDR		48
+#define CONTAINER_NONCE		16
+#define CONTAINER_DROP		3072
+#define CONTAINER_MAX_CHUNK	((size_t)1 << 30)
+
+#define CONTAINER_MAC		0x1
+
+struct container	{
+	size_t chunk;
+	uint32_t flags;
+	unsigned char nonce[CONTAINER_NONCE];
+	unsigned char hdr[CONTAINER_HDR];	/* encoded, tag and all */
+	struct rc4_ctx root;		/* keyed with the passphrase only */
+};
+
+void container_new(struct container *c, const struct rc4_ctx *root,
+				   size_t chunk, uint32_t flags);
+void container_encode(const struct container *c, unsigned char *hdr);
+int container_decode(struct container *c, const struct rc4_ctx *root,
+					 const unsigned char *hdr, size_t len);
+size_t container_tag(const struct container *c);
+uint64_t container_chunks(const struct container *c, uint64_t len);
+uint64_t container_size(const struct container *c, uint64_t len);
+int64_t container_data(const struct container *c, uint64_t size);
+
+void container_seal(const struct container *c, uint64_t index, bool last,
+					unsigned char *dst, const unsigned char *src, size_t len);
+int container_open(const struct container *c, uint64_t index, bool last,
+				   unsigned char *dst, const unsigned char *src, size_t len);
+
+#endif
@@ -0,0 +1,303 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "entropy.h"
+
+#ifndef GRND_NONBLOCK
+#define GRND_NONBLOCK	0x0001
+#endif
+#ifndef GRND_INSECURE
+#define GRND_INSECURE	0x0004
+#endif
+
+/* /dev/urandom, opened once and kept if getrandom() isn't there */
+static int urandom_fd = -1;
+static pthread_mutex_t urandom_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static enum entropy_mode mode = ENTROPY_BLOCK;
+
+/* With a fixed seed every byte comes from splitmix64 instead */
+static bool seeded = false;
+static uint64_t seed_state, first_seed;
+static pthread_mutex_t seed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t prefetcher;
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_wake = PTHREAD_COND_INITIALIZER;
+static struct rekey_slot *slots = NULL;
+static size_t pf_klen = 32;
+static bool pf_running = false;
+static bool pf_stop = false;
+
+static void urandom_bytes(unsigned char *buf, size_t len)
+{
+	size_t rb = 0;
+
+	pthread_mutex_lock(&urandom_lock);
+	if(urandom_fd < 0 && (urandom_fd = open("/dev/urandom", O_RDONLY)) < 0)	{
+		perror("Random device");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_unlock(&urandom_lock);
+
+	while(rb < len)	{
+		ssize_t r = read(urandom_fd, buf + rb, len - rb);
+		if(r < 0)	{
+			if(errno == EINTR)
+				continue;
+			perror("Read random");
+			exit(EXIT_FAILURE);
+		}
+		rb += r;
+	}
+}
+
+/* "block", "nonblock" or "insecure", 0 if @name is one of them */
+int entropy_parse_mode(const char *name, enum entropy_mode *m)
+{
+	if(!strcmp(name, "block"))
+		*m = ENTROPY_BLOCK;
+	else if(!strcmp(name, "nonblock"))
+		*m = ENTROPY_NONBLOCK;
+	else if(!strcmp(name, "insecure"))
+		*m = ENTROPY_INSECURE;
+	else
+		return -1;
+	return 0;
+}
+
+void entropy_set_mode(enum entropy_mode m)
+{
+	mode = m;
+}
+
+/* Make every entropy_bytes() from here on a function of @seed, for runs
+ * that can be repeated byte for byte.  Nothing random about it.
+ */
+void entropy_seed(uint64_t seed)
+{
+	seed_state = first_seed = seed;
+	seeded = true;
+}
+
+/* Where the random bytes come from, in @buf */
+const char *entropy_describe(char *buf, size_t len)
+{
+	static const char *modes[] = { "blocking", "non-blocking", "insecure" };
+
+	if(seeded)
+		snprintf(buf, len, "fixed seed %llu", (unsigned long long)first_seed);
+	else
+		snprintf(buf, len, "getrandom(), %s", modes[mode]);
+	return buf;
+}
+
+static void splitmix_bytes(uint64_t *state, unsigned char *buf, size_t len)
+{
+	uint64_t z;
+	size_t n;
+
+	while(len > 0)	{
+		z = (*state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+		n = (len < sizeof(z)) ? len : sizeof(z);
+		memcpy(buf, &z, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+static void seeded_bytes(unsigned char *buf, size_t len)
+{
+	pthread_mutex_lock(&seed_lock);
+	splitmix_bytes(&seed_state, buf, len);
+	pthread_mutex_unlock(&seed_lock);
+}
+
+/* Fill @buf with @len bytes from the kernel's pool, waiting for it to be
+ * initialised or not as set with entropy_set_mode()
+ */
+void entropy_bytes(unsigned char *buf, size_t len)
+{
+#ifdef SYS_getrandom
+	static bool no_getrandom = false;
+	static bool no_insecure = false;
+	size_t rb = 0;
+#endif
+
+	if(seeded)	{
+		seeded_bytes(buf, len);
+		return;
+	}
+
+#ifdef SYS_getrandom
+	while(!no_getrandom && rb < len)	{
+		int flags = (mode == ENTROPY_BLOCK) ? 0 :
+					(mode == ENTROPY_INSECURE && !no_insecure) ? GRND_INSECURE
+															   : GRND_NONBLOCK;
+		long r = syscall(SYS_getrandom, buf + rb, len - rb, flags);
+		if(r < 0)	{
+			if(errno == EINTR)
+				continue;
+			/* Not initialised yet, /dev/urandom doesn't wait */
+			if(errno == EAGAIN && mode != ENTROPY_BLOCK)
+				break;
+			/* GRND_INSECURE is new in 5.6, the same as urandom before */
+			if(errno == EINVAL && flags == GRND_INSECURE)	{
+				no_insecure = true;
+				break;
+			}
+			if(errno != ENOSYS)	{
+				perror("getrandom");
+				exit(EXIT_FAILURE);
+			}
+			no_getrandom = true;
+			break;
+		}
+		rb += r;
+	}
+	if(rb == len)
+		return;
+	buf += rb;
+	len -= rb;
+#endif
+	urandom_bytes(buf, len);
+}
+
+static void *prefetch_thread(void *arg)
+{
+	unsigned char key[256];
+	struct rekey_slot *s;
+	bool idle;
+
+	(void)arg;
+
+	pthread_mutex_lock(&pf_lock);
+	while(!pf_stop)	{
+		idle = true;
+		for(s = slots; s != NULL; s = s->next)	{
+			if(__atomic_load_n(&s->full, __ATOMIC_ACQUIRE))
+				continue;
+			pthread_mutex_unlock(&pf_lock);
+
+			entropy_bytes(key, pf_klen);
+			gen_reseed(s->shadow, key, pf_klen);
+			gen_load_key(s->ready, s->shadow);
+			__atomic_store_n(&s->full, 1, __ATOMIC_RELEASE);
+			idle = false;
+
+			pthread_mutex_lock(&pf_lock);
+		}
+		if(idle)
+			pthread_cond_wait(&pf_wake, &pf_lock);
+	}
+	pthread_mutex_unlock(&pf_lock);
+
+	memset(key, 0, sizeof(key));
+	return NULL;
+}
+
+/* Start the prefetch thread, rekeying with @klen bytes at a time.  Not
+ * with a fixed seed: whether a rekey finds its key prepared or makes one
+ * inline depends on timing, so every rekey is inline then.
+ */
+int prefetch_start(size_t klen)
+{
+	pf_klen = (klen > 256) ? 256 : (klen == 0) ? 1 : klen;
+	pf_stop = false;
+	if(seeded)
+		return 0;
+	if(pthread_create(&prefetcher, NULL, prefetch_thread, NULL) != 0)
+		return -1;
+	pf_running = true;
+	return 0;
+}
+
+/* Have the next key of generator @g prepared in the background, NULL if
+ * out of memory (callers then rekey inline)
+ */
+struct rekey_slot *prefetch_register(struct gen *g)
+{
+	static uint64_t nslots = 0;
+	struct rekey_slot *s = calloc(1, sizeof(struct rekey_slot));
+
+	if(s == NULL)
+		return NULL;
+	/* Its own stream of the seed, so the threads' draws don't interleave */
+	s->stream = first_seed ^ (++nslots * 0xd1b54a32d192ed03ULL);
+	s->shadow = gen_copy(g);
+	s->ready = gen_copy(g);
+	if(s->shadow == NULL || s->ready == NULL)	{
+		gen_free(s->shadow);
+		gen_free(s->ready);
+		free(s);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pf_lock);
+	s->next = slots;
+	slots = s;
+	pthread_cond_signal(&pf_wake);
+	pthread_mutex_unlock(&pf_lock);
+	return s;
+}
+
+/* Swap the prepared key into @g, which keeps its stream position.  False
+ * if it isn't ready yet, the caller should rekey inline then.
+ */
+bool prefetch_swap(struct rekey_slot *slot, struct gen *g)
+{
+	if(slot == NULL || !__atomic_load_n(&slot->full, __ATOMIC_ACQUIRE))
+		return false;
+
+	gen_load_key(g, slot->ready);
+	__atomic_store_n(&slot->full, 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&pf_lock);
+	pthread_cond_signal(&pf_wake);
+	pthread_mutex_unlock(&pf_lock);
+	return true;
+}
+
+/* Key material for an inline rekey of @slot's generator, from the slot's
+ * own stream when seeded
+ */
+void prefetch_key(struct rekey_slot *slot, unsigned char *key, size_t len)
+{
+	if(seeded && slot != NULL)
+		splitmix_bytes(&slot->stream, key, len);
+	else
+		entropy_bytes(key, len);
+}
+
+void prefetch_stop(void)
+{
+	struct rekey_slot *s;
+
+	if(pf_running)	{
+		pthread_mutex_lock(&pf_lock);
+		pf_stop = true;
+		pthread_cond_signal(&pf_wake);
+		pthread_mutex_unlock(&pf_lock);
+		pthread_join(prefetcher, NULL);
+		pf_running = false;
+	}
+
+	while((s = slots) != NULL)	{
+		slots = s->next;
+		gen_free(s->shadow);
+		gen_free(s->ready);
+		free(s);
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef ENTROPY_H_
+#define ENTROPY_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gen.h"
+
+/* Background rekeying: a prefetch thread keeps, for every registered
+ * generator, its next cipher state already shuffled with fresh random key
+ * material, so a rekey on the hot path is a copy instead of a read from
+ * the random device plus a key schedule.
+ */
+struct rekey_slot {
+    struct gen *shadow;         /* prefetcher's copy, only ever reseeded */
+    struct gen *ready;          /* next key to swap in when full is set */
+    int full;
+    uint64_t stream;            /* seeded runs: this slot's splitmix state */
+    struct rekey_slot *next;
+};
+
+/* How getrandom() is asked: wait for the pool to be initialised (the
+ * default), don't wait and read /dev/urandom instead if it isn't, or take
+ * whatever it has (GRND_INSECURE, /dev/urandom on kernels before 5.6)
+ */
+enum entropy_mode	{ ENTROPY_BLOCK, ENTROPY_NONBLOCK, ENTROPY_INSECURE };
+
+int entropy_parse_mode(const char *name, enum entropy_mode *mode);
+void entropy_set_mode(enum entropy_mode mode);
+void entropy_seed(uint64_t seed);
+const char *entropy_describe(char *buf, size_t len);
+void entropy_bytes(unsigned char *buf, size_t len);
+
+int prefetch_start(size_t klen);
+struct rekey_slot *prefetch_register(struct gen *g);
+bool prefetch_swap(struct rekey_slot *slot, struct gen *g);
+void prefetch_key(struct rekey_slot *slot, unsigned char *key, size_t len);
+void prefetch_stop(void);
+
+#endif
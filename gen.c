@@ -0,0 +1,350 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gen.h"
+
+/* Parse a backend name: rc4, chacha8, chacha12, chacha20 (or chacha) and
+ * xoshiro.  For ChaCha @param gets the rounds, 0 on success.
+ */
+int gen_parse(const char *name, enum gen_type *type, int *param)
+{
+	if(!strcmp(name, "rc4"))	{
+		*type = GEN_RC4;
+	} else if(!strcmp(name, "xoshiro"))	{
+		*type = GEN_XOSHIRO;
+	} else if(!strcmp(name, "chacha") || !strcmp(name, "chacha20"))	{
+		*type = GEN_CHACHA;
+		*param = 20;
+	} else if(!strcmp(name, "chacha12"))	{
+		*type = GEN_CHACHA;
+		*param = 12;
+	} else if(!strcmp(name, "chacha8"))	{
+		*type = GEN_CHACHA;
+		*param = 8;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* New generator keyed with @seed.  @param is the number of RC4 lanes (1 is
+ * the serial engine) or the ChaCha rounds.  NULL if out of memory.
+ */
+struct gen *gen_new(enum gen_type type, int param,
+					unsigned char *seed, size_t slen)
+{
+	unsigned char discard[1024];
+	struct gen *g = calloc(1, sizeof(struct gen));
+
+	if(g == NULL)
+		return NULL;
+	g->type = type;
+	g->param = param;
+
+	switch(type)	{
+		case GEN_RC4:
+			rc4_init_key(&g->u.rc4.ctx, seed, slen);
+			/* Discard some keystream because beginning of RC4 is weaker?
+			 * I mean, we're not really doing crypto here, but whatever...
+			 */
+			rc4_fill_buf(&g->u.rc4.ctx, discard, sizeof(discard));
+			if(param > 1 &&
+			   (g->u.rc4.lanes = rc4_lanes_new(&g->u.rc4.ctx, param)) == NULL)	{
+				free(g);
+				return NULL;
+			}
+			break;
+		case GEN_CHACHA:
+			chacha_init(&g->u.chacha, seed, slen, param);
+			break;
+		case GEN_XOSHIRO:
+			xoshiro_init(&g->u.xoshiro, seed, slen);
+			break;
+	}
+	return g;
+}
+
+/* Copy of @src in the same state, NULL if out of memory */
+struct gen *gen_copy(struct gen *src)
+{
+	struct gen *g = malloc(sizeof(struct gen));
+	struct rc4_lanes *sl = src->u.rc4.lanes;
+
+	if(g == NULL)
+		return NULL;
+	memcpy(g, src, sizeof(struct gen));
+
+	if(src->type == GEN_RC4 && sl != NULL)	{
+		if((g->u.rc4.lanes = rc4_lanes_new(&src->u.rc4.ctx, sl->n)) == NULL)	{
+			free(g);
+			return NULL;
+		}
+		memcpy(g->u.rc4.lanes->lane, sl->lane, sl->n * sizeof(struct rc4_ctx));
+		g->u.rc4.lanes->pos = sl->pos;
+	}
+	return g;
+}
+
+void gen_free(struct gen *g)
+{
+	if(g == NULL)
+		return;
+	if(g->type == GEN_RC4)
+		rc4_lanes_free(g->u.rc4.lanes);
+	memset(g, 0, sizeof(struct gen));
+	free(g);
+}
+
+/* Mix @klen bytes of @key into the generator's state */
+void gen_reseed(struct gen *g, unsigned char *key, size_t klen)
+{
+	switch(g->type)	{
+		case GEN_RC4:
+			if(g->u.rc4.lanes != NULL)
+				rc4_lanes_shuffle_key(g->u.rc4.lanes, key, klen);
+			else
+				rc4_shuffle_key(&g->u.rc4.ctx, key, klen);
+			break;
+		case GEN_CHACHA:
+			chacha_rekey(&g->u.chacha, key, klen);
+			break;
+		case GEN_XOSHIRO:
+			xoshiro_rekey(&g->u.xoshiro, key, klen);
+			break;
+	}
+}
+
+/* Give @dst the keying state of @src (same backend), @dst keeps its place
+ * in the stream and any keystream it has buffered
+ */
+void gen_load_key(struct gen *dst, struct gen *src)
+{
+	int l;
+
+	switch(dst->type)	{
+		case GEN_RC4:
+			if(dst->u.rc4.lanes != NULL)	{
+				for(l = 0; l < dst->u.rc4.lanes->n; l++)
+					memcpy(dst->u.rc4.lanes->lane[l].S,
+						   src->u.rc4.lanes->lane[l].S, 256);
+			} else {
+				memcpy(dst->u.rc4.ctx.S, src->u.rc4.ctx.S, 256);
+			}
+			break;
+		case GEN_CHACHA:
+			/* Everything but the block counter in words 12 and 13 */
+			memcpy(dst->u.chacha.input, src->u.chacha.input,
+				   12 * sizeof(uint32_t));
+			dst->u.chacha.input[14] = src->u.chacha.input[14];
+			dst->u.chacha.input[15] = src->u.chacha.input[15];
+			break;
+		case GEN_XOSHIRO:
+			memcpy(dst->u.xoshiro.s, src->u.xoshiro.s,
+				   sizeof(dst->u.xoshiro.s));
+			break;
+	}
+}
+
+/* Write @n bytes of keystream to @buf */
+void gen_fill(struct gen *g, unsigned char *buf, size_t n)
+{
+	switch(g->type)	{
+		case GEN_RC4:
+			if(g->u.rc4.lanes != NULL)
+				rc4_lanes_fill_buf(g->u.rc4.lanes, buf, n);
+			else
+				rc4_fill_buf(&g->u.rc4.ctx, buf, n);
+			break;
+		case GEN_CHACHA:
+			chacha_fill_buf(&g->u.chacha, buf, n);
+			break;
+		case GEN_XOSHIRO:
+			xoshiro_fill_buf(&g->u.xoshiro, buf, n);
+			break;
+	}
+}
+
+/* XOR a buffer with the keystream */
+void gen_xor(struct gen *g, unsigned char *buf, size_t n)
+{
+	unsigned char ks[4096];
+	size_t i, c;
+
+	if(g->type == GEN_RC4)	{
+		if(g->u.rc4.lanes != NULL)
+			rc4_lanes_xor_stream(g->u.rc4.lanes, buf, n);
+		else
+			rc4_xor_stream(&g->u.rc4.ctx, buf, n);
+		return;
+	}
+
+	for(; n > 0; n -= c, buf += c)	{
+		c = (n < sizeof(ks)) ? n : sizeof(ks);
+		gen_fill(g, ks, c);
+		for(i = 0; i < c; i++)
+			buf[i] ^= ks[i];
+	}
+}
+
+/* Human readable name of a backend and the kernel it runs, in @buf */
+const char *gen_describe(enum gen_type type, int param, char *buf, size_t len)
+{
+	switch(type)	{
+		case GEN_RC4:
+			if(param > 1)
+				snprintf(buf, len, "rc4 (%d lanes)", param);
+			else
+				snprintf(buf, len, "rc4");
+			break;
+		case GEN_CHACHA:
+			snprintf(buf, len, "chacha%d (%s)", param, chacha_impl());
+			break;
+		case GEN_XOSHIRO:
+			snprintf(buf, len, "xoshiro256++ x%d (%s)", XOSHIRO_LANES,
+					 xoshiro_impl());
+			break;
+	}
+	return buf;
+}
+
+
+#ifdef TEST
+
+#define TEST_LEN	(1 << 16)
+
+static const char *kernels[] = { "avx512", "avx2", "sse2", "generic" };
+
+/* Stream of @type in one go with the generic kernel must match every SIMD
+ * kernel the CPU has, whatever the chunking
+ */
+static int check(enum gen_type type, int param)
+{
+	static unsigned char ref[TEST_LEN], out[TEST_LEN];
+	unsigned char key[32];
+	struct gen *g;
+	size_t k, off, n;
+	char name[64];
+	int fails = 0;
+
+	for(k = 0; k < sizeof(key); k++)
+		key[k] = k * 7 + 1;
+
+	chacha_force_impl("generic");
+	xoshiro_force_impl("generic");
+	g = gen_new(type, param, key, sizeof(key));
+	gen_fill(g, ref, TEST_LEN);
+	gen_free(g);
+
+	for(k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)	{
+		chacha_force_impl(kernels[k]);
+		xoshiro_force_impl(kernels[k]);
+		g = gen_new(type, param, key, sizeof(key));
+		for(off = 0; off < TEST_LEN; off += n)	{
+			n = rand() % 3000;
+			if(n > TEST_LEN - off)
+				n = TEST_LEN - off;
+			gen_fill(g, out + off, n);
+		}
+		gen_free(g);
+		if(memcmp(ref, out, TEST_LEN) != 0)	{
+			printf("FAIL: %s differs with the %s kernel\n",
+				   gen_describe(type, param, name, sizeof(name)), kernels[k]);
+			fails++;
+		}
+	}
+	return fails;
+}
+
+/* Every byte of a rekey has to count: 256 byte keys that differ only far
+ * into them, or in two words whose difference a plain XOR of the words into
+ * one accumulator would cancel, must give different streams
+ */
+static int check_key_bytes(enum gen_type type, int param)
+{
+	static const size_t where[] = { 0, 31, 64, 200, 255 };
+	unsigned char seed[32], a[256], b[256], sa[64], sb[64];
+	uint64_t d = (1 + 0x9e3779b97f4a7c15ULL) ^ 0x9e3779b97f4a7c15ULL;
+	struct gen *g;
+	char name[64];
+	size_t k;
+	int i, fails = 0;
+
+	memset(seed, 0x11, sizeof(seed));
+	for(k = 0; k <= sizeof(where) / sizeof(where[0]); k++)	{
+		memset(a, 0, sizeof(a));
+		memcpy(b, a, sizeof(b));
+		if(k < sizeof(where) / sizeof(where[0]))
+			b[where[k]] = 1;
+		else	{
+			b[0] = 1;
+			for(i = 0; i < 8; i++)
+				b[8 + i] = d >> (8 * i);
+		}
+
+		g = gen_new(type, param, seed, sizeof(seed));
+		gen_reseed(g, a, sizeof(a));
+		gen_fill(g, sa, sizeof(sa));
+		gen_free(g);
+		g = gen_new(type, param, seed, sizeof(seed));
+		gen_reseed(g, b, sizeof(b));
+		gen_fill(g, sb, sizeof(sb));
+		gen_free(g);
+		if(memcmp(sa, sb, sizeof(sa)) == 0)	{
+			printf("FAIL: %s keys differing %s give the same stream\n",
+				   gen_describe(type, param, name, sizeof(name)),
+				   (k < sizeof(where) / sizeof(where[0])) ? "in one byte" :
+				   "in two cancelling words");
+			fails++;
+		}
+	}
+	return fails;
+}
+
+/* RFC 7539 section 2.3.2 block, nonce and counter put in the 64/64 layout */
+static int check_chacha_vector(void)
+{
+	static const unsigned char expect[16] = {
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+		0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+	};
+	struct chacha_ctx c;
+	unsigned char key[32], out[64];
+	int i;
+
+	for(i = 0; i < 32; i++)
+		key[i] = i;
+	chacha_init(&c, key, sizeof(key), 20);
+	c.input[12] = 1;
+	c.input[13] = 0x09000000;
+	c.input[14] = 0x4a000000;
+	c.input[15] = 0;
+	chacha_fill_buf(&c, out, sizeof(out));
+
+	if(memcmp(out, expect, sizeof(expect)) != 0)	{
+		puts("FAIL: chacha20 test vector");
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	int fails = check_chacha_vector();
+
+	fails += check(GEN_RC4, 1);
+	fails += check(GEN_RC4, 8);
+	fails += check(GEN_CHACHA, 8);
+	fails += check(GEN_CHACHA, 20);
+	fails += check(GEN_XOSHIRO, 0);
+	fails += check_key_bytes(GEN_RC4, 1);
+	fails += check_key_bytes(GEN_CHACHA, 20);
+	fails += check_key_bytes(GEN_XOSHIRO, 0);
+
+	printf("%s: generators match across kernels and chunking\n",
+		   fails ? "FAIL" : "OK");
+	return fails != 0;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef GEN_H_
+#define GEN_H_
+
+#include <stdlib.h>
+
+#include "rc4.h"
+#include "chacha.h"
+#include "xoshiro.h"
+
+/* Keystream generator backends shred and spin can run on.  Every backend
+ * continues its stream across calls, can have more key mixed in, and can
+ * take over another generator's key while keeping its own stream position
+ * (which is how a prepared rekey is swapped in).
+ */
+enum gen_type {
+    GEN_RC4,
+    GEN_CHACHA,
+    GEN_XOSHIRO,
+};
+
+struct gen {
+    enum gen_type type;
+    int param;                  /* RC4 lanes or ChaCha rounds */
+    union {
+        struct {
+            struct rc4_ctx ctx;
+            struct rc4_lanes *lanes;
+        } rc4;
+        struct chacha_ctx chacha;
+        struct xoshiro_ctx xoshiro;
+    } u;
+};
+
+int gen_parse(const char *name, enum gen_type *type, int *param);
+struct gen *gen_new(enum gen_type type, int param,
+                    unsigned char *seed, size_t slen);
+struct gen *gen_copy(struct gen *src);
+void gen_free(struct gen *g);
+void gen_reseed(struct gen *g, unsigned char *key, size_t klen);
+void gen_load_key(struct gen *dst, struct gen *src);
+void gen_fill(struct gen *g, unsigned char *buf, size_t n);
+void gen_xor(struct gen *g, unsigned char *buf, size_t n);
+const char *gen_describe(enum gen_type type, int param, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,217 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+/****************************************************************************
+ * kbench.c -- measure how fast the keystream kernels go
+ *
+ *	Runs the fill and XOR of every generator (serial RC4, RC4 with 4, 8 and
+ *	16 lanes, ChaCha 8/12/20 and xoshiro) over a range of buffer sizes and
+ *	prints the rate in bytes per cycle (TSC cycles on x86, nanoseconds
+ *	elsewhere) and MB/s, as a table, CSV or JSON.
+ *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "gen.h"
+#include "cmdlineparse.h"
+
+enum { FMT_TABLE, FMT_CSV, FMT_JSON };
+
+static size_t total = (size_t)1 << 25;
+static size_t only_size = 0;
+static int format = FMT_TABLE;
+static int rows = 0;
+
+static const struct engine	{
+	const char *name;
+	enum gen_type type;
+	int param;
+} engines[] = {
+	{ "rc4", GEN_RC4, 1 },
+	{ "rc4-lanes4", GEN_RC4, 4 },
+	{ "rc4-lanes8", GEN_RC4, 8 },
+	{ "rc4-lanes16", GEN_RC4, 16 },
+	{ "chacha8", GEN_CHACHA, 8 },
+	{ "chacha12", GEN_CHACHA, 12 },
+	{ "chacha20", GEN_CHACHA, 20 },
+	{ "xoshiro", GEN_XOSHIRO, 0 },
+};
+
+static const size_t sizes[] = { 64, 512, 4096, 65536, 1 << 20 };
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1000000000.0;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+static void print_row(const struct engine *e, const char *kernel,
+					  const char *op, size_t bufsize, size_t bytes,
+					  double secs, uint64_t cyc)
+{
+	double bpc = (double)bytes / cyc, mbs = bytes / secs / 1000000.0;
+
+	switch(format)	{
+		case FMT_CSV:
+			printf("kernel,%s,%s,%s,%zu,%zu,%.6f,%.4f,%.1f\n", e->name, kernel,
+				   op, bufsize, bytes, secs, bpc, mbs);
+			break;
+		case FMT_JSON:
+			printf("%s  {\"suite\": \"kernel\", \"engine\": \"%s\", "
+				   "\"impl\": \"%s\", \"op\": \"%s\", \"bufsize\": %zu, "
+				   "\"bytes\": %zu, \"seconds\": %.6f, \"bytes_per_cycle\": "
+				   "%.4f, \"mb_s\": %.1f}", rows ? ",\n" : "", e->name,
+				   kernel, op, bufsize, bytes, secs, bpc, mbs);
+			break;
+		default:
+			printf("%-12s %-8s %-4s %8zu %10.4f %10.1f\n", e->name, kernel,
+				   op, bufsize, bpc, mbs);
+	}
+	rows++;
+}
+
+/* Time @op over @total bytes of @bufsize chunks with engine @e */
+static void run(const struct engine *e, const char *op, size_t bufsize,
+				unsigned char *buf)
+{
+	struct gen *g;
+	uint64_t c0, c1;
+	double t0, t1;
+	size_t done;
+	char kernel[64], *p;
+
+	g = gen_new(e->type, e->param, (unsigned char *)"kbench", 6);
+	if(g == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 0, bufsize);
+
+	t0 = now();
+	c0 = cycles();
+	for(done = 0; done < total; done += bufsize)	{
+		if(op[0] == 'x')
+			gen_xor(g, buf, bufsize);
+		else
+			gen_fill(g, buf, bufsize);
+	}
+	c1 = cycles();
+	t1 = now();
+
+	/* Just the kernel in brackets out of the description */
+	gen_describe(e->type, e->param, kernel, sizeof(kernel));
+	if((p = strchr(kernel, '(')) != NULL && e->type != GEN_RC4)	{
+		memmove(kernel, p + 1, strlen(p + 1) + 1);
+		kernel[strcspn(kernel, ")")] = '\0';
+	} else {
+		strcpy(kernel, "scalar");
+	}
+
+	print_row(e, kernel, op, bufsize, done, t1 - t0, c1 - c0);
+	gen_free(g);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *ops[] = { "fill", "xor" };
+	unsigned char *buf;
+	const char *only = NULL;
+	size_t e, s, o;
+	int c;
+
+	while((c=getopt(argc, argv, "hcjb:n:e:")) != -1)	{
+		switch(c)	{
+			case 'b':
+				only_size = parse_num(c);
+				break;
+			case 'n':
+				total = parse_num(c);
+				break;
+			case 'e':
+				only = optarg;
+				break;
+			case 'c':
+				format = FMT_CSV;
+				break;
+			case 'j':
+				format = FMT_JSON;
+				break;
+			case 'h':
+				fprintf(stderr,
+"Usage: %s [OPTION]\n\
+  Options:\n\
+    -b  only this buffer size, default sweeps 64 bytes to 1m\n\
+    -n  total bytes to generate per measurement, default 32m\n\
+    -e  only this engine (rc4, rc4-lanes8, chacha20, xoshiro, ...)\n\
+    -c  CSV output\n\
+    -j  JSON output\n\
+", argv[0]);
+				exit(EXIT_SUCCESS);
+			default:
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if((buf = malloc(only_size ? only_size : sizes[4])) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if(format == FMT_CSV)
+		puts("suite,engine,impl,op,bufsize,bytes,seconds,"
+			 "bytes_per_cycle,mb_s");
+	else if(format == FMT_JSON)
+		puts("[");
+	else
+		printf("%-12s %-8s %-4s %8s %10s %10s\n", "engine", "impl", "op",
+			   "bufsize",
+#ifdef HAVE_TSC
+			   "B/cycle",
+#else
+			   "B/ns",
+#endif
+			   "MB/s");
+
+	for(e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)	{
+		if(only != NULL && strcmp(only, engines[e].name))
+			continue;
+		for(o = 0; o < 2; o++)	{
+			for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)	{
+				if(only_size && s > 0)
+					break;
+				run(&engines[e], ops[o], only_size ? only_size : sizes[s],
+					buf);
+			}
+		}
+	}
+
+	if(format == FMT_JSON)
+		puts("\n]");
+
+	free(buf);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,241 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#endif
+
+#include "mem.h"
+
+#define HUGE_PAGE	(2UL * 1024 * 1024)
+
+__thread int mem_thread_node = -1;
+
+static enum mem_pages mem_pages = MEM_PAGES_NORMAL;
+
+/* Every live mapping, to find the start and length again on free */
+static struct mapping	{
+	struct mapping *next;
+	void *buf;
+	void *base;
+	size_t len;
+} *mappings = NULL;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* "normal", "thp" or "hugetlb", 0 if @name is one of them */
+int mem_parse_pages(const char *name, enum mem_pages *pages)
+{
+	if(!strcmp(name, "normal"))
+		*pages = MEM_PAGES_NORMAL;
+	else if(!strcmp(name, "thp"))
+		*pages = MEM_PAGES_THP;
+	else if(!strcmp(name, "hugetlb"))
+		*pages = MEM_PAGES_HUGETLB;
+	else
+		return -1;
+	return 0;
+}
+
+/* Use @pages for the buffers allocated from here on */
+void mem_set_pages(enum mem_pages pages)
+{
+	mem_pages = pages;
+}
+
+/* Prefer NUMA node @node for [@p, @p + @len), it is only a preference so
+ * a full node spills over rather than failing the allocation
+ */
+static void prefer_node(void *p, size_t len, int node)
+{
+#if defined(SYS_mbind) && defined(MPOL_PREFERRED)
+	unsigned long mask[4] = { 0 };
+
+	if(node < 0 || node >= (int)(sizeof(mask) * 8))
+		return;
+	mask[node / (sizeof(long) * 8)] = 1UL << (node % (sizeof(long) * 8));
+	syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1, 0);
+#else
+	(void)p;
+	(void)len;
+	(void)node;
+#endif
+}
+
+/* Map @size bytes aligned to @align and placed on @node (-1 for wherever
+ * the first touch is), NULL on failure
+ */
+void *alloc_buffer_on(size_t size, size_t align, int node)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	static bool warned = false;
+	struct mapping *m;
+	size_t len;
+	char *base, *buf;
+
+	if(page > 0 && align < (size_t)page)
+		align = page;
+	if((m = malloc(sizeof(*m))) == NULL)
+		return NULL;
+
+	base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if(mem_pages == MEM_PAGES_HUGETLB && align <= HUGE_PAGE)	{
+		len = (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+		base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(base == MAP_FAILED && !warned)	{
+			warned = true;
+			perror("No huge pages (vm.nr_hugepages), using transparent ones");
+		}
+	}
+#endif
+	if(base != MAP_FAILED)	{
+		buf = base;
+	} else {
+		/* Room to slide up to the alignment, to a huge page for THP */
+		if(mem_pages != MEM_PAGES_NORMAL && align < HUGE_PAGE &&
+		   size >= HUGE_PAGE / 2)
+			align = HUGE_PAGE;
+		len = size + align - page;
+		base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(base == MAP_FAILED)	{
+			free(m);
+			return NULL;
+		}
+		buf = base + ((align - (size_t)base % align) % align);
+#ifdef MADV_HUGEPAGE
+		if(mem_pages != MEM_PAGES_NORMAL)
+			madvise(buf, size, MADV_HUGEPAGE);
+#endif
+	}
+	prefer_node(base, len, node);
+
+	m->buf = buf;
+	m->base = base;
+	m->len = len;
+	pthread_mutex_lock(&mappings_lock);
+	m->next = mappings;
+	mappings = m;
+	pthread_mutex_unlock(&mappings_lock);
+	return buf;
+}
+
+void free_buffer(void *p)
+{
+	struct mapping **mp, *m = NULL;
+
+	if(p == NULL)
+		return;
+
+	pthread_mutex_lock(&mappings_lock);
+	for(mp = &mappings; *mp != NULL; mp = &(*mp)->next)	{
+		if((*mp)->buf == p)	{
+			m = *mp;
+			*mp = m->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mappings_lock);
+
+	if(m == NULL)	{
+		fputs("free_buffer() of a buffer not from alloc_buffer()\n", stderr);
+		abort();
+	}
+	munmap(m->base, m->len);
+	free(m);
+}
+
+/* Parse a CPU list such as "0-3,8,10-11" into a new array in *@cpus,
+ * returns its length or -1 if @spec doesn't parse
+ */
+int parse_cpu_list(const char *spec, int **cpus)
+{
+	const char *s = spec;
+	int n = 0, cap = 0, *l = NULL, *grown;
+	long lo, hi;
+	char *end;
+
+	while(*s != '\0')	{
+		lo = hi = strtol(s, &end, 10);
+		if(end == s || lo < 0)
+			goto bad;
+		if(*end == '-')	{
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+			if(end == s || hi < lo)
+				goto bad;
+		}
+		for(; lo <= hi; lo++)	{
+			if(n == cap)	{
+				cap = (cap) ? cap * 2 : 16;
+				if((grown = realloc(l, cap * sizeof(int))) == NULL)
+					goto bad;
+				l = grown;
+			}
+			l[n++] = lo;
+		}
+		if(*end == ',')
+			end++;
+		else if(*end != '\0')
+			goto bad;
+		s = end;
+	}
+	if(n == 0)
+		goto bad;
+	*cpus = l;
+	return n;
+
+bad:
+	free(l);
+	return -1;
+}
+
+/* NUMA node of @cpu as sysfs has it, -1 if unknown */
+int cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *e;
+	DIR *d;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if((d = opendir(path)) == NULL)
+		return -1;
+	while((e = readdir(d)) != NULL)
+		if(!strncmp(e->d_name, "node", 4) &&
+		   sscanf(e->d_name + 4, "%d", &node) == 1)
+			break;
+	closedir(d);
+	return node;
+}
+
+/* Run the calling thread on @cpu only and allocate its buffers on that
+ * CPU's node from now on, -1 with errno set on failure
+ */
+int pin_thread(int cpu)
+{
+	cpu_set_t set;
+
+	if(cpu < 0 || cpu >= CPU_SETSIZE)	{
+		errno = EINVAL;
+		return -1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof(set), &set) != 0)
+		return -1;
+	mem_thread_node = cpu_node(cpu);
+	return 0;
+}
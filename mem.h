@@ -0,0 +1,34 @@
+#ifndef MEM_H_
+#define MEM_H_
+
+#include <stdlib.h>
+
+/* Where keystream buffers come from.  Every buffer is its own anonymous
+ * mapping, of normal pages, transparent huge pages or MAP_HUGETLB pages
+ * (falling back on THP when none are reserved), and preferably on the NUMA
+ * node given or else the one of the CPU the allocating thread was pinned
+ * to with pin_thread().  Buffers are freed with free_buffer().
+ */
+enum mem_pages	{ MEM_PAGES_NORMAL, MEM_PAGES_THP, MEM_PAGES_HUGETLB };
+
+extern __thread int mem_thread_node;
+
+int mem_parse_pages(const char *name, enum mem_pages *pages);
+void mem_set_pages(enum mem_pages pages);
+
+void *alloc_buffer_on(size_t size, size_t align, int node);
+void free_buffer(void *p);
+
+/* Allocate @size bytes aligned to @align (at least a page) so the buffer can
+ * be handed to O_DIRECT or registered with the kernel, NULL on failure
+ */
+static inline void *alloc_buffer(size_t size, size_t align)
+{
+	return alloc_buffer_on(size, align, mem_thread_node);
+}
+
+int parse_cpu_list(const char *spec, int **cpus);
+int cpu_node(int cpu);
+int pin_thread(int cpu);
+
+#endif
@@ -0,0 +1,305 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+#define MAX_WATCH	256
+/* Report every this many 100ms ticks, and weight of the newest second */
+#define REPORT_TICKS	10
+#define EWMA_WEIGHT		0.25
+
+struct metrics metrics;
+__thread struct metrics metrics_local;
+__thread uint64_t metrics_flushed;
+bool metrics_any_written = false;
+
+static const unsigned long *stalls[MAX_WATCH];
+static int nr_stalls = 0;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t reporter;
+static pthread_mutex_t tick_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tick_wake = PTHREAD_COND_INITIALIZER;
+static bool running = false;
+static bool status = false;
+static FILE *json = NULL;
+static volatile sig_atomic_t report_now = 0;
+/* Bytes the whole run will write when known up front, 0 if not */
+static uint64_t expected = 0;
+/* CLOCK_MONOTONIC ns when the first write completed, 0 before */
+static uint64_t first_write = 0;
+
+/* What the counters were at the last report */
+static struct snapshot	{
+	uint64_t ns;
+	uint64_t ticks;
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t lat[METRICS_BUCKETS];
+	uint64_t gen_ticks;
+	uint64_t write_ticks;
+} prev;
+
+static void sigusr1_handler(int signum)
+{
+	(void)signum;
+	report_now = 1;
+}
+
+static void take_snapshot(struct snapshot *s)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	s->ns = (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+	s->ticks = metrics_clock();
+	s->bytes = __atomic_load_n(&metrics.bytes, __ATOMIC_RELAXED);
+	s->writes = __atomic_load_n(&metrics.writes, __ATOMIC_RELAXED);
+	s->gen_ticks = __atomic_load_n(&metrics.gen_ticks, __ATOMIC_RELAXED);
+	s->write_ticks = __atomic_load_n(&metrics.write_ticks, __ATOMIC_RELAXED);
+	for(int k = 0; k < METRICS_BUCKETS; k++)
+		s->lat[k] = __atomic_load_n(&metrics.lat[k], __ATOMIC_RELAXED);
+}
+
+/* Upper bound in ticks of the bucket the @q quantile falls in */
+static double percentile(const uint64_t *hist, uint64_t n, double q)
+{
+	uint64_t seen = 0;
+	int k;
+
+	if(n == 0)
+		return 0;
+	for(k = 0; k < METRICS_BUCKETS - 1; k++)	{
+		seen += hist[k];
+		if(seen >= q * n)
+			break;
+	}
+	return (double)(2ull << k);
+}
+
+static void report(bool to_stderr, double *ewma)
+{
+	struct snapshot cur;
+	uint64_t hist[METRICS_BUCKETS], writes;
+	unsigned long st, total_stalls = 0;
+	double dt, ticks, us, mb_s, p50, p99, max, gen_pct, write_pct;
+	uint64_t goal = __atomic_load_n(&expected, __ATOMIC_RELAXED);
+	char line[320];
+	size_t len;
+
+	take_snapshot(&cur);
+	max = __atomic_exchange_n(&metrics.lat_max, 0, __ATOMIC_RELAXED);
+
+	dt = (cur.ns - prev.ns) / 1000000000.0;
+	ticks = cur.ticks - prev.ticks;
+	if(dt <= 0 || ticks <= 0)
+		return;
+	/* Ticks in a microsecond, measured over this interval */
+	us = ticks / dt / 1000000.0;
+
+	writes = cur.writes - prev.writes;
+	for(int k = 0; k < METRICS_BUCKETS; k++)
+		hist[k] = cur.lat[k] - prev.lat[k];
+
+	mb_s = (cur.bytes - prev.bytes) / dt / 1000000.0;
+	*ewma = (*ewma < 0) ? mb_s : *ewma + EWMA_WEIGHT * (mb_s - *ewma);
+	p50 = percentile(hist, writes, 0.50) / us;
+	p99 = percentile(hist, writes, 0.99) / us;
+	max /= us;
+	gen_pct = 100.0 * (cur.gen_ticks - prev.gen_ticks) / ticks;
+	write_pct = 100.0 * (cur.write_ticks - prev.write_ticks) / ticks;
+
+	pthread_mutex_lock(&watch_lock);
+	for(int i = 0; i < nr_stalls; i++)
+		total_stalls += __atomic_load_n(stalls[i], __ATOMIC_RELAXED);
+
+	snprintf(line, sizeof(line),
+			 "%.3f Mb, %.2f Mb/s (avg %.2f), write p50 %.1fus p99 %.1fus "
+			 "max %.1fus, gen %.0f%% write %.0f%%, stalls %lu",
+			 cur.bytes / 1000000.0, mb_s, *ewma, p50, p99, max,
+			 gen_pct, write_pct, total_stalls);
+	len = strlen(line);
+	if(goal > 0)
+		snprintf(line + len, sizeof(line) - len, ", %.1f%% of %.3f Mb, eta %.0fs",
+				 100.0 * cur.bytes / goal, goal / 1000000.0,
+				 (*ewma > 0 && cur.bytes < goal) ?
+				 (goal - cur.bytes) / 1000000.0 / *ewma : 0);
+	if(status)
+		fprintf(stderr, "%-150s\r", line);
+	if(to_stderr)
+		fprintf(stderr, "%s\n", line);
+
+	if(json != NULL)	{
+		fprintf(json, "{\"bytes\": %llu, \"mb_s\": %.2f, \"ewma_mb_s\": %.2f, "
+				"\"writes\": %llu, \"lat_us\": {\"p50\": %.1f, \"p99\": %.1f, "
+				"\"max\": %.1f}, \"gen_pct\": %.1f, \"write_pct\": %.1f, ",
+				(unsigned long long)cur.bytes, mb_s, *ewma,
+				(unsigned long long)writes, p50, p99, max, gen_pct, write_pct);
+		if(goal > 0)
+			fprintf(json, "\"total\": %llu, \"pct\": %.1f, \"stalls\": [",
+					(unsigned long long)goal, 100.0 * cur.bytes / goal);
+		else
+			fputs("\"stalls\": [", json);
+		for(int i = 0; i < nr_stalls; i++)	{
+			st = __atomic_load_n(stalls[i], __ATOMIC_RELAXED);
+			fprintf(json, "%s%lu", (i > 0) ? ", " : "", st);
+		}
+		fputs("]}\n", json);
+		fflush(json);
+	}
+	pthread_mutex_unlock(&watch_lock);
+
+	prev = cur;
+}
+
+static void *metrics_thread(void *arg)
+{
+	struct timespec until;
+	double ewma = -1;
+	int ticks = 0;
+
+	(void)arg;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	pthread_mutex_lock(&tick_lock);
+	while(running)	{
+		/* Sleep a tick, metrics_stop() wakes us early */
+		if((until.tv_nsec += 100000000) >= 1000000000)	{
+			until.tv_nsec -= 1000000000;
+			until.tv_sec++;
+		}
+		pthread_cond_timedwait(&tick_wake, &tick_lock, &until);
+		if(!running)	{
+			/* The last line has everything, the threads have flushed */
+			if(status || json != NULL)
+				report(false, &ewma);
+			break;
+		}
+
+		if(report_now)	{
+			report_now = 0;
+			report(true, &ewma);
+			ticks = 0;
+		} else if(++ticks == REPORT_TICKS)	{
+			if(status || json != NULL)
+				report(false, &ewma);
+			ticks = 0;
+		}
+	}
+	pthread_mutex_unlock(&tick_lock);
+	return NULL;
+}
+
+/* Add what this thread counted since the last flush to the shared counters,
+ * timestamping the first write of the run
+ */
+void metrics_flush(uint64_t now)
+{
+	struct metrics *m = &metrics_local;
+	uint64_t max = __atomic_load_n(&metrics.lat_max, __ATOMIC_RELAXED);
+
+	if(m->bytes > 0 && __atomic_load_n(&first_write, __ATOMIC_RELAXED) == 0)	{
+		struct timespec t;
+		uint64_t none = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		__atomic_compare_exchange_n(&first_write, &none,
+									(uint64_t)t.tv_sec * 1000000000u + t.tv_nsec,
+									false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		__atomic_store_n(&metrics_any_written, true, __ATOMIC_RELAXED);
+	}
+
+	__atomic_fetch_add(&metrics.bytes, m->bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&metrics.writes, m->writes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&metrics.gen_ticks, m->gen_ticks, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&metrics.write_ticks, m->write_ticks, __ATOMIC_RELAXED);
+	for(int k = 0; k < METRICS_BUCKETS; k++)
+		if(m->lat[k] != 0)
+			__atomic_fetch_add(&metrics.lat[k], m->lat[k], __ATOMIC_RELAXED);
+	while(m->lat_max > max &&
+		  !__atomic_compare_exchange_n(&metrics.lat_max, &max, m->lat_max,
+						true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	memset(m, 0, sizeof(*m));
+	metrics_flushed = now;
+}
+
+/* Start reporting: a status line on stderr with @status_line, JSON records
+ * to @json_fd unless it is -1, and a line on stderr at every SIGUSR1
+ */
+int metrics_start(int json_fd, bool status_line)
+{
+	struct sigaction new_action;
+
+	if(json_fd >= 0 && (json = fdopen(json_fd, "w")) == NULL)
+		return -1;
+	status = status_line;
+
+	memset(&new_action, 0, sizeof(new_action));
+	new_action.sa_handler = sigusr1_handler;
+	sigemptyset(&new_action.sa_mask);
+	sigaction(SIGUSR1, &new_action, NULL);
+
+	take_snapshot(&prev);
+	running = true;
+	if(pthread_create(&reporter, NULL, metrics_thread, NULL) != 0)	{
+		running = false;
+		return -1;
+	}
+	return 0;
+}
+
+/* Include *@counter, a thread's stall count, in the reports */
+void metrics_watch_stalls(const unsigned long *counter)
+{
+	pthread_mutex_lock(&watch_lock);
+	if(nr_stalls < MAX_WATCH)
+		stalls[nr_stalls++] = counter;
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/* The watched counters are going away */
+void metrics_forget_stalls(void)
+{
+	pthread_mutex_lock(&watch_lock);
+	nr_stalls = 0;
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/* Flush the caller's counts, the workers have flushed theirs and exited,
+ * and stop the reporter after a last report
+ */
+void metrics_stop(void)
+{
+	metrics_flush(metrics_clock());
+	pthread_mutex_lock(&tick_lock);
+	if(!running)	{
+		pthread_mutex_unlock(&tick_lock);
+		return;
+	}
+	running = false;
+	pthread_cond_signal(&tick_wake);
+	pthread_mutex_unlock(&tick_lock);
+	pthread_join(reporter, NULL);
+	if(status)
+		fputc('\n', stderr);
+	if(json != NULL)
+		fclose(json);
+	json = NULL;
+}
+
+/* The run will write @bytes in all, report progress against that */
+void metrics_set_total(uint64_t bytes)
+{
+	__atomic_store_n(&expected, bytes, __ATOMIC_RELAXED);
+}
+
+/* When the first write of the run completed, CLOCK_MONOTONIC ns, 0 if none */
+uint64_t metrics_first_write(void)
+{
+	return __atomic_load_n(&first_write, __ATOMIC_RELAXED);
+}
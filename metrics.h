@@ -0,0 +1,94 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/* Live counters every writer and generator bumps, a reporter thread turns
+ * them into a status line, JSON records on a side fd and a report on
+ * SIGUSR1 once per second.  Times are in ticks of metrics_clock(), TSC
+ * cycles on x86 and nanoseconds elsewhere, the reporter scales them against
+ * CLOCK_MONOTONIC.  Write latencies go in log2 buckets of ticks, bucket k
+ * holding [2^k, 2^(k+1)).
+ */
+#define METRICS_BUCKETS	64
+
+struct metrics	{
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t lat[METRICS_BUCKETS];
+	uint64_t lat_max;		/* since the last report */
+	uint64_t gen_ticks;		/* time spent generating, summed over threads */
+	uint64_t write_ticks;	/* and waiting on writes */
+};
+
+/* Every thread counts into its own copy and adds it to the shared one
+ * every METRICS_FLUSH_TICKS (a few ms), the hot path never touches a
+ * shared line.  Threads flush once more as they finish, metrics_stop()
+ * for the one calling it.
+ */
+#define METRICS_FLUSH_TICKS	(1u << 24)
+
+extern struct metrics metrics;
+extern __thread struct metrics metrics_local;
+extern __thread uint64_t metrics_flushed;
+extern bool metrics_any_written;
+
+void metrics_flush(uint64_t now);
+
+static inline uint64_t metrics_clock(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+#endif
+}
+
+/* A write of @bytes issued at @start has completed, returns the time */
+static inline uint64_t metrics_wrote(size_t bytes, uint64_t start)
+{
+	uint64_t now = metrics_clock(), t = now - start;
+	struct metrics *m = &metrics_local;
+
+	m->bytes += bytes;
+	m->writes++;
+	m->write_ticks += t;
+	m->lat[63 - __builtin_clzll(t | 1)]++;
+	if(t > m->lat_max)
+		m->lat_max = t;
+	/* The first write of the run flushes at once, to be timestamped */
+	if(now - metrics_flushed > METRICS_FLUSH_TICKS || !metrics_any_written)
+		metrics_flush(now);
+	return now;
+}
+
+/* Keystream generation started at @start is done, returns the time */
+static inline uint64_t metrics_generated(uint64_t start)
+{
+	uint64_t now = metrics_clock();
+
+	metrics_local.gen_ticks += now - start;
+	if(now - metrics_flushed > METRICS_FLUSH_TICKS)
+		metrics_flush(now);
+	return now;
+}
+
+int metrics_start(int json_fd, bool status_line);
+void metrics_watch_stalls(const unsigned long *counter);
+void metrics_forget_stalls(void);
+void metrics_set_total(uint64_t bytes);
+uint64_t metrics_first_write(void);
+void metrics_stop(void);
+
+#endif
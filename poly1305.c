@@ -0,0 +1,224 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "poly1305.h"
+
+__extension__ typedef unsigned __int128 u128;
+
+#define MASK44	0xfffffffffffULL
+#define MASK42	0x3ffffffffffULL
+
+static uint64_t load64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for(i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static void store64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for(i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+void poly1305_init(struct poly1305_ctx *ctx, const unsigned char *key)
+{
+	uint64_t t0 = load64(key), t1 = load64(key + 8);
+
+	/* r with the bits RFC 8439 clamps cleared, in 44/44/42 bit limbs */
+	ctx->r[0] = t0 & 0xffc0fffffffULL;
+	ctx->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+	ctx->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+
+	ctx->h[0] = ctx->h[1] = ctx->h[2] = 0;
+	ctx->pad[0] = load64(key + 16);
+	ctx->pad[1] = load64(key + 24);
+	ctx->leftover = 0;
+	ctx->final = 0;
+}
+
+/* h = (h + m) * r mod 2^130 - 5 for every whole 16 byte block of @m */
+static void blocks(struct poly1305_ctx *ctx, const unsigned char *m,
+				   size_t bytes)
+{
+	const uint64_t hibit = ctx->final ? 0 : (uint64_t)1 << 40;
+	uint64_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+	uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+	uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+	uint64_t t0, t1, c;
+	u128 d0, d1, d2;
+
+	while(bytes >= 16)	{
+		t0 = load64(m);
+		t1 = load64(m + 8);
+
+		h0 += t0 & MASK44;
+		h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+		h2 += ((t1 >> 24) & MASK42) | hibit;
+
+		d0 = (u128)h0 * r0 + (u128)h1 * s2 + (u128)h2 * s1;
+		d1 = (u128)h0 * r1 + (u128)h1 * r0 + (u128)h2 * s2;
+		d2 = (u128)h0 * r2 + (u128)h1 * r1 + (u128)h2 * r0;
+
+		c = (uint64_t)(d0 >> 44);
+		h0 = (uint64_t)d0 & MASK44;
+		d1 += c;
+		c = (uint64_t)(d1 >> 44);
+		h1 = (uint64_t)d1 & MASK44;
+		d2 += c;
+		c = (uint64_t)(d2 >> 42);
+		h2 = (uint64_t)d2 & MASK42;
+		h0 += c * 5;
+		c = h0 >> 44;
+		h0 &= MASK44;
+		h1 += c;
+
+		m += 16;
+		bytes -= 16;
+	}
+
+	ctx->h[0] = h0;
+	ctx->h[1] = h1;
+	ctx->h[2] = h2;
+}
+
+void poly1305_update(struct poly1305_ctx *ctx, const unsigned char *m,
+					 size_t bytes)
+{
+	size_t want;
+
+	if(ctx->leftover)	{
+		want = 16 - ctx->leftover;
+		if(want > bytes)
+			want = bytes;
+		memcpy(ctx->buffer + ctx->leftover, m, want);
+		bytes -= want;
+		m += want;
+		ctx->leftover += want;
+		if(ctx->leftover < 16)
+			return;
+		blocks(ctx, ctx->buffer, 16);
+		ctx->leftover = 0;
+	}
+
+	if(bytes >= 16)	{
+		want = bytes & ~(size_t)15;
+		blocks(ctx, m, want);
+		m += want;
+		bytes -= want;
+	}
+
+	if(bytes)	{
+		memcpy(ctx->buffer, m, bytes);
+		ctx->leftover = bytes;
+	}
+}
+
+void poly1305_finish(struct poly1305_ctx *ctx, unsigned char *mac)
+{
+	uint64_t h0, h1, h2, g0, g1, g2, t0, t1, c;
+
+	/* A short last block is padded with a 1 byte and zeros */
+	if(ctx->leftover)	{
+		ctx->buffer[ctx->leftover++] = 1;
+		memset(ctx->buffer + ctx->leftover, 0, 16 - ctx->leftover);
+		ctx->final = 1;
+		blocks(ctx, ctx->buffer, 16);
+	}
+
+	h0 = ctx->h[0];
+	h1 = ctx->h[1];
+	h2 = ctx->h[2];
+
+	/* Carry all the way through */
+	c = h1 >> 44; h1 &= MASK44;
+	h2 += c; c = h2 >> 42; h2 &= MASK42;
+	h0 += c * 5; c = h0 >> 44; h0 &= MASK44;
+	h1 += c; c = h1 >> 44; h1 &= MASK44;
+	h2 += c; c = h2 >> 42; h2 &= MASK42;
+	h0 += c * 5; c = h0 >> 44; h0 &= MASK44;
+	h1 += c;
+
+	/* g = h - p, and take it instead of h unless it went negative */
+	g0 = h0 + 5; c = g0 >> 44; g0 &= MASK44;
+	g1 = h1 + c; c = g1 >> 44; g1 &= MASK44;
+	g2 = h2 + c - ((uint64_t)1 << 42);
+
+	c = (g2 >> 63) - 1;
+	g0 &= c;
+	g1 &= c;
+	g2 &= c;
+	c = ~c;
+	h0 = (h0 & c) | g0;
+	h1 = (h1 & c) | g1;
+	h2 = (h2 & c) | g2;
+
+	/* mac = (h + pad) mod 2^128 */
+	t0 = ctx->pad[0];
+	t1 = ctx->pad[1];
+	h0 += t0 & MASK44; c = h0 >> 44; h0 &= MASK44;
+	h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c; c = h1 >> 44; h1 &= MASK44;
+	h2 += ((t1 >> 24) & MASK42) + c; h2 &= MASK42;
+
+	store64(mac, h0 | (h1 << 44));
+	store64(mac + 8, (h1 >> 20) | (h2 << 24));
+
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+/* 0 if tags @a and @b match, compared in constant time */
+int poly1305_verify(const unsigned char *a, const unsigned char *b)
+{
+	unsigned char d = 0;
+	int i;
+
+	for(i = 0; i < POLY1305_TAG; i++)
+		d |= a[i] ^ b[i];
+	return (d == 0) ? 0 : -1;
+}
+
+
+#ifdef TEST
+
+/* RFC 8439 section 2.5.2, then the same message fed in every split */
+int main(void)
+{
+	static const unsigned char key[POLY1305_KEY] = {
+		0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+		0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+		0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+		0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b
+	};
+	static const unsigned char want[POLY1305_TAG] = {
+		0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+		0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9
+	};
+	const char *msg = "Cryptographic Forum Research Group";
+	size_t len = strlen(msg), split;
+	struct poly1305_ctx ctx;
+	unsigned char mac[POLY1305_TAG];
+	int fails = 0;
+
+	for(split = 0; split <= len; split++)	{
+		poly1305_init(&ctx, key);
+		poly1305_update(&ctx, (const unsigned char *)msg, split);
+		poly1305_update(&ctx, (const unsigned char *)msg + split, len - split);
+		poly1305_finish(&ctx, mac);
+		if(poly1305_verify(mac, want) != 0)	{
+			printf("FAIL: tag differs when split at %zu\n", split);
+			fails++;
+		}
+	}
+
+	printf("%s: Poly1305 matches RFC 8439\n", fails ? "FAIL" : "OK");
+	return fails != 0;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef POLY1305_H_
+#define POLY1305_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Poly1305 one-time authenticator (RFC 8439) on 44-bit limbs with 64x64
+ * bit multiplies.  A key must never authenticate more than one message.
+ */
+#define POLY1305_KEY    32
+#define POLY1305_TAG    16
+
+struct poly1305_ctx {
+    uint64_t r[3], h[3], pad[2];
+    size_t leftover;
+    unsigned char buffer[16];
+    unsigned char final;
+};
+
+void poly1305_init(struct poly1305_ctx *ctx, const unsigned char *key);
+void poly1305_update(struct poly1305_ctx *ctx, const unsigned char *m,
+                     size_t bytes);
+void poly1305_finish(struct poly1305_ctx *ctx, unsigned char *mac);
+int poly1305_verify(const unsigned char *a, const unsigned char *b);
+
+#endif
@@ -0,0 +1,186 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ratelimit.h"
+
+/* The buckets hold at most this much of a second's allowance */
+#define BURST			0.1
+/* Latency is looked at this often, and the byte rate cut to CUT of what it
+ * was while it is over the target, or raised by STEP of the cap (or of the
+ * rate before the first cut) every time it isn't.  Cuts stop at 1/FLOOR of
+ * that rate: latency that doesn't come down by then isn't ours to fix, and
+ * stalling would only keep the device busy for longer.
+ */
+#define ADJUST_NS		100000000
+#define CUT				0.7
+#define STEP			0.05
+#define FLOOR			16
+#define MIN_RATE		65536.0
+/* Long waits are slept this much at a time, to see *stop get set */
+#define SLICE_NS		50000000
+
+bool rate_on = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double cap_bytes = 0, cap_writes = 0;	/* 0 is no cap */
+static double byte_rate = 0, write_rate = 0;	/* in force now */
+static double byte_tokens = 0, write_tokens = 0;
+static uint64_t last_refill = 0;
+
+static double target_ns = 0;
+static double lat_ewma = 0;
+static double peak = 0;			/* the rate the backoff climbs back to */
+static uint64_t window_start = 0;
+static size_t window_bytes = 0;
+static unsigned long cuts = 0;
+
+static uint64_t slept_ns = 0;
+static const bool *stopping = NULL;
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+/* Limit writes to @bytes_per_sec and @writes_per_sec (0 for no limit) and
+ * back off while the average write takes longer than @target_us (0 to not).
+ * A wait is cut short once *@stop (if not NULL) is set.
+ */
+void rate_init(double bytes_per_sec, double writes_per_sec, double target_us,
+			   const bool *stop)
+{
+	stopping = stop;
+	cap_bytes = byte_rate = bytes_per_sec;
+	cap_writes = write_rate = writes_per_sec;
+	target_ns = target_us * 1000;
+
+	byte_tokens = byte_rate * BURST;
+	write_tokens = write_rate * BURST;
+	last_refill = window_start = now_ns();
+
+	rate_on = (byte_rate > 0 || write_rate > 0 || target_ns > 0);
+}
+
+static void refill(uint64_t now)
+{
+	double dt = (now - last_refill) / 1000000000.0;
+
+	last_refill = now;
+	if(byte_rate > 0)	{
+		byte_tokens += dt * byte_rate;
+		if(byte_tokens > byte_rate * BURST)
+			byte_tokens = byte_rate * BURST;
+	}
+	if(write_rate > 0)	{
+		write_tokens += dt * write_rate;
+		if(write_tokens > write_rate * BURST)
+			write_tokens = write_rate * BURST;
+	}
+}
+
+/* Take @bytes and a write out of the buckets, sleeping for as long as that
+ * puts them in debt.  Returns the time the write may start.
+ */
+uint64_t rate_take(size_t bytes)
+{
+	double wait = 0;
+	uint64_t now;
+
+	pthread_mutex_lock(&lock);
+	refill(now_ns());
+	if(byte_rate > 0)	{
+		byte_tokens -= bytes;
+		if(byte_tokens < 0)
+			wait = -byte_tokens / byte_rate;
+	}
+	if(write_rate > 0)	{
+		write_tokens -= 1;
+		if(write_tokens < 0 && -write_tokens / write_rate > wait)
+			wait = -write_tokens / write_rate;
+	}
+	pthread_mutex_unlock(&lock);
+
+	now = now_ns();
+	if(wait > 0)	{
+		uint64_t before = now, until = now + (uint64_t)(wait * 1000000000.0);
+		struct timespec t;
+
+		while(now < until &&
+			  (stopping == NULL || !__atomic_load_n(stopping, __ATOMIC_RELAXED)))	{
+			t.tv_sec = 0;
+			t.tv_nsec = (until - now < SLICE_NS) ? until - now : SLICE_NS;
+			nanosleep(&t, NULL);
+			now = now_ns();
+		}
+		__atomic_fetch_add(&slept_ns, now - before, __ATOMIC_RELAXED);
+	}
+	return now;
+}
+
+/* A write of @bytes that started at @start is done, adjust the byte rate
+ * to the latency seen over the last ADJUST_NS
+ */
+void rate_note(uint64_t start, size_t bytes)
+{
+	uint64_t now = now_ns();
+	double lat = now - start, seen;
+
+	if(target_ns <= 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	lat_ewma += (lat - lat_ewma) / 8;
+	window_bytes += bytes;
+
+	if(now - window_start >= ADJUST_NS)	{
+		seen = window_bytes * 1000000000.0 / (now - window_start);
+
+		if(lat_ewma > target_ns)	{
+			/* Unlimited so far, start from what is getting through */
+			if(byte_rate == 0)
+				byte_rate = peak = seen;
+			double floor = ((cap_bytes > 0) ? cap_bytes : peak) / FLOOR;
+
+			byte_rate *= CUT;
+			if(byte_rate < floor)
+				byte_rate = floor;
+			if(byte_rate < MIN_RATE)
+				byte_rate = MIN_RATE;
+			cuts++;
+		} else if(byte_rate > 0 && (cap_bytes == 0 || byte_rate < cap_bytes))	{
+			byte_rate += STEP * ((cap_bytes > 0) ? cap_bytes : peak);
+			if(cap_bytes > 0 && byte_rate > cap_bytes)
+				byte_rate = cap_bytes;
+			else if(cap_bytes == 0 && byte_rate >= peak)
+				byte_rate = 0;
+		}
+		window_start = now;
+		window_bytes = 0;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void rate_report(void)
+{
+	if(!rate_on)
+		return;
+	fprintf(stderr, "Rate limit: slept %.3fs, ", slept_ns / 1000000000.0);
+	if(target_ns > 0)
+		fprintf(stderr, "backed off %lu times, write latency %.0fus, ",
+				cuts, lat_ewma / 1000.0);
+	fputs("now at ", stderr);
+	if(byte_rate > 0)
+		fprintf(stderr, "%.2f Mb/s", byte_rate / 1000000.0);
+	else
+		fputs("full speed", stderr);
+	if(write_rate > 0)
+		fprintf(stderr, ", %.0f writes/s", write_rate);
+	fputc('\n', stderr);
+}
@@ -0,0 +1,29 @@
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* Token buckets for bytes and writes per second shared by every writer,
+ * plus a backoff that cuts the byte rate while the write latency is above
+ * a target and lets it climb back once it is under.  Writers call
+ * rate_take() before a write when rate_on is set, which sleeps until the
+ * buckets allow it, and rate_done() with what it returned once the write
+ * completed.
+ */
+extern bool rate_on;
+
+void rate_init(double bytes_per_sec, double writes_per_sec, double target_us,
+			   const bool *stop);
+uint64_t rate_take(size_t bytes);
+void rate_note(uint64_t start, size_t bytes);
+void rate_report(void);
+
+static inline void rate_done(uint64_t start, size_t bytes)
+{
+	if(rate_on)
+		rate_note(start, bytes);
+}
+
+#endif
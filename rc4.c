@@ -11,12 +11,14 @@ void rc4_init_key(struct rc4_ctx *ctx, unsigned char *key, size_t klen)
 
 	for(i = 0; i < 256; i++)
 		ctx->S[i] = i;
+	ctx->i = ctx->j = 0;
 
 	rc4_shuffle_key(ctx, key, klen);
 }
 
 /* Second half of the key-init algorithm, used to preserve state from
- * last call (ctx doesn't get filled 1-256 in order)
+ * last call (ctx doesn't get filled 1-256 in order).  The stream position
+ * is left alone.
  */
 void rc4_shuffle_key(struct rc4_ctx *ctx, unsigned char *k, size_t l)
 {
@@ -35,11 +37,15 @@ void rc4_shuffle_key(struct rc4_ctx *ctx, unsigned char *k, size_t l)
 /* Write @nb bytes of RC4 keystream to @buf from cipher context @ctx */
 void rc4_fill_buf(struct rc4_ctx *ctx, unsigned char *buf, size_t nb)
 {
-	unsigned char i, j, k, idx, tmp;
+	unsigned char i, j, idx, tmp;
 	unsigned char *state = ctx->S;
 	size_t n = 0;
 
-	i = j = k = 0;
+	if(nb == 0)
+		return;
+
+	i = ctx->i;
+	j = ctx->j;
 
 	do
 	{
@@ -54,16 +60,26 @@ void rc4_fill_buf(struct rc4_ctx *ctx, unsigned char *buf, size_t nb)
 
 		*(buf + n) = state[idx];
 	} while(++n < nb);
+
+	ctx->i = i;
+	ctx->j = j;
 }
 
-/* XOR a buffer with the keystream */
-void rc4_xor_stream(struct rc4_ctx *ctx, unsigned char *buf, size_t n)
+/* Write @src XORed with the keystream to @dst, which may be @src, so data
+ * can go from one mapping to another in a single pass
+ */
+void rc4_xor_copy(struct rc4_ctx *ctx, unsigned char *dst,
+				  const unsigned char *src, size_t n)
 {
-	unsigned char i, j, k, tmp;
+	unsigned char i, j, tmp;
 	unsigned char *state = ctx->S;
 	size_t ctr = 0;
 
-	i = j = k = 0;
+	if(n == 0)
+		return;
+
+	i = ctx->i;
+	j = ctx->j;
 
 	do
 	{
@@ -74,8 +90,17 @@ void rc4_xor_stream(struct rc4_ctx *ctx, unsigned char *buf, size_t n)
 		state[i] = state[j];
 		state[j] = tmp;
 
-		*(buf + ctr) ^= state[(state[i] + state[j]) & 255];
+		*(dst + ctr) = *(src + ctr) ^ state[(state[i] + state[j]) & 255];
 	} while(++ctr < n);
+
+	ctx->i = i;
+	ctx->j = j;
+}
+
+/* XOR a buffer with the keystream */
+void rc4_xor_stream(struct rc4_ctx *ctx, unsigned char *buf, size_t n)
+{
+	rc4_xor_copy(ctx, buf, buf, n);
 }
 
 /* Copy an existing rc4 context */
@@ -88,21 +113,269 @@ struct rc4_ctx *rc4_copy_ctx(struct rc4_ctx *src)
 	return new_ctx;
 }
 
+/* Make an @n lane engine, each lane starts as a copy of @root and is then
+ * shuffled with its lane number so no two lanes produce the same stream
+ */
+struct rc4_lanes *rc4_lanes_new(struct rc4_ctx *root, int n)
+{
+	struct rc4_lanes *lc;
+	unsigned char tag[2];
+	int l;
+
+	if(n < 1 || n > RC4_MAX_LANES)
+		return NULL;
+
+	if((lc = malloc(sizeof(struct rc4_lanes))) == NULL)
+		return NULL;
+	if((lc->lane = malloc(n * sizeof(struct rc4_ctx))) == NULL)	{
+		free(lc);
+		return NULL;
+	}
+	lc->n = n;
+	lc->pos = 0;
+
+	for(l = 0; l < n; l++)	{
+		memcpy(&lc->lane[l], root, sizeof(struct rc4_ctx));
+		tag[0] = 0xa5;
+		tag[1] = l;
+		rc4_shuffle_key(&lc->lane[l], tag, sizeof(tag));
+	}
+	return lc;
+}
+
+void rc4_lanes_free(struct rc4_lanes *lc)
+{
+	if(lc == NULL)
+		return;
+	free(lc->lane);
+	free(lc);
+}
+
+/* Mix key @k into every lane, they stay distinct since their states are */
+void rc4_lanes_shuffle_key(struct rc4_lanes *lc, unsigned char *k, size_t l)
+{
+	int n;
+
+	for(n = 0; n < lc->n; n++)
+		rc4_shuffle_key(&lc->lane[n], k, l);
+}
+
+/* One PRGA step of a single lane, returns the keystream byte */
+#define RC4_STEP(S, i, j, out)	do {			\
+		unsigned char _t;						\
+		(i) = ((i) + 1) & 255;					\
+		(j) = ((j) + (S)[(i)]) & 255;			\
+		_t = (S)[(i)];							\
+		(S)[(i)] = (S)[(j)];					\
+		(S)[(j)] = _t;							\
+		(out) = (S)[((S)[(i)] + (S)[(j)]) & 255];	\
+	} while(0)
+
+/* Run @n lanes side by side: every step of the inner loop advances each lane
+ * by one byte, the chains don't depend on each other so the CPU can overlap
+ * them.  Called with a constant @n and @xor so the loops get unrolled.
+ */
+static inline void lanes_kernel(struct rc4_lanes *lc, const int n,
+		unsigned char *restrict buf, size_t nb, const int xor)
+{
+	struct rc4_ctx *lane = lc->lane;
+	unsigned char i[RC4_MAX_LANES], j[RC4_MAX_LANES];
+	size_t stripe = (size_t)n * RC4_LINE;
+	size_t pos = lc->pos;
+	size_t off = 0;
+	unsigned char ks;
+	int l, b;
+
+	for(l = 0; l < n; l++)	{
+		i[l] = lane[l].i;
+		j[l] = lane[l].j;
+	}
+
+	/* Finish the stripe the last call stopped in, a line at a time */
+	for(; pos != 0 && off < nb; off++)	{
+		l = pos / RC4_LINE;
+		RC4_STEP(lane[l].S, i[l], j[l], ks);
+		if(xor)
+			buf[off] ^= ks;
+		else
+			buf[off] = ks;
+		if(++pos == stripe)
+			pos = 0;
+	}
+
+	for(; off + stripe <= nb; off += stripe)	{
+		unsigned char *p = buf + off;
+
+		for(b = 0; b < RC4_LINE; b++)	{
+			for(l = 0; l < n; l++)	{
+				RC4_STEP(lane[l].S, i[l], j[l], ks);
+				if(xor)
+					p[l * RC4_LINE + b] ^= ks;
+				else
+					p[l * RC4_LINE + b] = ks;
+			}
+		}
+	}
+
+	/* Partial stripe at the end, remembered in pos for the next call */
+	for(; off < nb; off++, pos++)	{
+		l = pos / RC4_LINE;
+		RC4_STEP(lane[l].S, i[l], j[l], ks);
+		if(xor)
+			buf[off] ^= ks;
+		else
+			buf[off] = ks;
+	}
+
+	for(l = 0; l < n; l++)	{
+		lane[l].i = i[l];
+		lane[l].j = j[l];
+	}
+	lc->pos = pos;
+}
+
+static void lanes_dispatch(struct rc4_lanes *lc, unsigned char *buf, size_t nb,
+		const int xor)
+{
+	switch(lc->n)	{
+		case 4:
+			lanes_kernel(lc, 4, buf, nb, xor);
+			break;
+		case 8:
+			lanes_kernel(lc, 8, buf, nb, xor);
+			break;
+		case 16:
+			lanes_kernel(lc, 16, buf, nb, xor);
+			break;
+		default:
+			lanes_kernel(lc, lc->n, buf, nb, xor);
+			break;
+	}
+}
+
+/* Write @nb bytes of interleaved keystream from all lanes of @lc to @buf */
+void rc4_lanes_fill_buf(struct rc4_lanes *lc, unsigned char *buf, size_t nb)
+{
+	lanes_dispatch(lc, buf, nb, 0);
+}
+
+/* XOR a buffer with the interleaved keystream */
+void rc4_lanes_xor_stream(struct rc4_lanes *lc, unsigned char *buf, size_t n)
+{
+	lanes_dispatch(lc, buf, n, 1);
+}
+
 
 #ifdef TEST
 #include <string.h>
 
+#define TEST_LEN	(1 << 16)
+
+/* Generate TEST_LEN bytes in one call and again in chunks of @chunk (or
+ * random sizes if 0) and make sure the streams are identical
+ */
+static int check_chunking(size_t chunk, int nlanes, int xor)
+{
+	static unsigned char one[TEST_LEN], parts[TEST_LEN];
+	struct rc4_ctx a, b;
+	struct rc4_lanes *la = NULL, *lb = NULL;
+	size_t off, n;
+
+	rc4_init_key(&a, (unsigned char *)"chunking", 8);
+	rc4_init_key(&b, (unsigned char *)"chunking", 8);
+	if(nlanes > 1)	{
+		la = rc4_lanes_new(&a, nlanes);
+		lb = rc4_lanes_new(&b, nlanes);
+	}
+
+	memset(one, 0x5a, sizeof(one));
+	memset(parts, 0x5a, sizeof(parts));
+
+	if(la != NULL)
+		(xor ? rc4_lanes_xor_stream : rc4_lanes_fill_buf)(la, one, TEST_LEN);
+	else
+		(xor ? rc4_xor_stream : rc4_fill_buf)(&a, one, TEST_LEN);
+
+	for(off = 0; off < TEST_LEN; off += n)	{
+		n = (chunk != 0) ? chunk : (size_t)(rand() % 5000);
+		if(n > TEST_LEN - off)
+			n = TEST_LEN - off;
+		if(lb != NULL)
+			(xor ? rc4_lanes_xor_stream : rc4_lanes_fill_buf)(lb, parts + off, n);
+		else
+			(xor ? rc4_xor_stream : rc4_fill_buf)(&b, parts + off, n);
+	}
+
+	rc4_lanes_free(la);
+	rc4_lanes_free(lb);
+
+	if(memcmp(one, parts, TEST_LEN) != 0)	{
+		printf("FAIL: chunk %zu, lanes %d, %s\n", chunk, nlanes,
+			   xor ? "xor" : "fill");
+		return 1;
+	}
+	return 0;
+}
+
+/* rc4_xor_copy() in chunks of @chunk must match rc4_xor_stream() in place */
+static int check_copy(size_t chunk)
+{
+	static unsigned char src[TEST_LEN], one[TEST_LEN], parts[TEST_LEN];
+	struct rc4_ctx a, b;
+	size_t off, n;
+
+	rc4_init_key(&a, (unsigned char *)"chunking", 8);
+	rc4_init_key(&b, (unsigned char *)"chunking", 8);
+
+	for(off = 0; off < TEST_LEN; off++)
+		src[off] = off * 131;
+	memcpy(one, src, TEST_LEN);
+	rc4_xor_stream(&a, one, TEST_LEN);
+
+	for(off = 0; off < TEST_LEN; off += n)	{
+		n = (chunk != 0) ? chunk : (size_t)(rand() % 5000);
+		if(n > TEST_LEN - off)
+			n = TEST_LEN - off;
+		rc4_xor_copy(&b, parts + off, src + off, n);
+	}
+
+	if(memcmp(one, parts, TEST_LEN) != 0)	{
+		printf("FAIL: chunk %zu, copy\n", chunk);
+		return 1;
+	}
+	return 0;
+}
+
+static int self_test(void)
+{
+	static const size_t chunks[] = { 1, 7, 64, 100, 4096, 5000, 0 };
+	static const int lanes[] = { 1, 3, 4, 8, 16 };
+	size_t c, l;
+	int xor, fails = 0;
+
+	for(xor = 0; xor < 2; xor++)
+		for(l = 0; l < sizeof(lanes) / sizeof(lanes[0]); l++)
+			for(c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+				fails += check_chunking(chunks[c], lanes[l], xor);
+	for(c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+		fails += check_copy(chunks[c]);
+
+	printf("%s: keystream is independent of chunking\n",
+		   fails ? "FAIL" : "OK");
+	return fails != 0;
+}
+
+/* With no key argument run the self-test, else dump keystream for the key */
 int main(int argc, char *argv[])
 {
 	struct rc4_ctx ctx;
-	char buf[1024];
+	unsigned char buf[1024];
 	int n = 456;
 
-	if(argc < 2)    {
-		puts("Error, requires key argument\n");
-		return 1;
-	}
-	rc4_init_key(&ctx, argv[1], strlen(argv[1]));
+	if(argc < 2)
+		return self_test();
+
+	rc4_init_key(&ctx, (unsigned char *)argv[1], strlen(argv[1]));
 	while(n--)  {
 		rc4_fill_buf(&ctx, buf, 1024);
 		fwrite(buf, 1024, 1, stdout);
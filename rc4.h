@@ -4,14 +4,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* @i and @j are the PRGA indices, kept so that the keystream carries on
+ * where the last call stopped regardless of how it is chunked up
+ */
 struct rc4_ctx {
     unsigned char S[256];
+    unsigned char i, j;
+};
+
+/* Keystream of the multi-lane engine is stitched together in cache-lines,
+ * line k of the output comes from lane (k % n)
+ */
+#define RC4_LINE        64
+#define RC4_MAX_LANES   16
+
+struct rc4_lanes {
+    int n;
+    size_t pos;         /* offset into the current stripe of n lines */
+    struct rc4_ctx *lane;
 };
 
 void rc4_init_key(struct rc4_ctx *ctx, unsigned char *key, size_t klen);
 void rc4_fill_buf(struct rc4_ctx *ctx, unsigned char *buf, size_t nb);
 void rc4_xor_stream(struct rc4_ctx *ctx, unsigned char *buf, size_t n);
+void rc4_xor_copy(struct rc4_ctx *ctx, unsigned char *dst,
+                  const unsigned char *src, size_t n);
 void rc4_shuffle_key(struct rc4_ctx *ctx, unsigned char *k, size_t l);
 struct rc4_ctx *rc4_copy_ctx(struct rc4_ctx *src);
 
+struct rc4_lanes *rc4_lanes_new(struct rc4_ctx *root, int n);
+void rc4_lanes_free(struct rc4_lanes *lc);
+void rc4_lanes_shuffle_key(struct rc4_lanes *lc, unsigned char *k, size_t l);
+void rc4_lanes_fill_buf(struct rc4_lanes *lc, unsigned char *buf, size_t nb);
+void rc4_lanes_xor_stream(struct rc4_lanes *lc, unsigned char *buf, size_t n);
+
 #endif
@@ -1,4 +1,5 @@
 /* vim: set ts=4 sw=4 noexpandtab: */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,14 +10,30 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "rc4.h"
+#include "ring.h"
+#include "container.h"
 #include "cmdlineparse.h"
 
-#define DEF_BUFSIZE	(size_t)(1 << 12)	/* page size? */
+#define DEF_BUFSIZE	(size_t)(1 << 20)
+/* Buffers in the ring between a stream's reader, cipher and writer */
+#define PIPE_SLOTS	4
+/* Files are mapped this much at a time, a multiple of any page size */
+#define MAP_WINDOW	((off_t)1 << 26)
+#define DEF_CHUNK	(size_t)(1 << 20)
+#define MAX_THREADS	256
+/* Most of a chunked stream read at a time */
+#define MAX_BATCH	((size_t)1 << 26)
 
 
 static unsigned char passphrase[256] = {0};
@@ -27,6 +44,22 @@ static char  *input_file = NULL;
 static char  *output_file = NULL;
 
 static size_t bufsize = DEF_BUFSIZE;
+static bool   in_place = false;
+static bool   stream_only = false;
+
+static bool   chunked = false;
+static bool   authenticate = false;
+static bool   decrypting = false;
+static size_t chunk_size = DEF_CHUNK;
+static int    nr_threads = 1;
+static bool   do_range = false;
+static uint64_t range_off = 0, range_len = 0;
+
+static bool   batch_mode = false;
+static char  *batch_list = NULL;
+static char  *batch_suffix = NULL;
+static char **batch_paths = NULL;
+static int    nr_batch_paths = 0;
 
 
 static inline void err_exit(const char *str)
@@ -115,12 +148,20 @@ static void read_passfile(const char *filename)
 /* Set the configuration options above from cmdline */
 static void initialize_options(int argc, char *argv[])
 {
+	static const struct option long_opts[] = {
+		{ "range", required_argument, NULL, 'R' },
+		{ NULL, 0, NULL, 0 }
+	};
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	char *end;
 	int c;
 
+	nr_threads = (ncpu < 1) ? 1 : (ncpu > MAX_THREADS) ? MAX_THREADS : ncpu;
+
 	/* Use getopt_long here because with POSIX feature-tets-macro set we don't
 	 * permute option strings, but we want to because we're lazy
 	 */
-	while((c=getopt_long(argc, argv, "hp:f:b:", NULL, NULL)) != -1)	{
+	while((c=getopt_long(argc, argv, "hiscadBp:f:b:C:t:L:S:", long_opts, NULL)) != -1)	{
 		switch(c)	{
 			case 'p':
 				if(optarg == NULL)	{
@@ -136,15 +177,91 @@ static void initialize_options(int argc, char *argv[])
 				have_pass = true;
 				break;
 			case 'b':
-				bufsize = parse_num(c);
+				if((bufsize = parse_num(c)) == 0)	{
+					fputs("ERROR: -b needs at least 1 byte\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'i':
+				in_place = true;
+				break;
+			case 's':
+				stream_only = true;
+				break;
+			case 'c':
+				chunked = true;
+				break;
+			case 'a':
+				authenticate = true;
+				break;
+			case 'B':
+				batch_mode = true;
+				break;
+			case 'L':
+				batch_list = optarg;
+				batch_mode = true;
+				break;
+			case 'S':
+				if(*optarg == '\0')	{
+					fputs("ERROR: -S needs a suffix\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+				batch_suffix = optarg;
+				break;
+			case 'd':
+				decrypting = true;
+				break;
+			case 'C':
+				chunk_size = parse_num(c);
+				if(chunk_size == 0 || chunk_size > CONTAINER_MAX_CHUNK)	{
+					fputs("ERROR: chunk size must be from 1 byte to 1g\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 't':
+				nr_threads = parse_num(c);
+				if(nr_threads < 1 || nr_threads > MAX_THREADS)	{
+					fprintf(stderr, "ERROR: -t takes 1 to %d threads\n",
+							MAX_THREADS);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'R':
+				errno = 0;
+				range_off = strtoull(optarg, &end, 10);
+				if(*end == ':')
+					range_len = strtoull(end + 1, &end, 10);
+				if(errno != 0 || end == optarg || *end != '\0' || range_len == 0)	{
+					fputs("ERROR: --range takes OFFSET:LENGTH in bytes\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+				do_range = decrypting = true;
 				break;
 			case 'h':
 				fprintf(stderr,
 "Usage: %s [OPTION] [INPUT] [OUTPUT]\n\
+       %s -B [OPTION] [-L LIST] [FILE|DIR]...\n\
   Options:\n\
     -p  passphrase to use, if not given prompt from user on stdin\n\
     -f  pass-file to use, read contents of file and user as passphrase\n\
-    -b  block-size to use (default %zu)\n\n\
+    -b  block-size to use (default %zu)\n\
+    -i  encrypt INPUT in place, no OUTPUT is given\n\
+    -s  stream through the block-size buffer even from file to file\n\
+    -c  encrypt into the chunked format, which can be worked on in parallel\n\
+        and decrypted from any offset\n\
+    -a  authenticate: with -c (which it implies) follow every chunk with a\n\
+        Poly1305 tag, with -d refuse input that has none\n\
+    -d  decrypt, either a chunked file or a legacy stream\n\
+    -C  chunk size for -c (default %zu)\n\
+    -t  threads to encrypt or decrypt chunks on (default: one per CPU)\n\
+    --range OFFSET:LENGTH\n\
+        decrypt only LENGTH bytes from OFFSET of a chunked INPUT file\n\
+    -B  batch: encrypt (or with -d decrypt) every FILE and every file under\n\
+        every DIR in the chunked format, files side by side on -t threads\n\
+    -L  batch the files and directories listed in LIST, one to a line, or\n\
+        on stdin if LIST is '-' (implies -B)\n\
+    -S  in batch mode write FILE with SUFFIX added, or taken off with -d,\n\
+        instead of replacing FILE\n\n\
   Arguments:\n\
     INPUT   optional input file, if not given or given as '-', read stdin\n\
     OUTPUT  optional output file, if not given write to stdout\n\n\
@@ -152,7 +269,12 @@ static void initialize_options(int argc, char *argv[])
     If reading from stdin, the user will be asked to provide a password\n\
     from the terminal, so unless -p or -f is specified, the program needs \n\
     a controlling terminal or it will throw an error.\n\
-", argv[0], DEF_BUFSIZE);
+    From one regular file to another, or in place, both files are mapped\n\
+    and encrypted with no copies in between, anything else is streamed.\n\
+    An interrupted in-place run leaves the file partly encrypted.\n\
+    Tags are checked whenever a file has them, decryption stops at the\n\
+    first chunk that fails and writes none of it.\n\
+", argv[0], argv[0], DEF_BUFSIZE, DEF_CHUNK);
 				exit(EXIT_SUCCESS);
 			case '?':
 				exit(EXIT_FAILURE);
@@ -161,6 +283,24 @@ static void initialize_options(int argc, char *argv[])
 		}
 	}
 
+	if(batch_mode)	{
+		if(in_place || do_range || (chunked && decrypting))	{
+			fputs("ERROR: -B doesn't go with -i, -c -d or --range\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		if(batch_list == NULL && argc == optind)	{
+			fputs("ERROR: -B needs files, directories or -L\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		batch_paths = argv + optind;
+		nr_batch_paths = argc - optind;
+		return;
+	}
+	if(batch_suffix != NULL)	{
+		fputs("ERROR: -S is for batch mode (-B or -L)\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
 	if(argc > optind)
 		input_file = !strcmp(argv[optind], "-") ? NULL : argv[optind];
 	if(argc > optind + 1)
@@ -169,19 +309,1127 @@ static void initialize_options(int argc, char *argv[])
 		fputs("ERROR: too many arguments specified\n", stderr);
 		exit(EXIT_FAILURE);
 	}
+	if(in_place && (input_file == NULL || argc > optind + 1))	{
+		fputs("ERROR: -i takes an INPUT file and no OUTPUT\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if(authenticate && !decrypting)
+		chunked = true;
+	if(in_place && (chunked || decrypting))	{
+		fputs("ERROR: chunked files can't be written in place\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if(chunked && decrypting)	{
+		fputs("ERROR: -c encrypts, it doesn't go with -d or --range\n", stderr);
+		exit(EXIT_FAILURE);
+	}
 }
 
-int main(int argc, char *argv[])
+/* Same file at both paths, the second of which need not exist */
+static bool same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	return stat(a, &sa) == 0 && stat(b, &sb) == 0 &&
+		   sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static void advise(void *p, size_t len)
+{
+	madvise(p, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(p, len, MADV_HUGEPAGE);
+#endif
+}
+
+/* Open the input file to map it.  Returns -1 with it not open if it isn't a
+ * regular file (or is empty, which may just be a file in /proc), for the
+ * data to be streamed instead.
+ */
+static int open_input(int *in, off_t *size)
+{
+	struct stat st;
+
+	if(stream_only || input_file == NULL || output_file == NULL)
+		return -1;
+	if((*in = open(input_file, O_RDONLY)) < 0)
+		return -1;
+	if(fstat(*in, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)	{
+		close(*in);
+		return -1;
+	}
+	*size = st.st_size;
+	return 0;
+}
+
+/* Open the output file sized to @len to map it alongside input @in.
+ * Returns -1 with neither open if it isn't a regular file.
+ */
+static int open_output(int in, int *out, off_t len)
+{
+	struct stat st;
+	int err;
+
+	if((*out = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)	{
+		fprintf(stderr, "ERROR: cannot open output file '%s'\n", output_file);
+		exit(EXIT_FAILURE);
+	}
+	if(fstat(*out, &st) != 0 || !S_ISREG(st.st_mode))	{
+		close(in);
+		close(*out);
+		return -1;
+	}
+
+	/* Reserve the blocks now, running out of space on a store into a
+	 * mapping is a SIGBUS
+	 */
+	if(len > 0 && (err = posix_fallocate(*out, 0, len)) != 0)	{
+		if(err != EINVAL && err != EOPNOTSUPP)	{
+			errno = err;
+			err_exit("Sizing output file");
+		}
+		if(ftruncate(*out, len) != 0)
+			err_exit("Sizing output file");
+	}
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return 0;
+}
+
+static void close_pair(int in, int out)
+{
+	if(out != in && close(out) != 0)
+		err_exit("write-error to output file");
+	if(close(in) != 0)
+		err_exit(in_place ? "write-error to input file" : "Closing input file");
+}
+
+static void open_streams(FILE **fp_in, FILE **fp_out)
+{
+	if(input_file == NULL)	{
+		*fp_in = stdin;
+	} else if((*fp_in = fopen(input_file, "r")) == NULL)	{
+		fprintf(stderr, "ERROR: cannot open inupt file '%s'\n", input_file);
+		exit(EXIT_FAILURE);
+	}
+
+	if(output_file == NULL)	{
+		*fp_out = stdout;
+	} else if((*fp_out = fopen(output_file, "w")) == NULL)	{
+		fprintf(stderr, "ERROR: cannot open output file '%s'\n", output_file);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Encrypt the input file to the output one (or to itself) through mappings
+ * of both, MAP_WINDOW at a time.  Returns -1 without having used any of the
+ * keystream when there is no pair of regular files to map, for the caller to
+ * stream the data instead.
+ */
+static int crypt_mapped(struct rc4_ctx *ctx)
+{
+	unsigned char *src, *dst;
+	struct stat st;
+	off_t off, size;
+	size_t len;
+	int in, out;
+
+	/* Opening it for writing would truncate what we are to read */
+	if(!in_place && input_file != NULL && output_file != NULL &&
+	   same_file(input_file, output_file))
+		in_place = true;
+
+	if(in_place)	{
+		if((in = open(input_file, O_RDWR)) < 0)	{
+			fprintf(stderr, "ERROR: cannot open input file '%s'\n", input_file);
+			exit(EXIT_FAILURE);
+		}
+		if(fstat(in, &st) != 0)
+			err_exit("stat input file");
+		if(!S_ISREG(st.st_mode))	{
+			fputs("ERROR: only regular files are encrypted in place\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+		out = in;
+		size = st.st_size;
+	} else if(open_input(&in, &size) != 0 || open_output(in, &out, size) != 0)	{
+		return -1;
+	}
+
+	for(off = 0; off < size; off += len)	{
+		len = (size - off < MAP_WINDOW) ? size - off : MAP_WINDOW;
+
+		dst = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, out, off);
+		src = dst;
+		if(dst != MAP_FAILED && out != in)	{
+			src = mmap(NULL, len, PROT_READ, MAP_SHARED, in, off);
+			if(src == MAP_FAILED)
+				munmap(dst, len);
+		}
+		if(dst == MAP_FAILED || src == MAP_FAILED)	{
+			if(off != 0 || in_place)
+				err_exit("Mapping file");
+			close(in);
+			close(out);
+			return -1;
+		}
+		advise(dst, len);
+		if(src != dst)
+			advise(src, len);
+
+		rc4_xor_copy(ctx, dst, src, len);
+
+		if(src != dst)
+			munmap(src, len);
+		munmap(dst, len);
+	}
+
+	close_pair(in, out);
+	return 0;
+}
+
+/* A stream goes through three stages joined by a ring of PIPE_SLOTS
+ * buffers: a reader thread fills them from the input, the calling thread
+ * encrypts them in place and a writer thread writes them out, so reading,
+ * the cipher and writing all run at once.  The last buffer is marked.
+ *
+ * A buffer holds @pieces pieces @stride bytes apart, each read as up to
+ * @in_piece bytes and written as up to @out_piece, which leaves room for
+ * the tag a chunk gains or loses on the way through.
+ */
+struct pipeline	{
+	struct ring ring;
+	FILE *in, *out;
+	size_t pieces, stride;
+	size_t in_piece, out_piece;
+	uint64_t to_read;	/* the reader stops after this much */
+	uint64_t skip;		/* the writer leaves this much out first */
+	uint64_t to_write;	/* and stops after this much */
+	bool eof;			/* the input ran out, rather than to_read */
+};
+
+/* Pieces that touch are read or written in one go */
+static void piece_step(const struct pipeline *p, size_t piece, size_t *step,
+					   size_t *len)
+{
+	*step = p->stride;
+	*len = piece;
+	if(piece == p->stride)
+		*step = *len = p->pieces * p->stride;
+}
+
+static void *pipe_reader(void *arg)
+{
+	struct pipeline *p = arg;
+	struct ring_slot *slot;
+	unsigned int spins = 0;
+	size_t off, step, piece, want, n;
+	bool last;
+	int c;
+
+	piece_step(p, p->in_piece, &step, &piece);
+	do {
+		while((slot = ring_produce(&p->ring)) == NULL)
+			ring_wait(&spins);
+		spins = 0;
+
+		slot->len = 0;
+		for(off = 0; off < p->pieces * p->stride && p->to_read > 0 && !p->eof;
+			off += step)	{
+			want = (p->to_read < piece) ? p->to_read : piece;
+			n = fread(slot->buf + off, 1, want, p->in);
+			if(n < want && ferror(p->in))
+				err_exit("read-error from input file");
+			p->to_read -= n;
+			slot->len += n;
+			p->eof = (n < want);
+		}
+
+		/* Look ahead, so the buffer the input ends in is the last one */
+		if(!p->eof)	{
+			if((c = getc(p->in)) != EOF)
+				ungetc(c, p->in);
+			else if(ferror(p->in))
+				err_exit("read-error from input file");
+			else
+				p->eof = true;
+		}
+		last = slot->last = (p->eof || p->to_read == 0);
+		ring_produced(&p->ring);
+	} while(!last);
+	return NULL;
+}
+
+static void pipe_put(struct pipeline *p, const unsigned char *buf, size_t len)
+{
+	size_t skip = (p->skip < len) ? p->skip : len;
+
+	p->skip -= skip;
+	len -= skip;
+	if(len > p->to_write)
+		len = p->to_write;
+	p->to_write -= len;
+	if(fwrite(buf + skip, 1, len, p->out) != len)
+		err_exit("write-error to output file");
+}
+
+static void *pipe_writer(void *arg)
+{
+	struct pipeline *p = arg;
+	struct ring_slot *slot;
+	unsigned int spins = 0;
+	size_t k, off, step, piece, n;
+	bool last;
+
+	piece_step(p, p->out_piece, &step, &piece);
+	do {
+		while((slot = ring_consume(&p->ring)) == NULL)
+			ring_wait(&spins);
+		spins = 0;
+
+		for(k = 0, off = 0; off < slot->len; k++, off += n)	{
+			n = (slot->len - off < piece) ? slot->len - off : piece;
+			pipe_put(p, slot->buf + k * step, n);
+		}
+		last = slot->last;
+		ring_consumed(&p->ring);
+	} while(!last);
+	if(fflush(p->out) != 0)
+		err_exit("write-error to output file");
+	return NULL;
+}
+
+/* Set @p up to pass all of @fp_in to @fp_out in buffers of @size */
+static void pipeline_init(struct pipeline *p, FILE *fp_in, FILE *fp_out,
+						  size_t size)
+{
+	memset(p, 0, sizeof(*p));
+	p->in = fp_in;
+	p->out = fp_out;
+	p->pieces = 1;
+	p->stride = p->in_piece = p->out_piece = size;
+	p->to_read = p->to_write = UINT64_MAX;
+}
+
+/* Pass @p's input through @crypt to its output, @crypt returning how much
+ * of each buffer is to be written; it is told when a buffer holds the end
+ * of the input
+ */
+static void run_pipeline(struct pipeline *p,
+						 size_t (*crypt)(void *, unsigned char *, size_t, bool),
+						 void *arg)
+{
+	struct ring_slot *slot;
+	pthread_t reader, writer;
+	unsigned int spins = 0;
+	size_t size = p->pieces * p->stride;
+	bool last;
+	int err;
+
+	if(ring_init(&p->ring, PIPE_SLOTS, size, 0, -1) != 0)	{
+		fprintf(stderr, "ERROR: allocating %zu bytes for buffers!?\n",
+				size * PIPE_SLOTS);
+		exit(EXIT_FAILURE);
+	}
+	ring_add_stage(&p->ring);
+
+	if((err = pthread_create(&reader, NULL, pipe_reader, p)) != 0 ||
+	   (err = pthread_create(&writer, NULL, pipe_writer, p)) != 0)	{
+		errno = err;
+		err_exit("Starting stream threads");
+	}
+
+	do {
+		while((slot = ring_process(&p->ring)) == NULL)
+			ring_wait(&spins);
+		spins = 0;
+		last = slot->last;
+		slot->len = crypt(arg, slot->buf, slot->len, last && p->eof);
+		ring_processed(&p->ring);
+	} while(!last);
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	ring_free(&p->ring);
+}
+
+static size_t xor_buf(void *ctx, unsigned char *buf, size_t len, bool eof)
+{
+	(void)eof;
+	rc4_xor_stream(ctx, buf, len);
+	return len;
+}
+
+/* XOR a stream with the keystream, starting with the @hlen bytes at @head
+ * already read from it
+ */
+static void crypt_stream(struct rc4_ctx *ctx, FILE *fp_in, FILE *fp_out,
+						 unsigned char *head, size_t hlen)
+{
+	struct pipeline p;
+
+	rc4_xor_stream(ctx, head, hlen);
+	if(fwrite(head, 1, hlen, fp_out) != hlen)
+		err_exit("write-error to output file");
+
+	pipeline_init(&p, fp_in, fp_out, bufsize);
+	run_pipeline(&p, xor_buf, ctx);
+}
+
+/* The legacy format, one keystream from the start of the file to the end */
+static void crypt_legacy(struct rc4_ctx *ctx)
 {
 	FILE *fp_in, *fp_out;
-	unsigned char *buf;
-	struct rc4_ctx ctx;
-	size_t nread;
 
-	if((buf = malloc(bufsize * sizeof(unsigned char))) == NULL)	{
-		fprintf(stderr, "ERROR: allocating %ld bytes for buffer!?", bufsize);
-		return 1;
+	if(crypt_mapped(ctx) == 0)
+		return;
+
+	open_streams(&fp_in, &fp_out);
+	crypt_stream(ctx, fp_in, fp_out, NULL, 0);
+	fclose(fp_in);
+	fclose(fp_out);
+}
+
+static void bad_chunk(uint64_t index)
+{
+	fprintf(stderr, "ERROR: chunk %llu fails authentication, the input is "
+			"damaged or cut short or the passphrase is wrong\n",
+			(unsigned long long)index);
+	exit(EXIT_FAILURE);
+}
+
+/* Chunks @first to @first + @nchunks of a container, sealed or opened by
+ * the threads as they come free.  Chunk k is at @src + k * @sstride and
+ * goes to @dst + k * @dstride, the stride on the side with tags leaving
+ * room for them.
+ */
+struct chunk_job	{
+	const struct container *c;
+	bool sealing;
+	unsigned char *dst;
+	const unsigned char *src;
+	size_t dstride, sstride;
+	uint64_t first, nchunks;
+	size_t tail;		/* data in the last of them */
+	bool eof;			/* which is the container's last */
+	uint64_t next;
+	uint64_t bad;		/* first one whose tag didn't match */
+};
+
+static void chunk_failed(struct chunk_job *job, uint64_t k)
+{
+	uint64_t bad = __atomic_load_n(&job->bad, __ATOMIC_RELAXED);
+
+	while(k < bad && !__atomic_compare_exchange_n(&job->bad, &bad, k, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void *chunk_worker(void *arg)
+{
+	struct chunk_job *job = arg;
+	uint64_t k;
+	size_t n;
+	bool last;
+
+	/* Chunks are taken in order, so once one fails none after it matter */
+	while(__atomic_load_n(&job->bad, __ATOMIC_RELAXED) == UINT64_MAX &&
+		  (k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunks)	{
+		last = (k == job->nchunks - 1);
+		n = last ? job->tail : job->c->chunk;
+		if(job->sealing)
+			container_seal(job->c, job->first + k, last && job->eof,
+						   job->dst + k * job->dstride,
+						   job->src + k * job->sstride, n);
+		else if(container_open(job->c, job->first + k, last && job->eof,
+							   job->dst + k * job->dstride,
+							   job->src + k * job->sstride, n) != 0)
+			chunk_failed(job, k);
+	}
+	return NULL;
+}
+
+/* Run @job on nr_threads threads, -1 if a chunk failed to open */
+static int crypt_chunks(struct chunk_job *job)
+{
+	pthread_t tid[MAX_THREADS];
+	int i, n = (job->nchunks < (uint64_t)nr_threads) ? (int)job->nchunks
+												  : nr_threads;
+
+	job->next = 0;
+	job->bad = UINT64_MAX;
+	for(i = 1; i < n; i++)	{
+		if(pthread_create(&tid[i], NULL, chunk_worker, job) != 0)	{
+			n = i;
+			break;
+		}
+	}
+	chunk_worker(job);
+	for(i = 1; i < n; i++)
+		pthread_join(tid[i], NULL);
+	return (job->bad == UINT64_MAX) ? 0 : -1;
+}
+
+/* Encrypt into a container with header @hdr, or decrypt out of one if @hdr
+ * is NULL, file to file through mappings of both.  -1 if they can't be
+ * mapped, for the caller to stream them instead.
+ */
+static int container_mapped(const struct container *c, const unsigned char *hdr)
+{
+	size_t stride = c->chunk + container_tag(c);
+	unsigned char *src, *dst = NULL;
+	struct chunk_job job;
+	off_t size;
+	int64_t data;
+	size_t len;
+	int in, out;
+
+	if(open_input(&in, &size) != 0)
+		return -1;
+	data = (hdr != NULL) ? size : container_data(c, size);
+	if(data < 0)
+		bad_chunk((size - CONTAINER_HDR) / stride);
+	len = (hdr != NULL) ? container_size(c, size) : (uint64_t)data;
+	if(open_output(in, &out, len) != 0)
+		return -1;
+
+	src = mmap(NULL, size, PROT_READ, MAP_SHARED, in, 0);
+	if(src != MAP_FAILED && len > 0)	{
+		dst = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+		if(dst == MAP_FAILED)
+			munmap(src, size);
+	}
+	if(src == MAP_FAILED || dst == MAP_FAILED)	{
+		close(in);
+		close(out);
+		return -1;
+	}
+	advise(src, size);
+	if(dst != NULL)
+		advise(dst, len);
+
+	memset(&job, 0, sizeof(job));
+	job.c = c;
+	job.nchunks = container_chunks(c, data);
+	job.tail = data - (job.nchunks ? job.nchunks - 1 : 0) * c->chunk;
+	job.eof = true;
+	if(hdr != NULL)	{
+		memcpy(dst, hdr, CONTAINER_HDR);
+		job.sealing = true;
+		job.dst = dst + CONTAINER_HDR;
+		job.dstride = stride;
+		job.src = src;
+		job.sstride = c->chunk;
+	} else {
+		job.dst = dst;
+		job.dstride = c->chunk;
+		job.src = src + CONTAINER_HDR;
+		job.sstride = stride;
+	}
+
+	if(crypt_chunks(&job) != 0)	{
+		/* Leave no plaintext that didn't check out */
+		if(dst != NULL)
+			munmap(dst, len);
+		munmap(src, size);
+		if(ftruncate(out, 0) != 0)
+			err_exit("Truncating output file");
+		bad_chunk(job.bad);
+	}
+
+	if(dst != NULL)
+		munmap(dst, len);
+	munmap(src, size);
+	close_pair(in, out);
+	return 0;
+}
+
+/* Where a stream of chunks has got to */
+struct chunk_stream	{
+	const struct container *c;
+	bool sealing;
+	uint64_t next;
+};
+
+/* Seal or open the chunks in a buffer of them, laid out tags and all */
+static size_t crypt_batch(void *arg, unsigned char *buf, size_t len, bool eof)
+{
+	struct chunk_stream *cs = arg;
+	const struct container *c = cs->c;
+	size_t tag = container_tag(c), stride = c->chunk + tag;
+	struct chunk_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.c = c;
+	job.sealing = cs->sealing;
+	job.dst = buf;
+	job.src = buf;
+	job.dstride = job.sstride = stride;
+	job.first = cs->next;
+	job.eof = eof;
+
+	if(cs->sealing)	{
+		job.nchunks = (len + c->chunk - 1) / c->chunk;
+		if(job.nchunks == 0 && eof && cs->next == 0)
+			job.nchunks = container_chunks(c, 0);
+		job.tail = len - (job.nchunks ? job.nchunks - 1 : 0) * c->chunk;
+	} else {
+		/* A tag cut short, or no chunk at all, is as bad as a wrong one */
+		job.nchunks = (len + stride - 1) / stride;
+		if(job.nchunks == 0 && tag && eof && cs->next == 0)
+			bad_chunk(0);
+		if(job.nchunks != 0)	{
+			job.tail = len - (job.nchunks - 1) * stride;
+			if(job.tail < tag)
+				bad_chunk(cs->next + job.nchunks - 1);
+			job.tail -= tag;
+		}
+	}
+
+	if(job.nchunks != 0 && crypt_chunks(&job) != 0)
+		bad_chunk(cs->next + job.bad);
+	cs->next += job.nchunks;
+
+	if(cs->sealing)
+		return len + job.nchunks * tag;
+	return job.nchunks ? (job.nchunks - 1) * c->chunk + job.tail : 0;
+}
+
+/* Stream a container's data from chunk @first on, as many chunks at a time
+ * as there are threads, leaving out the first @skip bytes that come out and
+ * stopping after @limit.  Whole chunks are read either way, to check their
+ * tags.
+ */
+static void container_stream(const struct container *c, bool sealing,
+							 FILE *fp_in, FILE *fp_out, uint64_t first,
+							 uint64_t skip, uint64_t limit)
+{
+	struct chunk_stream cs = { c, sealing, first };
+	size_t stride = c->chunk + container_tag(c);
+	struct pipeline p;
+	uint64_t end;
+
+	pipeline_init(&p, fp_in, fp_out, stride);
+	p.pieces = MAX_BATCH / stride;
+	if(p.pieces > (size_t)nr_threads)
+		p.pieces = nr_threads;
+	if(p.pieces == 0)
+		p.pieces = 1;
+	p.in_piece = sealing ? c->chunk : stride;
+	p.out_piece = sealing ? stride : c->chunk;
+	p.skip = skip;
+	p.to_write = limit;
+
+	if(limit < UINT64_MAX - skip)	{
+		end = (skip + limit + c->chunk - 1) / c->chunk;
+		p.to_read = (end <= UINT64_MAX / stride) ? end * stride : UINT64_MAX;
+	}
+	run_pipeline(&p, crypt_batch, &cs);
+}
+
+static void same_file_exit(void)
+{
+	if(input_file != NULL && output_file != NULL &&
+	   same_file(input_file, output_file))	{
+		fputs("ERROR: chunked files can't be written in place\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Encrypt into a new container */
+static void encrypt_chunked(struct rc4_ctx *ctx)
+{
+	unsigned char hdr[CONTAINER_HDR];
+	struct container c;
+	FILE *fp_in, *fp_out;
+
+	same_file_exit();
+	container_new(&c, ctx, chunk_size, authenticate ? CONTAINER_MAC : 0);
+	container_encode(&c, hdr);
+	if(container_mapped(&c, hdr) == 0)
+		return;
+
+	open_streams(&fp_in, &fp_out);
+	if(fwrite(hdr, 1, CONTAINER_HDR, fp_out) != CONTAINER_HDR)
+		err_exit("write-error to output file");
+	container_stream(&c, true, fp_in, fp_out, 0, 0, UINT64_MAX);
+	fclose(fp_in);
+	fclose(fp_out);
+}
+
+/* Check a decoded header (@kind as from container_decode()) */
+static void check_container(int kind, const struct container *c)
+{
+	if(kind == -2)	{
+		fputs("ERROR: container header fails authentication, the input is "
+			  "damaged or the passphrase is wrong\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if(kind < 0)	{
+		fputs("ERROR: damaged container header, or one of an unsupported "
+			  "version\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if(authenticate && (kind > 0 || container_tag(c) == 0))	{
+		fputs("ERROR: -a given but the input has no tags (not written with -a)\n",
+			  stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Decrypt a container or a legacy stream, whichever the input is */
+static void decrypt(struct rc4_ctx *ctx)
+{
+	unsigned char hdr[CONTAINER_HDR];
+	struct container c;
+	FILE *fp_in, *fp_out;
+	struct stat st;
+	ssize_t got;
+	int fd, kind;
+
+	/* Look at a file first, to map it if we can */
+	if(input_file != NULL && stat(input_file, &st) == 0 && S_ISREG(st.st_mode))	{
+		if((fd = open(input_file, O_RDONLY)) < 0)	{
+			fprintf(stderr, "ERROR: cannot open inupt file '%s'\n", input_file);
+			exit(EXIT_FAILURE);
+		}
+		if((got = read(fd, hdr, CONTAINER_HDR)) < 0)
+			err_exit("read-error from input file");
+		close(fd);
+
+		kind = container_decode(&c, ctx, hdr, got);
+		check_container(kind, &c);
+		if(kind > 0)	{
+			crypt_legacy(ctx);
+			return;
+		}
+		same_file_exit();
+		if(container_mapped(&c, NULL) == 0)
+			return;
+	}
+
+	open_streams(&fp_in, &fp_out);
+	got = fread(hdr, 1, CONTAINER_HDR, fp_in);
+	kind = container_decode(&c, ctx, hdr, got);
+	check_container(kind, &c);
+	if(kind > 0)
+		crypt_stream(ctx, fp_in, fp_out, hdr, got);
+	else
+		container_stream(&c, false, fp_in, fp_out, 0, 0, UINT64_MAX);
+	fclose(fp_in);
+	fclose(fp_out);
+}
+
+/* Decrypt range_len bytes from range_off of a container, starting at the
+ * chunk they are in
+ */
+static void decrypt_range(struct rc4_ctx *ctx)
+{
+	unsigned char hdr[CONTAINER_HDR];
+	struct container c;
+	FILE *fp_in, *fp_out;
+	uint64_t first;
+	int kind;
+
+	open_streams(&fp_in, &fp_out);
+	kind = container_decode(&c, ctx, hdr, fread(hdr, 1, CONTAINER_HDR, fp_in));
+	if(kind > 0)	{
+		fputs("ERROR: --range needs a chunked file (written with -c)\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	check_container(kind, &c);
+
+	first = range_off / c.chunk;
+	if(fseeko(fp_in, CONTAINER_HDR + first * (c.chunk + container_tag(&c)),
+			  SEEK_SET) != 0)
+		err_exit("--range needs a seekable input");
+	container_stream(&c, false, fp_in, fp_out, first,
+					 range_off - first * c.chunk, range_len);
+	fclose(fp_in);
+	fclose(fp_out);
+}
+
+/* Batch mode: the files named (directories walked with nftw()) or listed
+ * with -L are collected first, biggest first, and taken one at a time by
+ * nr_threads workers.  Each is encrypted into a container of its own, so
+ * its keys come from the one key schedule and a fresh nonce, or decrypted
+ * out of one, a chunk at a time through the worker's buffer.  The result
+ * goes to a temporary file with the original's owner and mode, synced and
+ * renamed over it (never over one of several hard links), or with -S to
+ * the name with the suffix added (or taken off to decrypt).
+ */
+struct batch_file	{
+	off_t size;
+	char path[];
+};
+
+static struct batch_file **batch = NULL;
+static size_t nr_batch = 0, batch_cap = 0;
+static size_t batch_next = 0;
+
+static size_t batch_done = 0;
+static uint64_t batch_bytes = 0;
+
+static void batch_warn(const char *what, const char *path)
+{
+	char warn[4200];
+
+	snprintf(warn, sizeof(warn), "%s '%s'", what, path);
+	perror(warn);
+}
+
+/* Make the new name of a file in @path's directory durable */
+static int sync_dir(const char *path)
+{
+	char *copy = strdup(path);
+	int fd, ret = -1;
+
+	if(copy == NULL)
+		return -1;
+	if((fd = open(dirname(copy), O_RDONLY | O_DIRECTORY)) >= 0)	{
+		ret = fsync(fd);
+		close(fd);
+	}
+	free(copy);
+	return ret;
+}
+
+static int batch_visit(const char *path, const struct stat *st, int type,
+					   struct FTW *ftw)
+{
+	size_t plen = strlen(path) + 1;
+	struct batch_file *f, **b;
+
+	(void)ftw;
+	if(type == FTW_DNR || type == FTW_NS)	{
+		errno = (errno) ? errno : EACCES;
+		batch_warn("Reading", path);
+		return 0;
+	}
+	if(type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if(nr_batch == batch_cap)	{
+		batch_cap = (batch_cap) ? batch_cap * 2 : 256;
+		if((b = realloc(batch, batch_cap * sizeof(*batch))) == NULL)	{
+			fputs("Memory allocation error\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		batch = b;
+	}
+	if((f = malloc(sizeof(*f) + plen)) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(f->path, path, plen);
+	f->size = st->st_size;
+	batch[nr_batch++] = f;
+	return 0;
+}
+
+static void batch_walk(const char *path)
+{
+	if(nftw(path, batch_visit, 64, FTW_PHYS) < 0)
+		batch_warn("Walking", path);
+}
+
+/* Every path in the -L file, one to a line */
+static void batch_read_list(void)
+{
+	FILE *fp = strcmp(batch_list, "-") ? fopen(batch_list, "r") : stdin;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+
+	if(fp == NULL)	{
+		fprintf(stderr, "ERROR: cannot open file list '%s'\n", batch_list);
+		exit(EXIT_FAILURE);
+	}
+	while((len = getline(&line, &cap, fp)) > 0)	{
+		if(line[len - 1] == '\n')
+			line[--len] = '\0';
+		if(len > 0)
+			batch_walk(line);
+	}
+	if(ferror(fp))
+		err_exit("Reading file list");
+	free(line);
+	if(fp != stdin)
+		fclose(fp);
+}
+
+static int bigger_first(const void *a, const void *b)
+{
+	off_t sa = (*(struct batch_file * const *)a)->size;
+	off_t sb = (*(struct batch_file * const *)b)->size;
+
+	return (sa < sb) - (sa > sb);
+}
+
+static int read_full(int fd, unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	for(; len > 0; buf += n, len -= n)	{
+		if((n = read(fd, buf, len)) < 0 && errno == EINTR)
+			n = 0;
+		else if(n <= 0)	{
+			errno = (n == 0) ? EIO : errno;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	for(; len > 0; buf += n, len -= n)	{
+		if((n = write(fd, buf, len)) < 0 && errno == EINTR)
+			n = 0;
+		else if(n < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* A worker's buffer, grown for whatever chunk size a container has */
+struct batch_buf	{
+	unsigned char *p;
+	size_t len;
+};
+
+static int batch_grow(struct batch_buf *b, size_t len)
+{
+	unsigned char *p;
+
+	if(len <= b->len)
+		return 0;
+	if((p = realloc(b->p, len)) == NULL)
+		return -1;
+	b->p = p;
+	b->len = len;
+	return 0;
+}
+
+/* Encrypt or decrypt @in of @size bytes into @out, -1 with a message out if
+ * that fails.  Adds the data's length to @bytes.
+ */
+static int batch_crypt(const struct rc4_ctx *root, const char *path, int in,
+					   int out, off_t size, struct batch_buf *b,
+					   uint64_t *bytes)
+{
+	unsigned char hdr[CONTAINER_HDR];
+	struct container c;
+	uint64_t k, nchunks;
+	int64_t data;
+	size_t tag, n;
+	int kind;
+
+	if(decrypting)	{
+		kind = (read_full(in, hdr, sizeof(hdr)) != 0) ? 1 :
+			   container_decode(&c, root, hdr, sizeof(hdr));
+		if(kind != 0)	{
+			fprintf(stderr, "ERROR: '%s' %s\n", path, (kind > 0) ?
+					"is not a chunked file" : (kind == -2) ?
+					"has a header that fails authentication" :
+					"has a damaged or unsupported header");
+			return -1;
+		}
+		if(authenticate && container_tag(&c) == 0)	{
+			fprintf(stderr, "ERROR: '%s' has no tags (not written with -a)\n",
+					path);
+			return -1;
+		}
+		if((data = container_data(&c, size)) < 0)	{
+			fprintf(stderr, "ERROR: '%s' is cut short\n", path);
+			return -1;
+		}
+	} else {
+		container_new(&c, root, chunk_size, authenticate ? CONTAINER_MAC : 0);
+		container_encode(&c, hdr);
+		if(write_full(out, hdr, sizeof(hdr)) != 0)	{
+			batch_warn("Writing", path);
+			return -1;
+		}
+		data = size;
+	}
+
+	tag = container_tag(&c);
+	if(batch_grow(b, c.chunk + tag) != 0)	{
+		fputs("Memory allocation error\n", stderr);
+		return -1;
+	}
+	nchunks = container_chunks(&c, data);
+	for(k = 0; k < nchunks; k++)	{
+		n = (k == nchunks - 1) ? data - k * c.chunk : c.chunk;
+		if(read_full(in, b->p, decrypting ? n + tag : n) != 0)	{
+			batch_warn("Reading", path);
+			return -1;
+		}
+		if(!decrypting)	{
+			container_seal(&c, k, k == nchunks - 1, b->p, b->p, n);
+			n += tag;
+		} else if(container_open(&c, k, k == nchunks - 1, b->p, b->p, n) != 0)	{
+			fprintf(stderr, "ERROR: chunk %llu of '%s' fails authentication, "
+					"the file is damaged or the passphrase is wrong\n",
+					(unsigned long long)k, path);
+			return -1;
+		}
+		if(write_full(out, b->p, n) != 0)	{
+			batch_warn("Writing", path);
+			return -1;
+		}
+	}
+	*bytes += data;
+	return 0;
+}
+
+/* Encrypt or decrypt one file to where it goes, -1 if that failed */
+static int batch_one(const struct rc4_ctx *root, const char *path,
+					 struct batch_buf *b, uint64_t *bytes)
+{
+	size_t plen = strlen(path), slen = batch_suffix ? strlen(batch_suffix) : 0;
+	char *dest;
+	struct stat st;
+	int in, out, ret = -1;
+
+	if((dest = malloc(plen + slen + 16)) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return -1;
+	}
+	if((in = open(path, O_RDONLY | O_NOFOLLOW)) < 0)	{
+		batch_warn("Opening", path);
+		free(dest);
+		return -1;
+	}
+	if(fstat(in, &st) != 0)	{
+		batch_warn("Reading", path);
+		goto out_in;
+	}
+	/* Renaming over one name would leave the others with the old data */
+	if(batch_suffix == NULL && st.st_nlink > 1)	{
+		fprintf(stderr, "ERROR: '%s' has %lu hard links, skipped (use -S)\n",
+				path, (unsigned long)st.st_nlink);
+		goto out_in;
+	}
+
+	if(batch_suffix == NULL)	{
+		sprintf(dest, "%s.rc4XXXXXX", path);
+		out = mkstemp(dest);
+	} else if(!decrypting)	{
+		sprintf(dest, "%s%s", path, batch_suffix);
+		out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+	} else if(plen > slen && !strcmp(path + plen - slen, batch_suffix))	{
+		sprintf(dest, "%.*s", (int)(plen - slen), path);
+		out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+	} else {
+		fprintf(stderr, "ERROR: '%s' doesn't end in '%s'\n", path, batch_suffix);
+		goto out_in;
 	}
+	if(out < 0)	{
+		batch_warn("Creating", dest);
+		goto out_in;
+	}
+
+	/* What replaces the file has its owner, then (as chown clears the
+	 * set-id bits) its mode; a new one next to it only tries for the owner
+	 */
+	if(fchown(out, st.st_uid, st.st_gid) != 0 && batch_suffix == NULL)
+		batch_warn("Keeping the owner of", path);
+	else if(batch_suffix == NULL && fchmod(out, st.st_mode & 07777) != 0)
+		batch_warn("Keeping the mode of", path);
+	else
+		ret = batch_crypt(root, path, in, out, st.st_size, b, bytes);
+
+	if(ret == 0 && fsync(out) != 0)	{
+		batch_warn("Syncing", dest);
+		ret = -1;
+	}
+	if(close(out) != 0 && ret == 0)	{
+		batch_warn("Writing", dest);
+		ret = -1;
+	}
+	if(ret == 0 && batch_suffix == NULL && rename(dest, path) != 0)	{
+		batch_warn("Replacing", path);
+		ret = -1;
+	}
+	if(ret != 0)
+		unlink(dest);
+	else if(sync_dir(path) != 0)
+		batch_warn("Syncing the directory of", path);
+out_in:
+	close(in);
+	free(dest);
+	return ret;
+}
+
+static void *batch_worker(void *arg)
+{
+	const struct rc4_ctx *root = arg;
+	struct batch_buf b = { NULL, 0 };
+	uint64_t bytes = 0;
+	size_t i, done = 0;
+
+	while((i = __atomic_fetch_add(&batch_next, 1, __ATOMIC_RELAXED)) < nr_batch)	{
+		if(batch_one(root, batch[i]->path, &b, &bytes) == 0)
+			done++;
+		free(batch[i]);
+	}
+	free(b.p);
+	__atomic_fetch_add(&batch_done, done, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&batch_bytes, bytes, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static double elapsed(struct timespec *since)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - since->tv_sec) +
+		   (double)(t.tv_nsec - since->tv_nsec) / 1000000000.0;
+}
+
+static int batch_main(const struct rc4_ctx *root)
+{
+	pthread_t tid[MAX_THREADS];
+	struct timespec t_start;
+	double runtime, mb;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	if(batch_list != NULL)
+		batch_read_list();
+	for(i = 0; i < nr_batch_paths; i++)
+		batch_walk(batch_paths[i]);
+	qsort(batch, nr_batch, sizeof(*batch), bigger_first);
+
+	n = (nr_batch < (size_t)nr_threads) ? (int)nr_batch : nr_threads;
+	for(i = 1; i < n; i++)	{
+		if(pthread_create(&tid[i], NULL, batch_worker, (void *)root) != 0)	{
+			n = i;
+			break;
+		}
+	}
+	batch_worker((void *)root);
+	for(i = 1; i < n; i++)
+		pthread_join(tid[i], NULL);
+	free(batch);
+
+	runtime = elapsed(&t_start);
+	mb = batch_bytes / 1000000.0;
+	fprintf(stderr, "Finished, %zu of %zu files (%.3f Mb) %s in %.3fs "
+			"(%.1f files/s, %.2f Mb/s)\n", batch_done, nr_batch, mb,
+			decrypting ? "decrypted" : "encrypted", runtime,
+			batch_done / runtime, mb / runtime);
+	return (batch_done == nr_batch) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+	struct rc4_ctx ctx;
 
 	if(mlock(passphrase, sizeof(passphrase)) != 0)	{
 		perror("memlock passphrase");
@@ -204,32 +1452,16 @@ int main(int argc, char *argv[])
 
 	munlock(passphrase, sizeof(passphrase));
 
-	if(input_file == NULL)	{
-		fp_in = stdin;
-	} else if((fp_in = fopen(input_file, "r")) == NULL)	{
-		fprintf(stderr, "ERROR: cannot open inupt file '%s'\n", input_file);
-		return 1;
-	}
-
-	if(output_file == NULL)	{
-		fp_out = stdout;
-	} else if((fp_out = fopen(output_file, "w")) == NULL)	{
-		fprintf(stderr, "ERROR: cannot open output file '%s'\n", output_file);
-		return 1;
-	}
-
-	while((nread = fread(buf, 1, bufsize, fp_in)) != 0)	{
-
-		rc4_xor_stream(&ctx, buf, nread);
-
-		if(fwrite(buf, 1, nread, fp_out) != nread)
-			err_exit("write-error to output file");
-	}
-
-	fclose(fp_in);
-	fclose(fp_out);
-
-	free(buf);
+	if(batch_mode)
+		return batch_main(&ctx);
+	if(do_range)
+		decrypt_range(&ctx);
+	else if(chunked)
+		encrypt_chunked(&ctx);
+	else if(decrypting)
+		decrypt(&ctx);
+	else
+		crypt_legacy(&ctx);
 
 	return 0;
 }
@@ -0,0 +1,150 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+
+#include "ring.h"
+#include "mem.h"
+
+/* Spins before a waiting side starts giving up the CPU */
+#define RING_SPINS	256
+/* Yields before ring_wait() sleeps instead, and for how long */
+#define RING_YIELDS	64
+#define RING_NAP_NS	50000
+
+/* Set up @r with @nslots buffers of @bufsize bytes carved out of one pool
+ * on NUMA node @node (-1 for any), each starting on an @align boundary (at
+ * least a page), 0 on success
+ */
+int ring_init(struct ring *r, size_t nslots, size_t bufsize, size_t align,
+			  int node)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t stride, i;
+	void *pool;
+
+	memset(r, 0, sizeof(struct ring));
+	if(nslots == 0)
+		return -1;
+
+	if(page > 0 && align < (size_t)page)
+		align = page;
+	stride = (bufsize + align - 1) / align * align;
+
+	if((r->slot = calloc(nslots, sizeof(struct ring_slot))) == NULL)
+		return -1;
+	if((pool = alloc_buffer_on(stride * nslots, align, node)) == NULL)	{
+		free(r->slot);
+		r->slot = NULL;
+		return -1;
+	}
+	r->pool = pool;
+	r->nslots = nslots;
+
+	for(i = 0; i < nslots; i++)	{
+		r->slot[i].buf = r->pool + i * stride;
+		r->slot[i].len = bufsize;
+	}
+	return 0;
+}
+
+void ring_free(struct ring *r)
+{
+	if(r->slot == NULL)
+		return;
+	free_buffer(r->pool);
+	free(r->slot);
+	r->slot = NULL;
+	r->pool = NULL;
+}
+
+/* Producer: next free slot to fill, or NULL if the ring is full */
+struct ring_slot *ring_produce(struct ring *r)
+{
+	size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if(r->head - tail == r->nslots)
+		return NULL;
+	return &r->slot[r->head % r->nslots];
+}
+
+/* Producer: publish the slot returned by ring_produce() */
+void ring_produced(struct ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer: oldest filled slot, or NULL if there is nothing ready */
+struct ring_slot *ring_consume(struct ring *r)
+{
+	size_t head = __atomic_load_n(r->staged ? &r->mid : &r->head,
+								  __ATOMIC_ACQUIRE);
+
+	if(head == r->tail)
+		return NULL;
+	return &r->slot[r->tail % r->nslots];
+}
+
+/* Consumer: hand the slot from ring_consume() back to the producer */
+void ring_consumed(struct ring *r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+bool ring_empty(struct ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+		   __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Put a middle stage between producer and consumer, before either starts */
+void ring_add_stage(struct ring *r)
+{
+	r->staged = true;
+}
+
+/* Middle stage: oldest slot the producer published, or NULL if none is */
+struct ring_slot *ring_process(struct ring *r)
+{
+	size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if(head == r->mid)
+		return NULL;
+	return &r->slot[r->mid % r->nslots];
+}
+
+/* Middle stage: pass the slot from ring_process() on to the consumer */
+void ring_processed(struct ring *r)
+{
+	__atomic_store_n(&r->mid, r->mid + 1, __ATOMIC_RELEASE);
+}
+
+/* Wait a little for the other side, spin first then yield the CPU.  @spins
+ * counts consecutive failed attempts, reset it to zero on success.
+ */
+void ring_backoff(unsigned int *spins)
+{
+	if(++(*spins) < RING_SPINS)	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} else {
+		sched_yield();
+	}
+}
+
+/* As ring_backoff(), but once yielding hasn't helped either sleep instead,
+ * for a side that can be kept waiting on a pipe or disk for a long time
+ */
+void ring_wait(unsigned int *spins)
+{
+	struct timespec nap = { 0, RING_NAP_NS };
+
+	if(*spins < RING_SPINS + RING_YIELDS)
+		ring_backoff(spins);
+	else
+		nanosleep(&nap, NULL);
+}
@@ -0,0 +1,52 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* Lock-free single-producer/single-consumer ring of buffers.  The producer
+ * fills slots in place and the consumer drains them in place, the buffers
+ * are recycled and never move.  head and tail only ever increase and are
+ * each written by one side only, so they live on separate cache lines.
+ *
+ * After ring_add_stage() a third side sits in between: it works on the
+ * slots the producer published in place with ring_process() and passes
+ * them on to the consumer with ring_processed(), moving mid.
+ */
+
+#define RING_CACHELINE  64
+
+struct ring_slot {
+    unsigned char *buf;
+    size_t len;
+    bool last;              /* for users to mark the end of a stream */
+};
+
+struct ring {
+    size_t nslots;
+    struct ring_slot *slot;
+    unsigned char *pool;    /* backing memory of every slot's buffer */
+    bool staged;            /* the consumer waits for mid, not head */
+    size_t head __attribute__((aligned(RING_CACHELINE)));
+    size_t mid __attribute__((aligned(RING_CACHELINE)));
+    size_t tail __attribute__((aligned(RING_CACHELINE)));
+};
+
+int ring_init(struct ring *r, size_t nslots, size_t bufsize, size_t align,
+			  int node);
+void ring_free(struct ring *r);
+
+struct ring_slot *ring_produce(struct ring *r);
+void ring_produced(struct ring *r);
+struct ring_slot *ring_consume(struct ring *r);
+void ring_consumed(struct ring *r);
+bool ring_empty(struct ring *r);
+
+void ring_add_stage(struct ring *r);
+struct ring_slot *ring_process(struct ring *r);
+void ring_processed(struct ring *r);
+
+void ring_backoff(unsigned int *spins);
+void ring_wait(unsigned int *spins);
+
+#endif
@@ -17,7 +17,7 @@
  *	in parallel for each disk being shredded
  *
  ***************************************************************************/
-//#define _GNU_SOURCE
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,14 +29,22 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <pthread.h>
-#include <assert.h>
+#include <getopt.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ftw.h>
 
-#include "rc4.h"
+#include "gen.h"
+#include "ring.h"
+#include "uring.h"
 #include "cmdlineparse.h"
-
-void read_random_bytes(const char *rand_device, unsigned char *buf, size_t len);
-int write_block(int fd, unsigned char *buf, size_t len);
+#include "shredutil.h"
+#include "entropy.h"
+#include "metrics.h"
+#include "checkpoint.h"
+#include "ratelimit.h"
+#include "mem.h"
 
 
 /* Length of the key to read from /dev/urandom each re-initialization */
@@ -49,36 +57,91 @@ static size_t reps = 8192;
 static size_t total = 0;
 /* Filename to write to, stdout if NULL */
 static char *fname = NULL;
+/* All destinations given, more than one shreds them in parallel */
+static char **fnames = NULL;
+static int nr_dests = 0;
 /* Print the configuration to stderr */
 static bool print_conf = 0;
+/* When main() started, for the time to first byte */
+static struct timespec t_launch;
 /* Open with O_DIRECT */
 static bool direct_io = false;
 /* Debug messages along the way */
 static bool debug = false;
 /* Break out of loop */
 static bool done = false;
+/* Alignment every I/O buffer has to have, the device block size w/ -S */
+static size_t buf_align = 1;
 /* Bytes to skip in output device before writing */
 static off_t skip = 0;
 /* Number of threads to create, defaults to none (1 == main thread) */
 static int nr_threads = 1;
+/* Number of interleaved RC4 lanes per generator, 1 is the serial engine */
+static int nr_lanes = 1;
+/* Keystream generator backend, and the rounds for ChaCha */
+static enum gen_type gen_type = GEN_RC4;
+static int gen_rounds = 20;
+
+/* Split the destination in this many shards written in parallel, 0 is off */
+static int nr_shards = 0;
+/* Buffers in each generator thread's ring */
+static size_t ring_depth = 4;
+/* Writes kept in flight with io_uring, 0 means plain write() */
+static unsigned int uring_depth = 0;
+/* Splice to files and devices too, not only to pipes */
+static bool splice_files = false;
+/* Caps on bytes and writes per second, and the write latency to back off
+ * above in microseconds, 0 for none
+ */
+static size_t rate_bytes = 0;
+static size_t rate_writes = 0;
+static size_t rate_latency = 0;
+/* I/O scheduling class and level given with -I, class 0 leaves it be */
+static int io_class = 0;
+static int io_level = 4;
+/* Discard the range rather than overwrite it, then overwrite and verify
+ * this many regions of it
+ */
+static enum discard_kind discard = DISCARD_NONE;
+static size_t nr_samples = 64;
+/* Overwrite only the allocated extents of a file, leaving holes alone */
+static bool extents_only = false;
+/* CPUs to pin worker threads to in turn, from -A */
+static int *cpus = NULL;
+static int nr_cpus = 0;
+/* Destinations are directories to shred every file in, and unlink them */
+static bool tree = false;
+static bool unlink_files = false;
+/* Status line every second, and JSON records to this fd if not -1 */
+static bool status_line = false;
+static int metrics_fd = -1;
+/* Checkpoint file kept with -C, and whether to start from it */
+static char *ckpt_file = NULL;
+static bool resume = false;
+/* Stopped by SIGINT, and SIGALRM saying the next checkpoint is due */
+static volatile bool interrupted = false;
+static volatile sig_atomic_t checkpoint_due = 0;
+/* Overwrite scheme given with -P, and read every pass back with -V */
+static char *scheme = NULL;
+static bool verify = false;
 
+/* Each generator thread owns a ring it fills and the writer drains */
 static struct per_thread	{
-	pthread_cond_t go;
-	pthread_mutex_t lock;
-	struct rc4_ctx *ctx;
-	bool ready;
-	unsigned char *buf;
+	struct ring ring;
+	struct gen *gen;
+	struct rekey_slot *rk;
+	struct ring_slot *cur;
+	unsigned long stalls;
+	size_t bytes;
 	int id;
 } *tinfo;
 
-static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t dataready = PTHREAD_COND_INITIALIZER;
-
 
 /* If sigint, set done=1 and break out of main loop cleanly */
 static void sigint_handler(int signum)
 {
 	done = true;
+	interrupted = true;
 	if(debug || print_conf)
 		fputs("\nCaught SIGINT, stop after next block...", stderr);
 	if(signum && print_conf && !debug)
@@ -100,12 +163,89 @@ static void setup_signals(void)
 	sigaction(SIGINT, &new_action, NULL);
 }
 
+static void sigalrm_handler(int signum)
+{
+	(void)signum;
+	checkpoint_due = 1;
+}
+
+/* Have SIGALRM ask for a checkpoint every CHECKPOINT_SECS */
+#define CHECKPOINT_SECS	10
+
+static void start_checkpoints(void)
+{
+	struct sigaction new_action;
+	struct itimerval every = { { CHECKPOINT_SECS, 0 }, { CHECKPOINT_SECS, 0 } };
+
+	memset(&new_action, 0, sizeof(new_action));
+	new_action.sa_handler = sigalrm_handler;
+	sigemptyset(&new_action.sa_mask);
+	new_action.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &new_action, NULL);
+
+	setitimer(ITIMER_REAL, &every, NULL);
+}
+
+/* Class and level from -I, "idle", "be" or "rt" with an optional ":level" */
+static int parse_io_class(const char *arg)
+{
+	static const char *classes[] = { "rt", "be", "idle" };
+	size_t len = strcspn(arg, ":");
+
+	for(int i = 0; i < 3; i++)	{
+		if(strlen(classes[i]) != len || strncmp(arg, classes[i], len) != 0)
+			continue;
+		io_class = i + 1;
+		if(arg[len] == ':')	{
+			char *end;
+			io_level = strtol(arg + len + 1, &end, 10);
+			if(*end != '\0' || io_level < 0 || io_level > 7)
+				return -1;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/* Kind and sample count from -D, "discard", "secure" or "zero" with an
+ * optional ":samples"
+ */
+static int parse_discard(const char *arg)
+{
+	static const char *kinds[] = { "discard", "secure", "zero" };
+	size_t len = strcspn(arg, ":");
+
+	for(int i = 0; i < 3; i++)	{
+		if(strlen(kinds[i]) != len || strncmp(arg, kinds[i], len) != 0)
+			continue;
+		discard = DISCARD_PLAIN + i;
+		if(arg[len] == ':')	{
+			char *end;
+			nr_samples = strtoul(arg + len + 1, &end, 10);
+			if(*end != '\0')
+				return -1;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/* Long options with no short form */
+enum	{ OPT_SEED = 256, OPT_RANDOM };
+
 /* Set the configuration options above from cmdline */
 static void initialize_options(int argc, char *argv[])
 {
+	static const struct option long_opts[] = {
+		{ "resume", no_argument, NULL, 'R' },
+		{ "seed", required_argument, NULL, OPT_SEED },
+		{ "random", required_argument, NULL, OPT_RANDOM },
+		{ NULL, 0, NULL, 0 }
+	};
 	int c;
 
-	while((c=getopt(argc, argv, "+hpdSn:k:b:r:f:s:t:")) != -1)	{
+	while((c=getopt_long(argc, argv, "+hpdmSVzETXn:k:b:r:f:s:t:l:q:u:w:g:P:M:C:B:O:L:I:D:A:H:",
+						 long_opts, NULL)) != -1)	{
 		switch(c)	{
 			case 'n':
 				total = parse_num(c);
@@ -132,10 +272,133 @@ static void initialize_options(int argc, char *argv[])
 				break;
 			case 't':
 				nr_threads = parse_num(c);
+				if(nr_threads < 1)	{
+					fputs("Threads must be at least 1\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'q':
+				ring_depth = parse_num(c);
+				if(ring_depth < 1)	{
+					fputs("Ring depth must be at least 1\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'g':
+				if(gen_parse(optarg, &gen_type, &gen_rounds) != 0)	{
+					fprintf(stderr, "Unknown generator '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'w':
+				nr_shards = parse_num(c);
+				if(nr_shards > 200)	{
+					fputs("Too many shards, must be <= 200\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'P':
+				scheme = optarg;
+				break;
+			case 'V':
+				verify = true;
+				break;
+			case 'm':
+				status_line = true;
+				break;
+			case 'C':
+				ckpt_file = optarg;
+				break;
+			case OPT_SEED:	{
+				char *end;
+				unsigned long long seed = strtoull(optarg, &end, 0);
+
+				if(*optarg == '\0' || *end != '\0')	{
+					fprintf(stderr, "Bad seed '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				entropy_seed(seed);
+				break;
+			}
+			case OPT_RANDOM:	{
+				enum entropy_mode mode;
+
+				if(entropy_parse_mode(optarg, &mode) != 0)	{
+					fprintf(stderr, "Unknown random mode '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				entropy_set_mode(mode);
+				break;
+			}
+			case 'R':
+				resume = true;
+				break;
+			case 'z':
+				splice_files = true;
+				break;
+			case 'E':
+				extents_only = true;
+				break;
+			case 'T':
+				tree = true;
+				break;
+			case 'A':
+				if((nr_cpus = parse_cpu_list(optarg, &cpus)) < 0)	{
+					fprintf(stderr, "Bad CPU list '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'H':	{
+				enum mem_pages pages;
+
+				if(mem_parse_pages(optarg, &pages) != 0)	{
+					fprintf(stderr, "Unknown page size '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				mem_set_pages(pages);
+				break;
+			}
+			case 'X':
+				unlink_files = true;
+				break;
+			case 'B':
+				rate_bytes = parse_num(c);
+				break;
+			case 'O':
+				rate_writes = parse_num(c);
+				break;
+			case 'L':
+				rate_latency = parse_num(c);
+				break;
+			case 'I':
+				if(parse_io_class(optarg) != 0)	{
+					fprintf(stderr, "Unknown I/O class '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'D':
+				if(parse_discard(optarg) != 0)	{
+					fprintf(stderr, "Unknown discard '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'M':
+				metrics_fd = parse_num(c);
+				break;
+			case 'u':
+				uring_depth = parse_num(c);
+				break;
+			case 'l':
+				nr_lanes = parse_num(c);
+				if(nr_lanes < 1 || nr_lanes > RC4_MAX_LANES)	{
+					fprintf(stderr, "Lanes must be between 1 and %d\n",
+							RC4_MAX_LANES);
+					exit(EXIT_FAILURE);
+				}
 				break;
 			case 'h':
 				fprintf(stderr,
-"Usage: %s [OPTION] [DESTINATION]\n\
+"Usage: %s [OPTION] [DESTINATION]...\n\
   Options:\n\
     -n  total number of blocks to write, default unlimited\n\
     -b  block size to write at a time, default 4096\n\
@@ -144,10 +407,59 @@ static void initialize_options(int argc, char *argv[])
     -S  sidestep disk buffer, open destination with O_DIRECT\n\
     -s  bytes to skip in output device before starting writing\n\
     -t  number of threads to use, default is just main thread\n\
+    -q  pre-generated blocks queued per thread, default 4\n\
+    -w  split the destination in this many shards, each generated and\n\
+        written by its own thread with pwrite(), at most 200\n\
+    -E  only overwrite the parts of a file that hold data, leaving holes\n\
+        unallocated, split between the -t threads\n\
+    -T  shred every regular file under the DESTINATION directories, on\n\
+        the -t threads, without crossing into other filesystems\n\
+    -X  with -T, unlink each file once it is synced and remove the\n\
+        directories after\n\
+    -A  pin the -t/-w worker threads to these CPUs in turn, e.g. 0-7,16-23,\n\
+        their buffers then come from the CPU's NUMA node\n\
+    -H  buffer pages: normal (default), thp for transparent huge pages or\n\
+        hugetlb for reserved ones (vm.nr_hugepages)\n\
+    -u  write with io_uring keeping this many blocks in flight\n\
+    -z  splice() to a file or device through a pipe, rather than write()\n\
+    -B  write at most this many bytes per second, e.g. 50m\n\
+    -O  write at most this many blocks per second\n\
+    -L  slow down while writes take longer than this many microseconds\n\
+        on average, speeding up again once they are quicker\n\
+    -I  I/O scheduling class: idle, be or rt, optionally with a level,\n\
+        be:7 is the lowest best-effort priority\n\
+    -g  keystream generator: rc4 (default), chacha8, chacha12, chacha20\n\
+        or xoshiro, SIMD kernels are picked for the CPU at runtime\n\
+    -l  interleaved RC4 lanes per generator (4, 8 or 16), default 1\n\
+", argv[0]);
+				fputs(
+"    -P  overwrite in passes, a comma separated list of zero, one, random\n\
+        or a hex pattern (0x55aa), or the scheme dod (zero,one,random)\n\
+    -V  read every pass back and compare, under the writes of the next\n\
+        pass (implies -P random when -P is not given)\n\
+    -D  discard the range instead with BLKDISCARD (discard), BLKSECDISCARD\n\
+        (secure) or BLKZEROOUT (zero), then overwrite and verify 64 regions\n\
+        of it, or as many as given after a colon (zero:256).  Overwrites\n\
+        everything as usual when the device refuses or isn't a block device\n\
+    -m  show throughput, write latency and stalls once a second\n\
+    -M  write the same once a second as a JSON line to this fd\n\
+    -C  keep progress in this checkpoint file, saved after an fsync() every\n\
+        10 seconds and on SIGINT, removed once the shred is complete\n\
+    --resume  continue from the checkpoint given with -C, the other\n\
+        options have to be the same as in the run that saved it\n\
+    --random  how keys are taken from getrandom(): block (default) waits\n\
+        for the kernel pool to be initialised after boot, nonblock reads\n\
+        /dev/urandom instead if it isn't, insecure never waits\n\
+    --seed  derive every key from this number instead, for runs that\n\
+        can be repeated byte for byte (with -t 1), never for real wipes\n\
     -p  print the configuration used to stderr\n\
     -d  debug, print processing messages to stderr (implies -p)\n\n\
   Arguments:\n\
-    DESTINATION  optional output destination, defaults to stdout\n\n\
+    DESTINATION  optional output destination, defaults to stdout.  With\n\
+                 several, all are shredded at once sharing the -t\n\
+                 generator threads, each with its own writer thread.\n\
+                 When it is a pipe, the keystream is handed over with\n\
+                 vmsplice() and never copied (not with -t, -u or -S)\n\n\
   Notes:\n\
     Any numeric value can be postfixed with a multiplier, one of the\n\
     following letters:\n\
@@ -155,7 +467,8 @@ static void initialize_options(int argc, char *argv[])
     for kilo, mega, or giga-byte. The lower-case versions return the power\n\
     of two nearest (1k = 1024), and the upper-case returns an exact power of\n\
     ten (1K = 1000).\n\
-", argv[0]);
+    SIGUSR1 prints the current throughput and latency line to stderr.\n\
+", stderr);
 				exit(EXIT_SUCCESS);
 			case 'd':
 				debug = true;
@@ -163,7 +476,10 @@ static void initialize_options(int argc, char *argv[])
 				print_conf = true;
 				break;
 			case '?':
-				if(strchr("nkbrs", optopt) == NULL)
+				/* getopt_long() has already said what it was */
+				if(optopt == 0 || optopt >= OPT_SEED)
+					;
+				else if(strchr("nkbrstlquwgPMCBOLIDAH", optopt) == NULL)
 					fprintf(stderr,
 						"Unknown option -%c encountered\n", optopt);
 				else
@@ -175,146 +491,248 @@ static void initialize_options(int argc, char *argv[])
 		}
 	}
 
-	if(optind + 1 == argc)	{
-		fname = argv[optind];
-	} else if(optind != argc) {
-		fprintf(stderr, "Invalid/too many arguments found\n");
+	fnames = &argv[optind];
+	nr_dests = argc - optind;
+	if(nr_dests > 0)
+		fname = fnames[0];
+	if(nr_shards > 0 && nr_dests > 1)	{
+		fputs("Sharding (-w) takes a single destination\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if(nr_dests > 1 && uring_depth > 0)
+		fputs("io_uring is not used with several destinations\n", stderr);
+
+	if(resume && ckpt_file == NULL)	{
+		fputs("--resume needs the checkpoint file given with -C\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if(ckpt_file != NULL && (nr_dests != 1 || nr_shards > 0))	{
+		fputs("Checkpoints (-C) take a single destination and no -w\n",
+			  stderr);
+		exit(EXIT_FAILURE);
+	}
+	if(ckpt_file != NULL && uring_depth > 0)	{
+		fputs("Checkpoints are written with write(), -u is not used\n",
+			  stderr);
+		uring_depth = 0;
+	}
+
+	if(extents_only && (nr_dests != 1 || nr_shards > 0 || scheme != NULL ||
+						verify || ckpt_file != NULL))	{
+		fputs("Extents (-E) take a single destination, and no -w, -P, -V "
+			  "or -C\n", stderr);
 		exit(EXIT_FAILURE);
 	}
+
+	if(tree && (nr_dests < 1 || nr_shards > 0 || scheme != NULL || verify ||
+				ckpt_file != NULL || extents_only || discard != DISCARD_NONE ||
+				direct_io))	{
+		fputs("Trees (-T) take directories, and no -w, -P, -V, -C, -E, -D "
+			  "or -S\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if(unlink_files && !tree)	{
+		fputs("Unlinking (-X) is only done with -T\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if(verify && scheme == NULL)
+		scheme = "random";
+	if(scheme != NULL)	{
+		if(nr_dests != 1 || nr_shards > 0)	{
+			fputs("Passes (-P/-V) take a single destination and no -w\n",
+				  stderr);
+			exit(EXIT_FAILURE);
+		}
+		if(nr_threads > 1 || uring_depth > 0)
+			fputs("Passes are written from the main thread, -t and -u "
+				  "are not used\n", stderr);
+	}
+}
+
+/* Mix the state with @klen more random bytes: swap in what the prefetcher
+ * has ready, only if it is behind read and reseed here
+ */
+static void rekey(struct gen *g, struct rekey_slot *rk, unsigned char *key)
+{
+	if(prefetch_swap(rk, g))
+		return;
+
+	prefetch_key(rk, key, klen);
+	gen_reseed(g, key, klen);
+}
+
+/* Generate a block of keystream, timed for the metrics from @start, the
+ * end of whatever came before.  Returns the time the block was done, so a
+ * loop alternating generation and writes reads the clock once per step.
+ */
+static inline uint64_t fill_block(struct gen *g, unsigned char *buf,
+								  uint64_t start)
+{
+	gen_fill(g, buf, bufsize);
+	return metrics_generated(start);
 }
 
-static void init_threads(struct rc4_ctx *root)
+/* Wait for the rate limit to let @bytes be written.  Returns the start for
+ * rate_done() and moves the metrics clock *@t past the wait, so sleeping
+ * here isn't taken for write latency.
+ */
+static inline uint64_t throttle(size_t bytes, uint64_t *t)
+{
+	uint64_t r0;
+
+	if(!rate_on)
+		return 0;
+	r0 = rate_take(bytes);
+	*t = metrics_clock();
+	return r0;
+}
+
+/* Pin worker @id to its CPU from -A, round robin over the list */
+static void pin_worker(int id)
+{
+	if(nr_cpus > 0 && pin_thread(cpus[id % nr_cpus]) != 0)
+		perror("Pinning worker");
+}
+
+/* The NUMA node worker @id will run on, -1 if it isn't pinned */
+static int worker_node(int id)
+{
+	return (nr_cpus > 0) ? cpu_node(cpus[id % nr_cpus]) : -1;
+}
+
+static void init_threads(struct gen *root, bool with_ring)
 {
 	unsigned char key[16];
 
 	for (int i = 0; i < nr_threads; i++)	{
-		printf("Initalizing thread %d\n", i);
-		pthread_mutex_init(&(tinfo[i].lock), NULL);
-		pthread_cond_init(&(tinfo[i].go), NULL);
-		tinfo[i].ctx = rc4_copy_ctx(root);
+		if(debug) fprintf(stderr, "Initalizing thread %d\n", i);
+		if((tinfo[i].gen = gen_copy(root)) == NULL)	{
+			fputs("Memory allocation error\n", stderr);
+			exit(EXIT_FAILURE);
+		}
 
 		/* Mix the state with more random bytes */
-		read_random_bytes("/dev/urandom", key, sizeof(key));
-		rc4_shuffle_key(tinfo[i].ctx, key, sizeof(key));
+		entropy_bytes(key, sizeof(key));
+		gen_reseed(tinfo[i].gen, key, sizeof(key));
+		tinfo[i].rk = prefetch_register(tinfo[i].gen);
 
-		tinfo[i].ready = false;
-		tinfo[i].buf = malloc(bufsize);
+		if(with_ring &&
+		   ring_init(&tinfo[i].ring, ring_depth, bufsize, buf_align,
+					 worker_node(i)) != 0)	{
+			fputs("Memory allocation error\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		tinfo[i].cur = NULL;
+		tinfo[i].stalls = 0;
 		tinfo[i].id = i;
+		metrics_watch_stalls(&tinfo[i].stalls);
+	}
+}
+
+static void free_threads(void)
+{
+	metrics_forget_stalls();
+	for (int i = 0; i < nr_threads; i++)	{
+		ring_free(&tinfo[i].ring);
+		gen_free(tinfo[i].gen);
 	}
+	free(tinfo);
 }
 
+/* Keep our ring topped up with keystream until the main loop is done */
 static void *worker_generator(void *arg)
 {
-	int id = (int)arg;
-	printf("Creating prod worker %d\n", id);
-	assert(id < nr_threads);
+	struct per_thread *pt = arg;
+	unsigned char key[256];
+	struct ring_slot *slot;
+	unsigned int spins = 0;
+	size_t generated = 0;
 
-	struct per_thread *pt = &tinfo[id];
+	pin_worker(pt->id);
+	if(debug) fprintf(stderr, "Started generator %d\n", pt->id);
 
-	pthread_mutex_lock(&pt->lock); /* L */
-	printf("prod-%d: Entering worker, locked mtx\n", id);
-	while(!done)	{
-		// printf("prod-%d: Fill my buf (%p)\n", id, pt->buf);
-		rc4_fill_buf(pt->ctx, pt->buf, bufsize);
-		pt->ready = true;
-		// printf("prod-%d: Buf full, waiting for global mtx to signal ready\n", id);
-		pthread_mutex_lock(&mtx);
-		pthread_cond_signal(&dataready);
-		pthread_mutex_unlock(&mtx);
-		// printf("prod-%d: Ready signalled -- wait for my cond\n", id);
-		while(pt->ready)	{
-			pthread_cond_wait(&pt->go, &pt->lock); /* U ... L */
-		}
-	}
-	pthread_mutex_unlock(&pt->lock); /* U */
+	while(!__atomic_load_n(&done, __ATOMIC_RELAXED))	{
+		if((slot = ring_produce(&pt->ring)) == NULL)	{
+			ring_backoff(&spins);
+			continue;
+		}
+		spins = 0;
+		if(++generated % reps == 0)
+			rekey(pt->gen, pt->rk, key);
+		fill_block(pt->gen, slot->buf, metrics_clock());
+		ring_produced(&pt->ring);
+	}
+	metrics_flush(metrics_clock());
 	return NULL;
 }
 
+/* Hand back the block written last and take the next filled one, going
+ * round-robin over the generators so no ring is left to go stale
+ */
 static unsigned char *get_available_data(void)
 {
 	static int last_id = 0;
-	struct per_thread *t;
+	struct per_thread *t = &tinfo[last_id];
+	unsigned int spins = 0;
 	int i = last_id;
 
-	// printf("Main: Enter get_avail: last = i = %d/%d\n", last_id, i);
+	if(t->cur != NULL)	{
+		ring_consumed(&t->ring);
+		t->cur = NULL;
+	}
 
-	t = &tinfo[last_id];
-	pthread_mutex_lock(&t->lock);
-	t->ready = false;
-	pthread_mutex_unlock(&t->lock);
-	pthread_cond_signal(&t->go);
-	pthread_mutex_lock(&mtx);
 	while(true)	{
-
-		/* Checks if any are ready */
 		for(int n = 0; n < nr_threads; n++)	{
 			i = (i + 1) % nr_threads;
 			t = &tinfo[i];
-			if(t->ready)	{
+			if((t->cur = ring_consume(&t->ring)) != NULL)	{
 				last_id = i;
-				pthread_mutex_unlock(&mtx);
-				// printf("Main: Got data - %d: unlock main & return\n", i);
-				return t->buf;
-			} else {
-				// printf("Main: %d not ready\n", i);
+				return t->cur->buf;
 			}
 		}
-		// printf("Main: no data ready -- wait for dataready\n");
-		pthread_cond_wait(&dataready, &mtx);
+		/* Charged to the generator whose turn it is, not the last polled */
+		__atomic_fetch_add(&tinfo[(last_id + 1) % nr_threads].stalls, 1,
+						   __ATOMIC_RELAXED);
+		ring_backoff(&spins);
 	}
 }
 
-int main(int argc, char *argv[])
+/* What gen_new() wants for the chosen backend: lanes or rounds */
+static int gen_param(void)
 {
-	unsigned char *data, *key;
-	unsigned char tmpdata[8];
-	unsigned char discard[1024];
-	unsigned int n;
-	struct rc4_ctx ctx;
-	size_t written = 0;
-	struct timespec t_start, t_end;
-	float mb, runtime;
-	int fd;
-
-	initialize_options(argc, argv);
-
-	pthread_t producers[nr_threads];
-
-	if (nr_threads > 200) {
-		fputs("Too many threads, must be <= 200\n", stderr);
-		return EXIT_FAILURE;
-	}
+	return (gen_type == GEN_CHACHA) ? gen_rounds : nr_lanes;
+}
 
-	data = malloc(bufsize);
-	key = malloc(klen);
-	tinfo = calloc(nr_threads, sizeof(struct per_thread));
+/* Seed the root generator every other one is derived from */
+static struct gen *new_root_gen(void)
+{
+	unsigned char tmpdata[32];
+	struct gen *g;
 
-	if(data == NULL || key == NULL || tinfo == NULL)	{
+	entropy_bytes(tmpdata, sizeof(tmpdata));
+	g = gen_new(gen_type, gen_param(), tmpdata, sizeof(tmpdata));
+	if(g == NULL)	{
 		fputs("Memory allocation error\n", stderr);
-		return EXIT_FAILURE;
+		exit(EXIT_FAILURE);
 	}
+	return g;
+}
 
-	if(print_conf)	{
-		char tstr[64];
-
-		if(total == 0) strcpy(tstr, "(unlimited)");
-		else snprintf(tstr, 63, "%ld", total);
-
-		fprintf(stderr,
-			"Block size: %ld\nBlocks / key: %ld\nKey bytes: %ld\n"
-			"Total: %s\nDestination: %s (%ld bytes skipped)%s",
-			bufsize, reps, klen, tstr,
-			(fname == NULL) ? "(stdout)" : fname, skip,
-			(direct_io) ? "\nDirect IO (O_DSYNC) in use\n" : "\n");
-
-	}
+/* Open destination @name (stdout if NULL) for writing, seek past the skip
+ * and with -S raise buf_align to what the device needs
+ */
+static int open_destination(const char *name)
+{
+	size_t bs;
+	int fd;
 
-	if(fname != NULL)	{
+	if(name != NULL)	{
 		int flags = O_CREAT | O_WRONLY;
-		fd = open(fname, flags | ((direct_io) ? O_DSYNC : 0), 0664);
+		fd = open(name, flags | ((direct_io) ? O_DIRECT : 0), 0664);
 		if(fd < 0)	{
 			char warn[2048];
-			snprintf(warn, 2047, "Opening '%s' for writing", fname);
+			snprintf(warn, 2047, "Opening '%s' for writing", name);
 			perror(warn);
 			exit(EXIT_FAILURE);
 		}
@@ -323,92 +741,2024 @@ int main(int argc, char *argv[])
 				perror("Failed to seek in output");
 				exit(EXIT_FAILURE);
 			}
-			if(debug) fprintf(stderr, "Seeked %ld bytes in output\n", skip);
+			if(debug) fprintf(stderr, "Seeked %ld bytes in %s\n", skip, name);
 		}
 	} else {
 		fd = fileno(stdout);
+		if(direct_io && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) < 0)	{
+			perror("Setting O_DIRECT on stdout");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	if(debug) fprintf(stderr, "Initalizing key with %ld bytes\n", klen);
+	/* O_DIRECT needs buffers, sizes and offsets aligned to the device */
+	if(direct_io)	{
+		bs = device_block_size(fd);
+		if(bufsize % bs != 0 || skip % bs != 0)	{
+			fprintf(stderr, "With -S the block size (%ld) and skip (%ld) "
+					"must be multiples of the device block size (%ld)\n",
+					bufsize, skip, bs);
+			exit(EXIT_FAILURE);
+		}
+		if(debug) fprintf(stderr, "Device block size %ld\n", bs);
+		if(bs > buf_align)
+			buf_align = bs;
+	}
+	return fd;
+}
 
-	/* First pass init key with 96 truly random bits */
-	read_random_bytes("/dev/random", tmpdata, sizeof(tmpdata));
-	rc4_init_key(&ctx, tmpdata, sizeof(tmpdata));
+/* Sync @fd and record that everything before @offset in pass @pass is on
+ * the device
+ */
+static void save_checkpoint(int fd, int pass, off_t offset)
+{
+	struct checkpoint c;
 
-	setup_signals();
+	checkpoint_due = 0;
+	if(fsync(fd) < 0 && (errno == EIO || errno == EBADF))	{
+		perror("Sync for checkpoint");
+		return;
+	}
 
-	if(clock_gettime(CLOCK_MONOTONIC, &t_start) != 0)	{
-		perror("clock_gettime");
-		return 1;
+	memset(&c, 0, sizeof(c));
+	snprintf(c.dest, sizeof(c.dest), "%s", fname);
+	gen_describe(gen_type, gen_param(), c.gen, sizeof(c.gen));
+	snprintf(c.passes, sizeof(c.passes), "%s",
+			 (scheme != NULL) ? scheme : "random");
+	c.block = bufsize;
+	c.total = total;
+	c.skip = skip;
+	c.pass = pass;
+	c.offset = offset;
+
+	if(checkpoint_save(ckpt_file, &c) != 0)
+		perror("Saving checkpoint");
+	else if(debug)
+		fprintf(stderr, "\nCheckpoint: pass %d, offset %ld\n", pass + 1,
+				(long)offset);
+}
+
+/* Where --resume picks up, the pass and destination offset from a
+ * checkpoint saved by a run with the same settings
+ */
+static void load_checkpoint(int *pass, off_t *offset)
+{
+	const char *passes_now = (scheme != NULL) ? scheme : "random";
+	struct checkpoint c;
+	char gen_now[64];
+
+	if(checkpoint_load(ckpt_file, &c) != 0)	{
+		char warn[2048];
+		snprintf(warn, 2047, "Reading checkpoint '%s'", ckpt_file);
+		perror(warn);
+		exit(EXIT_FAILURE);
+	}
+	gen_describe(gen_type, gen_param(), gen_now, sizeof(gen_now));
+	if(strcmp(c.dest, fname) != 0 || c.block != bufsize ||
+	   c.total != total || c.skip != skip || strcmp(c.passes, passes_now) != 0 ||
+	   strcmp(c.gen, gen_now) != 0)	{
+		fprintf(stderr, "Checkpoint is for %s with -b %ld -n %ld -s %ld "
+				"-P %s and generator %s, not these options (%s)\n", c.dest,
+				c.block, c.total, (long)c.skip, c.passes, c.gen, gen_now);
+		exit(EXIT_FAILURE);
+	}
+	if(c.pass < 0 || c.offset < skip || (c.offset - skip) % bufsize != 0)	{
+		fprintf(stderr, "Checkpoint offset %ld is not one this would write\n",
+				(long)c.offset);
+		exit(EXIT_FAILURE);
 	}
 
-	/* Discard some keystream because beginning of RC4 is weaker?
-	 * I mean, we're not really doing crypto here, but whatever...
-	 */
-	rc4_fill_buf(&ctx, discard, sizeof(discard));
+	fprintf(stderr, "Resuming pass %d at offset %ld\n", c.pass + 1,
+			(long)c.offset);
+	*pass = c.pass;
+	*offset = c.offset;
+}
 
-	if(nr_threads > 1)	{
-		init_threads(&ctx);
-		for(int i = 0; i < nr_threads; i++)	{
-			pthread_create(&producers[i], NULL, worker_generator, (void *)i);
-		}
+/* Generate and write with io_uring, keeping uring_depth registered buffers
+ * in flight and refilling each one as soon as its write completes.  Returns
+ * -1 without writing anything if io_uring can't be used here.
+ */
+static int uring_loop(int fd, struct gen *g, struct rekey_slot *rk,
+					  unsigned char *key, size_t *written)
+{
+	struct uring u;
+	struct iovec *iov;
+	struct uring_block	{
+		off_t off;
+		size_t done;
+		uint64_t start;
+		uint64_t rate;
+	} *blk;
+	size_t generated = 0, inflight = 0;
+	uint64_t t;
+	bool seekable;
+	off_t pos;
+	unsigned int i;
+	uint64_t id;
+	int res, ret = -1;
+
+	if(uring_init(&u, uring_depth) != 0)	{
+		if(debug) perror("io_uring setup, falling back to write()");
+		return -1;
+	}
+
+	iov = calloc(uring_depth, sizeof(struct iovec));
+	blk = calloc(uring_depth, sizeof(struct uring_block));
+	if(iov == NULL || blk == NULL)
+		goto out;
+	for(i = 0; i < uring_depth; i++)	{
+		if((iov[i].iov_base = alloc_buffer(bufsize, buf_align)) == NULL)
+			goto out;
+		iov[i].iov_len = bufsize;
+	}
+	if(uring_register_buffers(&u, iov, uring_depth) != 0)	{
+		if(debug) perror("io_uring buffers, falling back to write()");
+		goto out;
 	}
 
+	/* Pipes and the like write at the current position (offset -1) */
+	pos = lseek(fd, 0, SEEK_CUR);
+	seekable = (pos >= 0);
 
-	do {
-		read_random_bytes("/dev/urandom", key, klen);
+#define MORE_BLOCKS()	(!done && (total == 0 || generated < total))
+#define SUBMIT(b, o, n)	uring_write_fixed(&u, fd,						\
+							(unsigned char *)iov[(b)].iov_base + (o),	\
+							(n), seekable ? blk[(b)].off + (off_t)(o) : -1,	\
+							(b), (b))
 
-		/* Mix the state with more random bytes */
-		rc4_shuffle_key(&ctx, key, klen);
+	for(i = 0; i < uring_depth && MORE_BLOCKS(); i++)	{
+		if(generated % reps == 0)
+			rekey(g, rk, key);
+		blk[i].start = fill_block(g, iov[i].iov_base, metrics_clock());
+		blk[i].rate = throttle(bufsize, &blk[i].start);
+		blk[i].off = pos;
+		blk[i].done = 0;
+		pos += bufsize;
+		SUBMIT(i, 0, bufsize);
+		generated++;
+		inflight++;
+	}
+
+	while(inflight > 0)	{
+		if(uring_submit(&u, 1) < 0)	{
+			perror("io_uring submit");
+			exit(EXIT_FAILURE);
+		}
 
+		while(uring_reap(&u, &id, &res))	{
+			i = id;
+			if(res <= 0)	{
+				/* A zero-length write means the end of the device */
+				if(res == 0 || res == -ENOSPC)	{
+					if(!done) fputs("\nNo space left, exiting", stderr);
+				} else {
+					errno = -res;
+					perror("Writing data");
+					exit(EXIT_FAILURE);
+				}
+				done = true;
+				inflight--;
+				continue;
+			}
 
+			blk[i].done += res;
+			if(blk[i].done < bufsize)	{
+				SUBMIT(i, blk[i].done, bufsize - blk[i].done);
+				continue;
+			}
 
-		for(n = 0; n < reps && !done; n++)	{
-			unsigned char *d;
-			if(nr_threads > 1)	{
-				d = get_available_data();
-			} else {
-				rc4_fill_buf(&ctx, data, bufsize);
-				d = data;
+			inflight--;
+			(*written)++;
+			t = metrics_wrote(bufsize, blk[i].start);
+			rate_done(blk[i].rate, bufsize);
+
+			if(MORE_BLOCKS())	{
+				if(generated % reps == 0)
+					rekey(g, rk, key);
+				blk[i].start = fill_block(g, iov[i].iov_base, t);
+				blk[i].rate = throttle(bufsize, &blk[i].start);
+				blk[i].off = pos;
+				blk[i].done = 0;
+				pos += bufsize;
+				SUBMIT(i, 0, bufsize);
+				generated++;
+				inflight++;
 			}
+		}
+	}
+#undef SUBMIT
+#undef MORE_BLOCKS
+	ret = 0;
 
-			if(write_block(fd, d, bufsize) == 0)	{
+out:
+	if(iov != NULL)
+		for(i = 0; i < uring_depth; i++)
+			free_buffer(iov[i].iov_base);
+	free(iov);
+	free(blk);
+	uring_exit(&u);
+	return ret;
+}
+
+/* Generate straight into buffers that are gifted to a pipe with vmsplice(),
+ * so a reader on stdout gets the keystream without it ever being copied.
+ * The pipe holds on to a gifted page until it is read, so the blocks go
+ * round-robin over a ring holding more than the pipe can.  Small blocks are
+ * gifted SPLICE_BATCH bytes at a time to keep the syscalls down.  With -z
+ * a file or device gets the same through a pipe of our own, spliced on to
+ * it.  Returns -1 without writing anything if @fd can't be spliced to.
+ */
+#define SPLICE_BATCH	65536
+
+static int splice_loop(int fd, struct gen *g, struct rekey_slot *rk,
+					   unsigned char *key, size_t *written)
+{
+	unsigned char *ring;
+	struct stat st;
+	int pfd[2] = { -1, -1 };
+	int out, ret = -1;
+	size_t generated = 0, nbufs, batch, n, len, sent, chunk;
+	bool to_file;
+	uint64_t t, r0;
+	long psize;
+	loff_t off = 0;
+
+	if(fstat(fd, &st) != 0)
+		return -1;
+	if(S_ISFIFO(st.st_mode))	{
+		out = fd;
+		to_file = false;
+	} else if(splice_files && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))	{
+		if(pipe(pfd) != 0)
+			return -1;
+		out = pfd[1];
+		off = lseek(fd, 0, SEEK_CUR);
+		to_file = true;
+	} else {
+		return -1;
+	}
+
+	if((psize = fcntl(out, F_GETPIPE_SZ)) <= 0)
+		psize = 65536;
+
+	/* A pipe full in flight plus the batch being generated, a multiple of
+	 * the batch so one never wraps.  Going to a file, every batch is out
+	 * of the pipe before the next one is made.
+	 */
+	batch = (bufsize < SPLICE_BATCH) ? SPLICE_BATCH / bufsize : 1;
+	nbufs = batch;
+	if(!to_file)
+		nbufs = ((size_t)psize / bufsize / batch + 2) * batch;
+
+	if((ring = alloc_buffer(nbufs * bufsize, buf_align)) == NULL)
+		goto out;
+
+	if(debug) fprintf(stderr, "Splicing through a %ld byte pipe, %ld blocks "
+					  "of %ld\n", psize, nbufs, batch);
+
+	while(!done && (total == 0 || generated < total))	{
+		unsigned char *buf = ring + (generated % nbufs) * bufsize;
+
+		t = metrics_clock();
+		for(n = 0; n < batch && (total == 0 || generated + n < total); n++)	{
+			if((generated + n) % reps == 0)
+				rekey(g, rk, key);
+			t = fill_block(g, buf + n * bufsize, t);
+		}
+		len = n * bufsize;
+		r0 = throttle(len, &t);
+
+		/* Our own pipe is emptied into the file a pipe full at a time */
+		for(sent = 0; sent < len && !done; sent += chunk)	{
+			chunk = len - sent;
+			if(to_file && chunk > (size_t)psize)
+				chunk = psize;
+
+			if(gift_block(out, buf + sent, chunk) == 0)	{
 				done = true;
-			} else {
-				written++;
+				break;
 			}
+			if(!to_file)
+				continue;
 
-			if(total > 0 && written >= total)
-				done = true;
+			switch(splice_block(pfd[0], fd, &off, chunk))	{
+				case 0:
+					done = true;
+					break;
+				case -1:
+					/* Nothing written yet, let write() do it */
+					if(generated == 0 && sent == 0)	{
+						if(debug) perror("splice, falling back to write()");
+						goto out;
+					}
+					perror("Splicing data");
+					exit(EXIT_FAILURE);
+			}
 		}
+		if(done)
+			break;
 
-		if(debug && !done)
-			fprintf(stderr,
-				"Reinitalizing key, %ld blocks so far (%.3f Mb)\r",
-				written, (float)((written * bufsize) / 1000000.0));
-	} while(!done);
+		metrics_wrote(len, t);
+		rate_done(r0, len);
+		*written += n;
+		generated += n;
+	}
+	ret = 0;
 
-	free(data);
-	free(key);
+out:
+	free_buffer(ring);
+	if(pfd[0] >= 0)	{
+		close(pfd[0]);
+		close(pfd[1]);
+	}
+	return ret;
+}
 
-	if(fsync(fd) < 0)	{
-		if(errno == EIO || errno == EBADF)	{
-			perror("Final sync");
-			return EXIT_FAILURE;
+/* Several destinations: each gets a ring and a writer thread draining it,
+ * the generator threads are shared and fill whichever rings have room.  A
+ * generator claims a device before touching its ring, so every ring still
+ * has a single producer at a time.  Slow disks keep their rings full and
+ * get skipped, the generation goes to the ones that keep up.
+ */
+static struct device	{
+	struct ring ring;
+	const char *name;
+	int fd;
+	int claimed;
+	bool finished;
+	size_t written;
+	double runtime;
+	pthread_t writer;
+} *devs;
+
+static double elapsed(struct timespec *since)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - since->tv_sec) +
+		   (double)(t.tv_nsec - since->tv_nsec) / 1000000000.0;
+}
+
+static void *device_writer(void *arg)
+{
+	struct device *dev = arg;
+	struct ring_slot *slot;
+	struct timespec t_start;
+	unsigned int spins = 0;
+	uint64_t t0, r0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+	while(!__atomic_load_n(&done, __ATOMIC_RELAXED))	{
+		if((slot = ring_consume(&dev->ring)) == NULL)	{
+			ring_backoff(&spins);
+			continue;
 		}
+		spins = 0;
+		t0 = metrics_clock();
+		r0 = throttle(bufsize, &t0);
+		if(write_block(dev->fd, slot->buf, bufsize) == 0)	{
+			if(debug) fprintf(stderr, " (%s)\n", dev->name);
+			break;
+		}
+		metrics_wrote(bufsize, t0);
+		rate_done(r0, bufsize);
+		ring_consumed(&dev->ring);
+		if(++dev->written >= total && total > 0)
+			break;
+	}
+
+	if(fsync(dev->fd) < 0 && (errno == EIO || errno == EBADF))	{
+		fprintf(stderr, "Final sync of %s: %s\n", dev->name, strerror(errno));
+	}
+	dev->runtime = elapsed(&t_start);
+	metrics_flush(metrics_clock());
+	__atomic_store_n(&dev->finished, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *device_generator(void *arg)
+{
+	struct per_thread *pt = arg;
+	unsigned char key[256];
+	struct ring_slot *slot;
+	unsigned int spins = 0;
+	size_t generated = 0;
+	int d = pt->id % nr_dests;
+	int live, filled;
+
+	pin_worker(pt->id);
+	while(!__atomic_load_n(&done, __ATOMIC_RELAXED))	{
+		live = filled = 0;
+		for(int n = 0; n < nr_dests; n++, d = (d + 1) % nr_dests)	{
+			struct device *dev = &devs[d];
+
+			if(__atomic_load_n(&dev->finished, __ATOMIC_ACQUIRE))
+				continue;
+			live++;
+			if(__atomic_exchange_n(&dev->claimed, 1, __ATOMIC_ACQUIRE))
+				continue;
+			while((slot = ring_produce(&dev->ring)) != NULL)	{
+				if(generated++ % reps == 0)
+					rekey(pt->gen, pt->rk, key);
+				fill_block(pt->gen, slot->buf, metrics_clock());
+				ring_produced(&dev->ring);
+				filled++;
+			}
+			__atomic_store_n(&dev->claimed, 0, __ATOMIC_RELEASE);
+		}
+		if(live == 0)
+			break;
+		if(filled == 0)	{
+			__atomic_fetch_add(&pt->stalls, 1, __ATOMIC_RELAXED);
+			ring_backoff(&spins);
+		} else {
+			spins = 0;
+		}
+	}
+	metrics_flush(metrics_clock());
+	return NULL;
+}
+
+static int multi_main(void)
+{
+	struct gen *root;
+	struct timespec t_start;
+	size_t written = 0;
+	float mb, runtime;
+	int nr_gen = nr_threads;
+	int i, started, err, ret = EXIT_SUCCESS;
+
+	pthread_t gens[nr_gen];
+	bool writing[nr_dests];
+
+	devs = calloc(nr_dests, sizeof(struct device));
+	tinfo = calloc(nr_gen, sizeof(struct per_thread));
+	if(devs == NULL || tinfo == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	for(i = 0; i < nr_dests; i++)	{
+		devs[i].name = fnames[i];
+		devs[i].fd = open_destination(fnames[i]);
+	}
+	for(i = 0; i < nr_dests; i++)	{
+		if(ring_init(&devs[i].ring, ring_depth, bufsize, buf_align, -1) != 0)	{
+			fputs("Memory allocation error\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(debug) fprintf(stderr, "%d destinations, %d generator threads\n",
+					  nr_dests, nr_gen);
+
+	root = new_root_gen();
+	init_threads(root, false);
+
+	setup_signals();
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+	/* A device whose writer didn't start counts as finished, the
+	 * generators pass it over
+	 */
+	for(i = 0; i < nr_dests; i++)	{
+		err = pthread_create(&devs[i].writer, NULL, device_writer, &devs[i]);
+		if((writing[i] = (err == 0)) == false)	{
+			errno = err;
+			perror("Starting writer");
+			__atomic_store_n(&devs[i].finished, true, __ATOMIC_RELEASE);
+			ret = EXIT_FAILURE;
+		}
+	}
+	for(started = 0; started < nr_gen; started++)	{
+		if((err = pthread_create(&gens[started], NULL, device_generator,
+								 &tinfo[started])) != 0)	{
+			errno = err;
+			perror("Starting generator");
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	/* Without a generator the writers would wait for ever */
+	if(started == 0)
+		__atomic_store_n(&done, true, __ATOMIC_RELAXED);
+
+	for(i = 0; i < nr_dests; i++)
+		if(writing[i])
+			pthread_join(devs[i].writer, NULL);
+	/* Writers are all finished, generators notice and drop out */
+	for(i = 0; i < started; i++)
+		pthread_join(gens[i], NULL);
+
+	runtime = elapsed(&t_start);
+
+	fputc('\n', stderr);
+	for(i = 0; i < nr_dests; i++)	{
+		mb = (float)((devs[i].written * bufsize) / 1000000.0f);
+		if(writing[i])
+			fprintf(stderr, "%s: %ld blocks (%.3f Mb) in %.3fs (%.2f Mb/s)\n",
+					devs[i].name, devs[i].written, mb, devs[i].runtime,
+					mb / devs[i].runtime);
+		written += devs[i].written;
+		ring_free(&devs[i].ring);
+		close(devs[i].fd);
+	}
+	if(debug)
+		for(i = 0; i < nr_gen; i++)
+			fprintf(stderr, "Generator %d: found no ring with room %lu times\n",
+					i, tinfo[i].stalls);
+
+	mb = (float)((written * bufsize) / 1000000.0f);
+	fprintf(stderr, "Finished, %ld blocks (%.3f Mb) written in %.3fs (%.2f Mb/s)\n",
+					written, mb, runtime, mb / runtime);
+
+	free_threads();
+	gen_free(root);
+	free(devs);
+	return ret;
+}
+
+/* Sharded mode: the destination is cut into byte ranges and every worker
+ * thread takes ranges off the list, generating with its own cipher state
+ * and writing with pwrite() so nobody shares a file offset
+ */
+struct range	{
+	off_t off;
+	off_t len;
+};
+
+static struct range *ranges;
+static size_t nr_ranges;
+static size_t next_range = 0;
+static int range_fd;
+
+/* Overwrite [@off, @end) of @fd with keystream from @pt's generator, which
+ * rekeys every reps blocks counting in *@generated.  False if a write
+ * failed or we were stopped before the end.
+ */
+static bool overwrite_range(struct per_thread *pt, int fd, unsigned char *buf,
+							off_t off, off_t end, size_t *generated)
+{
+	unsigned char key[256];
+	uint64_t t = metrics_clock(), r0;
+
+	while(off < end && !__atomic_load_n(&done, __ATOMIC_RELAXED))	{
+		size_t n = (end - off < (off_t)bufsize) ? (size_t)(end - off)
+												 : bufsize;
+
+		if((*generated)++ % reps == 0)
+			rekey(pt->gen, pt->rk, key);
+		t = fill_block(pt->gen, buf, t);
+		r0 = throttle(n, &t);
+		if(pwrite_block(fd, buf, n, off) == 0)
+			return false;
+		t = metrics_wrote(n, t);
+		rate_done(r0, n);
+		off += n;
+		pt->bytes += n;
+	}
+	return off >= end;
+}
+
+static void *range_worker(void *arg)
+{
+	struct per_thread *pt = arg;
+	unsigned char *buf;
+	size_t generated = 0;
+	size_t r;
+
+	pin_worker(pt->id);
+	if((buf = alloc_buffer(bufsize, buf_align)) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	while(!__atomic_load_n(&done, __ATOMIC_RELAXED))	{
+		off_t off, end;
+
+		r = __atomic_fetch_add(&next_range, 1, __ATOMIC_RELAXED);
+		if(r >= nr_ranges)
+			break;
+
+		off = ranges[r].off;
+		end = off + ranges[r].len;
+		if(debug) fprintf(stderr, "Worker %d: range %ld-%ld\n",
+						  pt->id, (long)off, (long)end);
+
+		if(!overwrite_range(pt, range_fd, buf, off, end, &generated))
+			done = true;
+	}
+
+	free_buffer(buf);
+	metrics_flush(metrics_clock());
+	return NULL;
+}
+
+/* Run nr_threads range workers over the ranges list and report */
+static int run_ranges(void)
+{
+	struct gen *root;
+	struct timespec t_start;
+	size_t bytes = 0;
+	float mb, runtime;
+	int i, err, started;
+
+	pthread_t workers[nr_threads];
+
+	if((tinfo = calloc(nr_threads, sizeof(struct per_thread))) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	root = new_root_gen();
+	init_threads(root, false);
+
+	setup_signals();
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+	/* The ranges go to whichever workers did start */
+	for(started = 0; started < nr_threads; started++)	{
+		if((err = pthread_create(&workers[started], NULL, range_worker,
+								 &tinfo[started])) != 0)	{
+			errno = err;
+			perror("Starting worker");
+			break;
+		}
+	}
+	if(started == 0)	{
+		free_threads();
+		gen_free(root);
+		return EXIT_FAILURE;
+	}
+	for(i = 0; i < started; i++)	{
+		pthread_join(workers[i], NULL);
+		bytes += tinfo[i].bytes;
+	}
+
+	if(fsync(range_fd) < 0 && (errno == EIO || errno == EBADF))	{
+		perror("Final sync");
+		return EXIT_FAILURE;
+	}
+	runtime = elapsed(&t_start);
+
+	if(debug)
+		for(i = 0; i < nr_threads; i++)
+			fprintf(stderr, "\nWorker %d: %.3f Mb", i,
+					tinfo[i].bytes / 1000000.0f);
+
+	mb = (float)(bytes / 1000000.0f);
+	fprintf(stderr, "\nFinished, %ld blocks (%.3f Mb) written in %.3fs (%.2f Mb/s)\n",
+					bytes / bufsize, mb, runtime, mb / runtime);
+
+	free_threads();
+	gen_free(root);
+	return EXIT_SUCCESS;
+}
+
+/* Cut [skip, skip + -n blocks or the end of the device) in nr_shards
+ * contiguous block-aligned shards, one per worker
+ */
+static int shard_main(void)
+{
+	off_t len, per, off;
+	int i;
+
+	range_fd = open_destination(fname);
+
+	if(total > 0)	{
+		len = (off_t)total * bufsize;
+	} else if((len = device_size(range_fd)) < 0 || (len -= skip) <= 0)	{
+		fputs("Sharding needs -n or a destination with a size\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if((ranges = calloc(nr_shards, sizeof(struct range))) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	per = (len / nr_shards + bufsize - 1) / bufsize * bufsize;
+	for(i = 0, off = skip; i < nr_shards && off < skip + len; i++)	{
+		ranges[i].off = off;
+		ranges[i].len = (skip + len - off < per) ? skip + len - off : per;
+		off += ranges[i].len;
+	}
+	nr_ranges = i;
+	nr_threads = nr_shards;
+
+	if(debug) fprintf(stderr, "%ld bytes in %ld shards of %ld\n",
+					  (long)len, nr_ranges, (long)per);
+
+	i = run_ranges();
+	free(ranges);
+	close(range_fd);
+	return i;
+}
+
+/* Walk the extents of a regular file that hold data and overwrite only
+ * those, a sparse image keeps its holes.  Extents are cut in pieces of at
+ * most EXTENT_PIECE so that a few big ones still keep every worker busy.
+ */
+#define EXTENT_PIECE	(64L * 1024 * 1024)
+
+static int extent_main(void)
+{
+	struct extent *ext;
+	struct stat st;
+	off_t end, allocated = 0, piece, off;
+	ssize_t nr_ext, i;
+	size_t cap = 0;
+	int ret;
+
+	range_fd = open_destination(fname);
+	if(fstat(range_fd, &st) != 0 || !S_ISREG(st.st_mode))	{
+		fputs("Extents (-E) need a regular file\n", stderr);
+		return EXIT_FAILURE;
+	}
+	end = st.st_size;
+	if(total > 0 && skip + (off_t)(total * bufsize) < end)
+		end = skip + total * bufsize;
+
+	if((nr_ext = data_extents(range_fd, skip, end, &ext)) < 0)	{
+		perror("Listing extents");
+		return EXIT_FAILURE;
+	}
+
+	piece = (EXTENT_PIECE > (off_t)bufsize) ? (off_t)(EXTENT_PIECE / bufsize * bufsize)
+											: (off_t)bufsize;
+	for(i = 0; i < nr_ext; i++)	{
+		allocated += ext[i].len;
+		cap += (ext[i].len + piece - 1) / piece;
+	}
+	if((ranges = calloc(cap + 1, sizeof(struct range))) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+	nr_ranges = 0;
+	for(i = 0; i < nr_ext; i++)	{
+		for(off = ext[i].off; off < ext[i].off + ext[i].len; off += piece)	{
+			ranges[nr_ranges].off = off;
+			ranges[nr_ranges].len = (ext[i].off + ext[i].len - off < piece) ?
+									ext[i].off + ext[i].len - off : piece;
+			nr_ranges++;
+		}
+	}
+	free(ext);
+
+	if(debug || print_conf)
+		fprintf(stderr, "%.3f Mb of %.3f Mb hold data, in %ld extents\n",
+				allocated / 1000000.0f, (end - skip) / 1000000.0f, (long)nr_ext);
+	metrics_set_total(allocated);
+
+	ret = run_ranges();
+	free(ranges);
+	close(range_fd);
+	return ret;
+}
+
+/* Tree mode: the destinations are walked with nftw() and every regular
+ * file in them overwritten to its size, fsync'd and with -X unlinked, the
+ * directories removed last.  The walk hands out tasks round robin to one
+ * deque per worker: small files in batches, files over TREE_SPLIT in
+ * TREE_PIECE pieces that whoever gets to them writes, the first one opening
+ * and the last one syncing the file.  Files are opened by path once the
+ * walk has moved on, so each is checked to still be the one it saw.  A
+ * worker takes from the back of its own deque and when that is empty
+ * steals from the front of the others'.  Generators carry on from file to
+ * file, rekeyed every reps blocks as anywhere else.
+ */
+#define TREE_BATCH_FILES	64
+#define TREE_BATCH_BYTES	(4L * 1024 * 1024)
+#define TREE_SPLIT			(64L * 1024 * 1024)
+#define TREE_PIECE			(16L * 1024 * 1024)
+
+struct tree_file	{
+	struct tree_file *next;		/* the rest of its batch */
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	int fd;						/* of a split file, shared by the pieces,
+								   TREE_UNOPENED or TREE_BADFD */
+	int pieces;					/* of a split file, still to be written */
+	bool failed;
+	char path[];
+};
+
+#define TREE_UNOPENED	-1
+#define TREE_BADFD		-2
+
+struct tree_task	{
+	struct tree_file *file;		/* a batch of whole files, or a split one */
+	off_t off;
+	off_t len;					/* of the piece, 0 for a batch */
+};
+
+static struct tree_queue	{
+	pthread_mutex_t lock;
+	struct tree_task *tasks;
+	size_t head, tail, cap;		/* tasks[head, tail) are waiting */
+	unsigned long steals;
+} *queues;
+
+static size_t tree_pending = 0;		/* tasks queued or being written */
+static bool tree_walked = false;
+static int next_queue = 0;
+
+/* Only the walk touches these */
+static struct tree_file *batch = NULL;
+static size_t batch_files = 0;
+static off_t batch_bytes = 0;
+static size_t tree_files = 0;
+static off_t tree_bytes = 0;
+static char **tree_dirs = NULL;
+static size_t nr_tree_dirs = 0, tree_dirs_cap = 0;
+
+static size_t tree_shredded = 0;
+static size_t tree_errors = 0;
+
+static void tree_push(struct tree_file *f, off_t off, off_t len)
+{
+	struct tree_queue *q = &queues[next_queue];
+	struct tree_task *t;
+
+	next_queue = (next_queue + 1) % nr_threads;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->tail == q->cap && q->head > 0)	{
+		memmove(q->tasks, q->tasks + q->head,
+				(q->tail - q->head) * sizeof(struct tree_task));
+		q->tail -= q->head;
+		q->head = 0;
+	}
+	if(q->tail == q->cap)	{
+		q->cap = (q->cap) ? q->cap * 2 : 256;
+		if((t = realloc(q->tasks, q->cap * sizeof(struct tree_task))) == NULL)	{
+			fputs("Memory allocation error\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		q->tasks = t;
+	}
+	t = &q->tasks[q->tail++];
+	t->file = f;
+	t->off = off;
+	t->len = len;
+	__atomic_fetch_add(&tree_pending, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Worker @id's next task, its own newest or the oldest of another's */
+static bool tree_take(int id, struct tree_task *t)
+{
+	for(int i = 0; i < nr_threads; i++)	{
+		struct tree_queue *q = &queues[(id + i) % nr_threads];
+		bool got = false;
+
+		pthread_mutex_lock(&q->lock);
+		if(q->head < q->tail)	{
+			*t = (i == 0) ? q->tasks[--q->tail] : q->tasks[q->head++];
+			got = true;
+		}
+		pthread_mutex_unlock(&q->lock);
+		if(got)	{
+			if(i > 0)
+				queues[id].steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void tree_warn(const char *what, const char *path)
+{
+	char warn[4200];
+
+	snprintf(warn, sizeof(warn), "%s '%s'", what, path);
+	perror(warn);
+	__atomic_fetch_add(&tree_errors, 1, __ATOMIC_RELAXED);
+}
+
+/* Open @f for writing, -1 with errno set if that fails, ESTALE if it isn't
+ * the file the walk found any more
+ */
+static int tree_open(struct tree_file *f)
+{
+	struct stat st;
+	int fd;
+
+	if((fd = open(f->path, O_WRONLY | O_NOFOLLOW)) < 0)
+		return -1;
+	if(fstat(fd, &st) != 0 || st.st_dev != f->dev || st.st_ino != f->ino)	{
+		close(fd);
+		errno = ESTALE;
+		return -1;
+	}
+	return fd;
+}
+
+static void tree_open_failed(struct tree_file *f)
+{
+	if(errno != ESTALE)	{
+		tree_warn("Opening", f->path);
+		return;
+	}
+	fprintf(stderr, "'%s' is no longer the file walked, skipped\n", f->path);
+	__atomic_fetch_add(&tree_errors, 1, __ATOMIC_RELAXED);
+}
+
+/* A split file's fd, opened by whichever of its pieces comes first */
+static int tree_piece_fd(struct tree_file *f)
+{
+	int fd = __atomic_load_n(&f->fd, __ATOMIC_ACQUIRE), nfd, err;
+
+	if(fd != TREE_UNOPENED)
+		return fd;
+	nfd = tree_open(f);
+	err = errno;
+	if(__atomic_compare_exchange_n(&f->fd, &fd, (nfd < 0) ? TREE_BADFD : nfd,
+								   false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))	{
+		/* Only the piece that got to open it says why it couldn't */
+		if(nfd < 0)	{
+			errno = err;
+			tree_open_failed(f);
+		}
+		return nfd;
+	}
+	if(nfd >= 0)
+		close(nfd);
+	return fd;
+}
+
+/* Sync and close @f, unlink it with -X and free it */
+static void tree_finish(struct tree_file *f, int fd)
+{
+	if(fd < 0)	{
+		free(f);
+		return;
+	}
+	if(!f->failed && fsync(fd) != 0)	{
+		tree_warn("Syncing", f->path);
+		f->failed = true;
+	}
+	close(fd);
+	if(!f->failed)	{
+		if(unlink_files && unlink(f->path) != 0)
+			tree_warn("Unlinking", f->path);
+		else
+			__atomic_fetch_add(&tree_shredded, 1, __ATOMIC_RELAXED);
+	}
+	free(f);
+}
+
+static void tree_batch(struct per_thread *pt, unsigned char *buf,
+					   size_t *generated, struct tree_file *f)
+{
+	struct tree_file *next;
+	int fd;
+
+	for(; f != NULL; f = next)	{
+		next = f->next;
+		if((fd = tree_open(f)) < 0)	{
+			tree_open_failed(f);
+			free(f);
+			continue;
+		}
+		f->failed = !overwrite_range(pt, fd, buf, 0, f->size, generated);
+		tree_finish(f, fd);
+	}
+}
+
+static void tree_piece(struct per_thread *pt, unsigned char *buf,
+					   size_t *generated, struct tree_task *t)
+{
+	struct tree_file *f = t->file;
+	int fd = tree_piece_fd(f);
+
+	if(fd < 0 || !overwrite_range(pt, fd, buf, t->off, t->off + t->len, generated))
+		__atomic_store_n(&f->failed, true, __ATOMIC_RELAXED);
+	if(__atomic_sub_fetch(&f->pieces, 1, __ATOMIC_ACQ_REL) == 0)
+		tree_finish(f, fd);
+}
+
+static void *tree_worker(void *arg)
+{
+	struct per_thread *pt = arg;
+	struct tree_task t;
+	struct timespec nap = { 0, 100000 };
+	unsigned char *buf;
+	size_t generated = 0;
+	unsigned int idle = 0;
+
+	pin_worker(pt->id);
+	if((buf = alloc_buffer(bufsize, buf_align)) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	while(!__atomic_load_n(&done, __ATOMIC_RELAXED))	{
+		if(!tree_take(pt->id, &t))	{
+			if(__atomic_load_n(&tree_walked, __ATOMIC_ACQUIRE) &&
+			   __atomic_load_n(&tree_pending, __ATOMIC_ACQUIRE) == 0)
+				break;
+			/* Waiting on the walk, which may take a while */
+			pt->stalls++;
+			if(++idle < 64)
+				sched_yield();
+			else
+				nanosleep(&nap, NULL);
+			continue;
+		}
+		idle = 0;
+
+		if(t.len > 0)
+			tree_piece(pt, buf, &generated, &t);
+		else
+			tree_batch(pt, buf, &generated, t.file);
+		__atomic_fetch_sub(&tree_pending, 1, __ATOMIC_RELEASE);
+	}
+
+	free_buffer(buf);
+	metrics_flush(metrics_clock());
+	return NULL;
+}
+
+static void tree_flush(void)
+{
+	if(batch != NULL)
+		tree_push(batch, 0, 0);
+	batch = NULL;
+	batch_files = 0;
+	batch_bytes = 0;
+}
+
+static void tree_add(const char *path, const struct stat *st)
+{
+	size_t plen = strlen(path) + 1;
+	struct tree_file *f;
+	off_t size, off, piece;
+	int pieces;
+
+	if((f = malloc(sizeof(*f) + plen)) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(f->path, path, plen);
+	f->size = size = st->st_size;
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	f->fd = TREE_UNOPENED;
+	f->failed = false;
+	tree_files++;
+	tree_bytes += size;
+
+	if(size <= TREE_SPLIT)	{
+		f->next = batch;
+		batch = f;
+		batch_bytes += size;
+		if(++batch_files == TREE_BATCH_FILES || batch_bytes >= TREE_BATCH_BYTES)
+			tree_flush();
+		return;
+	}
+
+	piece = (TREE_PIECE > (off_t)bufsize) ? (off_t)(TREE_PIECE / bufsize * bufsize)
+										  : (off_t)bufsize;
+	/* Every piece is counted before any is queued, f may be gone after */
+	f->pieces = pieces = (size + piece - 1) / piece;
+	for(off = 0; pieces-- > 0; off += piece)
+		tree_push(f, off, (size - off < piece) ? size - off : piece);
+}
+
+static int tree_visit(const char *path, const struct stat *st, int type,
+					  struct FTW *ftw)
+{
+	char **d;
+
+	(void)ftw;
+	if(done)
+		return 1;
+
+	switch(type)	{
+		case FTW_F:
+			if(S_ISREG(st->st_mode))
+				tree_add(path, st);
+			break;
+		case FTW_DP:
+			if(!unlink_files)
+				break;
+			if(nr_tree_dirs == tree_dirs_cap)	{
+				tree_dirs_cap = (tree_dirs_cap) ? tree_dirs_cap * 2 : 64;
+				if((d = realloc(tree_dirs, tree_dirs_cap * sizeof(char *))) == NULL)	{
+					fputs("Memory allocation error\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+				tree_dirs = d;
+			}
+			if((tree_dirs[nr_tree_dirs++] = strdup(path)) == NULL)	{
+				fputs("Memory allocation error\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case FTW_DNR:
+		case FTW_NS:
+			errno = (errno) ? errno : EACCES;
+			tree_warn("Reading", path);
+			break;
+	}
+	return 0;
+}
+
+static int tree_main(void)
+{
+	struct gen *root;
+	struct timespec t_start;
+	unsigned long steals = 0;
+	size_t bytes = 0, i;
+	float mb, runtime;
+	int w, started, err;
+
+	pthread_t workers[nr_threads];
+
+	tinfo = calloc(nr_threads, sizeof(struct per_thread));
+	queues = calloc(nr_threads, sizeof(struct tree_queue));
+	if(tinfo == NULL || queues == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+	for(w = 0; w < nr_threads; w++)
+		pthread_mutex_init(&queues[w].lock, NULL);
+
+	root = new_root_gen();
+	init_threads(root, false);
+
+	setup_signals();
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+	/* Queues of workers that didn't start are stolen from by the rest */
+	for(started = 0; started < nr_threads; started++)	{
+		if((err = pthread_create(&workers[started], NULL, tree_worker,
+								 &tinfo[started])) != 0)	{
+			errno = err;
+			perror("Starting worker");
+			break;
+		}
+	}
+	if(started == 0)
+		goto out;
+
+	/* Post-order, so directories come after what is in them */
+	for(w = 0; w < nr_dests && !done; w++)
+		if(nftw(fnames[w], tree_visit, 64, FTW_PHYS | FTW_DEPTH | FTW_MOUNT) < 0)
+			tree_warn("Walking", fnames[w]);
+	tree_flush();
+	metrics_set_total(tree_bytes);
+	if(debug) fprintf(stderr, "Walked %ld files (%.3f Mb) in %.3fs\n",
+					  tree_files, tree_bytes / 1000000.0f, elapsed(&t_start));
+	__atomic_store_n(&tree_walked, true, __ATOMIC_RELEASE);
+
+	for(w = 0; w < started; w++)	{
+		pthread_join(workers[w], NULL);
+		bytes += tinfo[w].bytes;
+		steals += queues[w].steals;
+	}
+	runtime = elapsed(&t_start);
+
+	/* Whatever wasn't shredded keeps its directory */
+	for(i = 0; i < nr_tree_dirs; i++)	{
+		if(!done && rmdir(tree_dirs[i]) != 0 && errno != ENOTEMPTY)
+			tree_warn("Removing", tree_dirs[i]);
+		free(tree_dirs[i]);
+	}
+	free(tree_dirs);
+
+	if(debug)
+		for(w = 0; w < nr_threads; w++)
+			fprintf(stderr, "Worker %d: %.3f Mb, %lu steals\n", w,
+					tinfo[w].bytes / 1000000.0f, queues[w].steals);
+
+	mb = (float)(bytes / 1000000.0f);
+	fprintf(stderr, "\nFinished, %ld of %ld files (%.3f Mb) shredded in %.3fs "
+			"(%.2f Mb/s), %lu tasks stolen\n", tree_shredded, tree_files, mb,
+			runtime, mb / runtime, steals);
+
+out:
+	for(w = 0; w < nr_threads; w++)	{
+		pthread_mutex_destroy(&queues[w].lock);
+		free(queues[w].tasks);
+	}
+	free(queues);
+	free_threads();
+	gen_free(root);
+	return (started > 0 && tree_shredded == tree_files && tree_errors == 0)
+		   ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Multi-pass mode: the destination is overwritten once per pass of the
+ * scheme, each pass a fixed pattern or keystream.  With -V every pass is
+ * read back and compared, random passes by replaying the generator from a
+ * snapshot taken as the pass started together with the keys it drew.  The
+ * read-back of pass N runs in its own thread under the writes of pass N+1,
+ * which trail it so no block is overwritten before it was checked.
+ */
+#define MAX_PASSES	32
+
+enum pass_kind	{ PASS_PATTERN, PASS_RANDOM };
+
+static struct pass	{
+	enum pass_kind kind;
+	const char *name;
+	unsigned char pattern[32];
+	size_t plen;
+	struct gen *snap;		/* generator as the pass started */
+	unsigned char *keys;	/* every key the pass drew, klen bytes each */
+} passes[MAX_PASSES];
+static int nr_passes = 0;
+
+static const struct	{
+	const char *name;
+	const char *passes;
+} schemes[] = {
+	{ "dod", "zero,one,random" },
+	{ NULL, NULL }
+};
+
+static int hexval(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static int parse_pattern(const char *hex, struct pass *p)
+{
+	size_t n = strlen(hex);
+
+	if(n == 0 || n % 2 != 0 || n / 2 > sizeof(p->pattern))
+		return -1;
+	for(size_t i = 0; i < n; i += 2)	{
+		int hi = hexval(hex[i]), lo = hexval(hex[i + 1]);
+		if(hi < 0 || lo < 0)
+			return -1;
+		p->pattern[i / 2] = (hi << 4) | lo;
+	}
+	p->plen = n / 2;
+	return 0;
+}
+
+/* Fill passes[] from a named scheme or a comma separated list of passes,
+ * the names point into a copy of @spec kept for the life of the program
+ */
+static int parse_scheme(const char *spec)
+{
+	char *list, *tok, *save;
+
+	for(int i = 0; schemes[i].name != NULL; i++)
+		if(!strcmp(spec, schemes[i].name))
+			spec = schemes[i].passes;
+
+	if((list = strdup(spec)) == NULL)
+		return -1;
+
+	for(tok = strtok_r(list, ",", &save); tok != NULL;
+		tok = strtok_r(NULL, ",", &save))	{
+		struct pass *p = &passes[nr_passes];
+
+		if(nr_passes == MAX_PASSES)	{
+			fprintf(stderr, "At most %d passes\n", MAX_PASSES);
+			return -1;
+		}
+		p->kind = PASS_PATTERN;
+		p->name = tok;
+		p->plen = 1;
+		if(!strcmp(tok, "zero"))	{
+			p->pattern[0] = 0x00;
+		} else if(!strcmp(tok, "one"))	{
+			p->pattern[0] = 0xff;
+		} else if(!strcmp(tok, "random"))	{
+			p->kind = PASS_RANDOM;
+		} else if(strncmp(tok, "0x", 2) != 0 ||
+				  parse_pattern(tok + 2, p) != 0)	{
+			fprintf(stderr, "Unknown pass '%s'\n", tok);
+			return -1;
+		}
+		nr_passes++;
+	}
+	return (nr_passes > 0) ? 0 : -1;
+}
+
+/* Produce block @b of pass @p in @buf, which holds block @b - 1 of the same
+ * pass unless @fresh.  Random passes draw a new key every reps blocks into
+ * the key log, or take it back out of the log when @replay.
+ */
+static void pass_block(struct pass *p, struct gen *g, unsigned char *buf,
+					   size_t b, bool fresh, bool replay)
+{
+	unsigned char tmp[256], *key;
+	size_t phase;
+
+	if(p->kind == PASS_RANDOM)	{
+		if(b % reps == 0)	{
+			key = (p->keys != NULL) ? p->keys + (b / reps) * klen : tmp;
+			if(!replay)
+				entropy_bytes(key, klen);
+			gen_reseed(g, key, klen);
+		}
+		fill_block(g, buf, metrics_clock());
+		return;
+	}
+
+	/* A pattern that divides the block gives the same block every time */
+	if(!fresh && bufsize % p->plen == 0)
+		return;
+	phase = (b * bufsize) % p->plen;
+	for(size_t i = 0; i < bufsize; i++)
+		buf[i] = p->pattern[(phase + i) % p->plen];
+}
+
+struct verifier	{
+	struct pass *p;
+	int fd;
+	off_t start;		/* where the pass started, above 0 when resumed */
+	off_t len;
+	off_t verified;		/* read back and matching up to here, the writer's limit */
+	off_t bad;			/* offset of the first mismatch, -1 if none */
+	bool complete;
+	double runtime;
+	pthread_t thread;
+};
+
+static void *verify_pass(void *arg)
+{
+	struct verifier *v = arg;
+	unsigned char *want, *got;
+	struct gen *g = NULL;
+	struct timespec t_start;
+	off_t off = v->start;
+	size_t b, n, r;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+	want = alloc_buffer(bufsize, buf_align);
+	got = alloc_buffer(bufsize, buf_align);
+	if(v->p->kind == PASS_RANDOM)
+		g = gen_copy(v->p->snap);
+	if(want == NULL || got == NULL || (v->p->kind == PASS_RANDOM && g == NULL))	{
+		fputs("Memory allocation error\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	for(b = off / bufsize; off < v->len && !__atomic_load_n(&done, __ATOMIC_RELAXED);
+		b++)	{
+		n = (v->len - off < (off_t)bufsize) ? (size_t)(v->len - off) : bufsize;
+
+		pass_block(v->p, g, want, b, off == v->start, true);
+		r = pread_block(v->fd, got, n, skip + off);
+		if(r != n || memcmp(want, got, n) != 0)	{
+			size_t i = 0;
+			while(i < r && want[i] == got[i])
+				i++;
+			v->bad = skip + off + i;
+			__atomic_store_n(&done, true, __ATOMIC_RELAXED);
+			break;
+		}
+		off += n;
+		__atomic_store_n(&v->verified, off, __ATOMIC_RELEASE);
+	}
+	v->complete = (off == v->len);
+	v->runtime = elapsed(&t_start);
+
+	/* Whatever happened, don't leave the writer waiting on us */
+	__atomic_store_n(&v->verified, v->len, __ATOMIC_RELEASE);
+	gen_free(g);
+	free_buffer(want);
+	free_buffer(got);
+	metrics_flush(metrics_clock());
+	return NULL;
+}
+
+/* Wait for a read-back to end and say how it went */
+static int finish_verify(struct verifier *v)
+{
+	int i = v->p - passes;
+
+	pthread_join(v->thread, NULL);
+
+	if(v->bad >= 0)	{
+		fprintf(stderr, "\nPass %d (%s): verify FAILED at offset %ld\n",
+				i + 1, v->p->name, (long)v->bad);
+		return -1;
+	}
+	if(v->complete)
+		fprintf(stderr, "Pass %d (%s): verified %.3f Mb in %.3fs\n",
+				i + 1, v->p->name, (v->len - v->start) / 1000000.0f,
+				v->runtime);
+	free(v->p->keys);
+	v->p->keys = NULL;
+	return 0;
+}
+
+static int passes_main(void)
+{
+	struct verifier vs[2], *v = NULL;
+	struct timespec t_start, t_pass;
+	struct gen *g;
+	unsigned char *buf;
+	unsigned long waits = 0;
+	unsigned int spins = 0;
+	size_t written = 0, b, n, nkeys;
+	uint64_t t0, r0;
+	off_t len, off, start, from = 0, ck_off = 0;
+	float mb, runtime;
+	int fd, rfd = -1, ret = EXIT_SUCCESS;
+	int i, first = 0, ck_pass = 0;
+
+	fd = open_destination(fname);
+
+	if(total > 0)	{
+		len = (off_t)total * bufsize;
+	} else if((len = device_size(fd)) < 0 || (len -= skip) <= 0)	{
+		fputs("Passes need -n or a destination with a size\n", stderr);
+		return EXIT_FAILURE;
+	}
+	nkeys = ((len + bufsize - 1) / bufsize + reps - 1) / reps;
+
+	if(resume)	{
+		load_checkpoint(&first, &from);
+		from -= skip;
+		if(first >= nr_passes || from > len)	{
+			fputs("Checkpoint is past the end of these passes\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(verify && (rfd = open(fname, O_RDONLY | (direct_io ? O_DIRECT : 0))) < 0)	{
+		perror("Opening destination to verify");
+		return EXIT_FAILURE;
+	}
+	if((buf = alloc_buffer(bufsize, buf_align)) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	g = new_root_gen();
+
+	setup_signals();
+	if(ckpt_file != NULL)	{
+		start_checkpoints();
+		save_checkpoint(fd, first, skip + from);
+	}
+	ck_pass = first;
+	ck_off = from;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+	for(i = first; i < nr_passes && !done; i++)	{
+		struct pass *p = &passes[i];
+
+		start = (i == first) ? from : 0;
+		ck_pass = i;
+		ck_off = start;
+
+		if(p->kind == PASS_RANDOM)	{
+			p->snap = gen_copy(g);
+			if(verify)
+				p->keys = malloc(nkeys * klen);
+			if(p->snap == NULL || (verify && p->keys == NULL))	{
+				fputs("Memory allocation error\n", stderr);
+				return EXIT_FAILURE;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t_pass);
+		for(b = start / bufsize, off = start; off < len && !done; b++, off += n)	{
+			n = (len - off < (off_t)bufsize) ? (size_t)(len - off) : bufsize;
+
+			pass_block(p, g, buf, b, off == start, false);
+
+			/* Trail the read-back of the previous pass */
+			while(v != NULL &&
+				  __atomic_load_n(&v->verified, __ATOMIC_ACQUIRE) < off + (off_t)n)	{
+				waits++;
+				ring_backoff(&spins);
+			}
+			spins = 0;
+
+			t0 = metrics_clock();
+			r0 = throttle(n, &t0);
+			if(pwrite_block(fd, buf, n, skip + off) == 0)	{
+				done = true;
+				break;
+			}
+			metrics_wrote(n, t0);
+			rate_done(r0, n);
+			written++;
+
+			ck_off = off + n;
+			if(checkpoint_due && ckpt_file != NULL)
+				save_checkpoint(fd, i, skip + ck_off);
+		}
+		if(off >= len)	{
+			ck_pass = i + 1;
+			ck_off = 0;
+		}
+
+		/* Push the pass out and drop it from the cache, so the read-back
+		 * comes from the device and not from memory
+		 */
+		if(fsync(fd) < 0 && (errno == EIO || errno == EBADF))	{
+			perror("Sync after pass");
+			return EXIT_FAILURE;
+		}
+		posix_fadvise(fd, skip, len, POSIX_FADV_DONTNEED);
+
+		fprintf(stderr, "Pass %d/%d (%s): %.3f Mb in %.3fs\n", i + 1,
+				nr_passes, p->name, (off - start) / 1000000.0f,
+				elapsed(&t_pass));
+
+		if(v != NULL && finish_verify(v) != 0)	{
+			ret = EXIT_FAILURE;
+			v = NULL;
+			break;
+		}
+		v = NULL;
+		if(verify && !done)	{
+			v = &vs[i % 2];
+			v->p = p;
+			v->fd = rfd;
+			v->start = start;
+			v->len = len;
+			v->verified = start;
+			v->bad = -1;
+			v->complete = false;
+			pthread_create(&v->thread, NULL, verify_pass, v);
+		}
+	}
+	if(v != NULL && finish_verify(v) != 0)
+		ret = EXIT_FAILURE;
+
+	runtime = elapsed(&t_start);
+
+	if(debug && verify)
+		fprintf(stderr, "Writer waited on the read-back %lu times\n", waits);
+
+	/* Every pass written means there is nothing left to resume, short of
+	 * that an interrupted run saves where it got to
+	 */
+	if(ckpt_file != NULL)	{
+		if(ck_pass >= nr_passes)
+			unlink(ckpt_file);
+		else if(interrupted)
+			save_checkpoint(fd, ck_pass, skip + ck_off);
+	}
+
+	mb = (float)((written * bufsize) / 1000000.0f);
+	fprintf(stderr, "\nFinished, %ld blocks (%.3f Mb) written in %.3fs (%.2f Mb/s)\n",
+					written, mb, runtime, mb / runtime);
+
+	for(i = 0; i < nr_passes; i++)	{
+		gen_free(passes[i].snap);
+		free(passes[i].keys);
+	}
+	gen_free(g);
+	free_buffer(buf);
+	if(rfd >= 0)
+		close(rfd);
+	close(fd);
+	return ret;
+}
+
+/* Discard mode: hand [skip, skip + -n blocks or the end of the device) to
+ * the device to drop, in DISCARD_CHUNK pieces so SIGINT gets a look in,
+ * then write keystream over nr_samples blocks spread over it and read them
+ * back.  The samples show the device still takes writes where it was told
+ * to forget, and with BLKZEROOUT the block after each is checked to read
+ * zeros.  Returns DISCARD_REFUSED if the very first discard fails, for the
+ * caller to overwrite everything instead.
+ */
+#define DISCARD_CHUNK		(1024L * 1024 * 1024)
+#define DISCARD_REFUSED		-1
+
+static const char *discard_names[] = { "None", "Discard", "Secure discard",
+									   "Zero-out" };
+
+static int discard_main(void)
+{
+	struct timespec t_start;
+	struct gen *g, *snap;
+	unsigned char *buf, *got, *keys;
+	struct stat st;
+	size_t sector, blocks, n, i, bad = 0;
+	off_t len, off, chunk, stride;
+	off_t *where;
+	uint64_t t0, r0;
+	int fd, rfd, ret = EXIT_SUCCESS;
+
+	if(fname == NULL || nr_dests > 1)	{
+		fputs("Discarding needs a single destination\n", stderr);
+		return DISCARD_REFUSED;
+	}
+	fd = open_destination(fname);
+
+	if(fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode))	{
+		fputs("Only a block device can be discarded, a file's blocks would "
+			  "just be freed\n", stderr);
+		close(fd);
+		return DISCARD_REFUSED;
+	}
+
+	if(total > 0)	{
+		len = (off_t)total * bufsize;
+	} else if((len = device_size(fd)) < 0 || (len -= skip) <= 0)	{
+		fputs("Discarding needs -n or a destination with a size\n", stderr);
+		close(fd);
+		return DISCARD_REFUSED;
+	}
+
+	sector = device_block_size(fd);
+	if(skip % sector != 0 || len % sector != 0)	{
+		fprintf(stderr, "Can only discard whole sectors of %ld bytes\n",
+				sector);
+		close(fd);
+		return DISCARD_REFUSED;
+	}
+
+	setup_signals();
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for(off = 0; off < len && !done; off += chunk)	{
+		chunk = (len - off < DISCARD_CHUNK) ? len - off : DISCARD_CHUNK;
+		if(discard_range(fd, discard, skip + off, chunk) != 0)	{
+			perror(discard_names[discard]);
+			close(fd);
+			if(off == 0)
+				return DISCARD_REFUSED;
+			fprintf(stderr, "Stopped %ld bytes in\n", (long)off);
+			return EXIT_FAILURE;
+		}
+		if(debug) fprintf(stderr, "\r%.3f Mb", (off + chunk) / 1000000.0f);
+	}
+	fprintf(stderr, "%s of %.3f Mb in %.3fs\n", discard_names[discard],
+			off / 1000000.0f, elapsed(&t_start));
+	if(done)	{
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	/* One sample somewhere in each of nr_samples equal strides, where
+	 * exactly is up to the entropy pool
+	 */
+	blocks = (len + bufsize - 1) / bufsize;
+	if(nr_samples > blocks)
+		nr_samples = blocks;
+	stride = blocks / (nr_samples ? nr_samples : 1);
+
+	where = calloc(nr_samples, sizeof(off_t));
+	keys = malloc(nr_samples * klen);
+	buf = alloc_buffer(bufsize, buf_align);
+	got = alloc_buffer(bufsize, buf_align);
+	if((nr_samples && (where == NULL || keys == NULL)) || buf == NULL || got == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	g = new_root_gen();
+	if((snap = gen_copy(g)) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < nr_samples && !done; i++)	{
+		uint32_t r;
+
+		entropy_bytes((unsigned char *)&r, sizeof(r));
+		where[i] = ((off_t)i * stride + r % stride) * bufsize;
+		n = (len - where[i] < (off_t)bufsize) ? (size_t)(len - where[i]) : bufsize;
+
+		entropy_bytes(keys + i * klen, klen);
+		gen_reseed(g, keys + i * klen, klen);
+		t0 = fill_block(g, buf, metrics_clock());
+		r0 = throttle(n, &t0);
+		if(pwrite_block(fd, buf, n, skip + where[i]) == 0)	{
+			ret = EXIT_FAILURE;
+			break;
+		}
+		metrics_wrote(n, t0);
+		rate_done(r0, n);
+	}
+	if(fsync(fd) < 0 && (errno == EIO || errno == EBADF))	{
+		perror("Sync after samples");
+		ret = EXIT_FAILURE;
+	}
+	posix_fadvise(fd, skip, len, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	if((rfd = open(fname, O_RDONLY | (direct_io ? O_DIRECT : 0))) < 0)	{
+		perror("Opening destination to verify");
+		exit(EXIT_FAILURE);
+	}
+	/* Replay the samples in the same order from the generator as it was */
+	for(size_t j = 0; j < i && ret == EXIT_SUCCESS; j++)	{
+		n = (len - where[j] < (off_t)bufsize) ? (size_t)(len - where[j]) : bufsize;
+
+		gen_reseed(snap, keys + j * klen, klen);
+		fill_block(snap, buf, metrics_clock());
+		if(pread_block(rfd, got, n, skip + where[j]) != n ||
+		   memcmp(buf, got, n) != 0)	{
+			fprintf(stderr, "Sample at offset %ld: verify FAILED\n",
+					(long)(skip + where[j]));
+			bad++;
+			continue;
+		}
+
+		/* Zeroed means zeros, unlike a discard which may leave anything */
+		off = where[j] + n;
+		if(discard == DISCARD_ZERO && off < len)	{
+			n = (len - off < (off_t)bufsize) ? (size_t)(len - off) : bufsize;
+			if(j + 1 < i && where[j + 1] < off + (off_t)n)
+				continue;
+			if(pread_block(rfd, got, n, skip + off) != n ||
+			   got[0] != 0 || memcmp(got, got + 1, n - 1) != 0)	{
+				fprintf(stderr, "Block at offset %ld: not zeroed\n",
+						(long)(skip + off));
+				bad++;
+			}
+		}
+	}
+	close(rfd);
+
+	if(bad > 0)
+		ret = EXIT_FAILURE;
+	fprintf(stderr, "\nFinished, %ld of %ld samples (%.3f Mb) written and "
+			"%s in %.3fs\n", i, nr_samples, i * bufsize / 1000000.0f,
+			(bad == 0) ? "verified" : "FAILED", elapsed(&t_start));
+
+	gen_free(g);
+	gen_free(snap);
+	free(where);
+	free(keys);
+	free_buffer(buf);
+	free_buffer(got);
+	return ret;
+}
+
+/* With -p, how long from starting up to the first block on its way */
+static void report_startup(void)
+{
+	uint64_t first = metrics_first_write();
+
+	if(!print_conf || first == 0)
+		return;
+	fprintf(stderr, "Time to first byte: %.3f ms\n",
+			(first - ((uint64_t)t_launch.tv_sec * 1000000000u +
+					  t_launch.tv_nsec)) / 1000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *data, *key;
+	unsigned int n;
+	struct gen *g;
+	struct rekey_slot *rk;
+	size_t written = 0, resumed = 0;
+	struct timespec t_start, t_end;
+	float mb, runtime;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_launch);
+	initialize_options(argc, argv);
+	if(scheme != NULL && parse_scheme(scheme) != 0)
+		return EXIT_FAILURE;
+
+	if (nr_threads > 200) {
+		fputs("Too many threads, must be <= 200\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	/* Less than a block a second would only sleep a long while per write */
+	if(rate_bytes > 0 && rate_bytes < bufsize)	{
+		fprintf(stderr, "WARNING: -B %zu is under one %zu byte block a second, "
+				"using %zu\n", rate_bytes, bufsize, bufsize);
+		rate_bytes = bufsize;
+	}
+
+	pthread_t producers[nr_threads];
+
+	key = malloc(klen);
+	tinfo = calloc(nr_threads, sizeof(struct per_thread));
+
+	if(key == NULL || tinfo == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if(print_conf)	{
+		char tstr[64];
+
+		if(total == 0) strcpy(tstr, "(unlimited)");
+		else snprintf(tstr, 63, "%ld", total);
+
+		char gname[64];
+
+		fprintf(stderr,
+			"Block size: %ld\nBlocks / key: %ld\nKey bytes: %ld\n"
+			"Generator: %s\nPasses: %s%s\nTotal: %s\n"
+			"Destination: %s (%ld bytes skipped)%s",
+			bufsize, reps, klen, gen_describe(gen_type, gen_param(),
+			gname, sizeof(gname)), (scheme != NULL) ? scheme : "random",
+			(verify) ? " (verified)" : "", tstr,
+			(fname == NULL) ? "(stdout)" : (nr_dests > 1) ? "(several)" : fname,
+			skip,
+			(direct_io) ? "\nDirect IO (O_DIRECT) in use\n" : "\n");
+		fprintf(stderr, "Keys from: %s\n",
+				entropy_describe(gname, sizeof(gname)));
+		if(rate_bytes || rate_writes || rate_latency)
+			fprintf(stderr, "Rate limit: %zu bytes/s, %zu writes/s, "
+					"%zu us latency target (0 is none)\n",
+					rate_bytes, rate_writes, rate_latency);
+	}
+
+	if(io_class != 0 && set_io_priority(io_class, io_level) != 0)
+		perror("Setting I/O priority");
+	rate_init(rate_bytes, rate_writes, rate_latency, &done);
+
+	if(prefetch_start(klen) != 0)
+		fputs("Could not start the rekey thread, rekeying inline\n", stderr);
+	if(metrics_start(metrics_fd, status_line) != 0)	{
+		perror("Starting metrics");
+		return EXIT_FAILURE;
+	}
+
+	/* Dropping the range is all it takes unless the device won't */
+	if(discard != DISCARD_NONE)	{
+		int ret = discard_main();
+
+		if(ret != DISCARD_REFUSED)	{
+			metrics_stop();
+			prefetch_stop();
+			rate_report();
+			report_startup();
+			return ret;
+		}
+		fputs("Overwriting everything instead\n", stderr);
+	}
+
+	if(nr_dests > 1 || nr_shards > 0 || nr_passes > 0 || extents_only ||
+	   tree)	{
+		int ret;
+
+		free(key);
+		free(tinfo);
+		ret = (tree) ? tree_main() :
+			  (extents_only) ? extent_main() :
+			  (nr_shards > 0) ? shard_main() :
+			  (nr_passes > 0) ? passes_main() : multi_main();
+		metrics_stop();
+		prefetch_stop();
+		rate_report();
+		report_startup();
+		return ret;
+	}
+
+	fd = open_destination(fname);
+
+	if(resume)	{
+		int pass;
+		off_t from;
+
+		load_checkpoint(&pass, &from);
+		if(lseek(fd, from, SEEK_SET) < 0)	{
+			perror("Failed to seek to the checkpoint");
+			return EXIT_FAILURE;
+		}
+		written = resumed = (from - skip) / bufsize;
+		if(total > 0 && written >= total)
+			done = true;
+	}
+
+	/* Without -t the main thread is the generator */
+	if(nr_threads == 1)
+		pin_worker(0);
+	if((data = alloc_buffer(bufsize, buf_align)) == NULL)	{
+		fputs("Memory allocation error\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if(debug) fprintf(stderr, "Initalizing key with %ld bytes\n", klen);
+
+	g = new_root_gen();
+
+	setup_signals();
+	if(ckpt_file != NULL)	{
+		start_checkpoints();
+		save_checkpoint(fd, 0, skip + (off_t)written * bufsize);
+	}
+
+	if(clock_gettime(CLOCK_MONOTONIC, &t_start) != 0)	{
+		perror("clock_gettime");
+		return 1;
+	}
+
+	rk = prefetch_register(g);
+
+	if(nr_threads > 1)	{
+		init_threads(g, true);
+		for(int i = 0; i < nr_threads; i++)	{
+			pthread_create(&producers[i], NULL, worker_generator, &tinfo[i]);
+		}
+	}
+
+
+	if(uring_depth > 0 && nr_threads > 1)	{
+		fputs("io_uring is only used without -t, using write()\n", stderr);
+	} else if(uring_depth > 0 && uring_loop(fd, g, rk, key, &written) == 0)	{
+		done = true;
+	} else if(uring_depth == 0 && nr_threads == 1 && !direct_io &&
+			  ckpt_file == NULL && splice_loop(fd, g, rk, key, &written) == 0)	{
+		done = true;
+	}
+
+	while(!done)	{
+		uint64_t t = metrics_clock(), r0;
+
+		/* Mix the state with more random bytes */
+		rekey(g, rk, key);
+
+		for(n = 0; n < reps && !done; n++)	{
+			unsigned char *d;
+			if(nr_threads > 1)	{
+				d = get_available_data();
+				t = metrics_clock();
+			} else {
+				t = fill_block(g, data, t);
+				d = data;
+			}
+
+			r0 = throttle(bufsize, &t);
+			if(write_block(fd, d, bufsize) == 0)	{
+				done = true;
+			} else {
+				t = metrics_wrote(bufsize, t);
+				rate_done(r0, bufsize);
+				written++;
+			}
+
+			if(total > 0 && written >= total)
+				done = true;
+			if(checkpoint_due && ckpt_file != NULL)
+				save_checkpoint(fd, 0, skip + (off_t)written * bufsize);
+		}
+
+		if(debug && !done)
+			fprintf(stderr,
+				"Reinitalizing key, %ld blocks so far (%.3f Mb)\r",
+				written, (float)((written * bufsize) / 1000000.0));
+	}
+
+	if(nr_threads > 1)	{
+		for(int i = 0; i < nr_threads; i++)
+			pthread_join(producers[i], NULL);
+		if(debug)
+			for(int i = 0; i < nr_threads; i++)
+				fprintf(stderr, "\nThread %d: writer waited %lu times",
+						i, tinfo[i].stalls);
+	}
+	free_threads();
+	prefetch_stop();
+
+	free_buffer(data);
+	free(key);
+	gen_free(g);
+
+	if(fsync(fd) < 0)	{
+		if(errno == EIO || errno == EBADF)	{
+			perror("Final sync");
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Interrupted runs keep where they got to, finished ones are done */
+	if(ckpt_file != NULL)	{
+		if(interrupted)
+			save_checkpoint(fd, 0, skip + (off_t)written * bufsize);
+		else
+			unlink(ckpt_file);
 	}
 
 	if(clock_gettime(CLOCK_MONOTONIC, &t_end) != 0)	{
 		perror("clock_gettime");
 		return 1;
 	}
+	metrics_stop();
 
+	written -= resumed;
 	mb = (float)((written * bufsize) / 1000000.0f);
 	runtime = (t_end.tv_sec - t_start.tv_sec) +
 			  ((float)(t_end.tv_nsec - t_start.tv_nsec) / 1000000000.0f);
 
 	fprintf(stderr, "\nFinished, %ld blocks (%.3f Mb) written in %.3fs (%.2f Mb/s)\n",
 					written, mb, runtime, mb / runtime);
+	rate_report();
+	report_startup();
 
 	if(fname != NULL)
 		close(fd);
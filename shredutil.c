@@ -1,32 +1,24 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
-/* Read @len random bytes from /dev/urandom into @buf */
-void read_random_bytes(const char *rand_device, unsigned char *buf, size_t len)
-{
-	int fd;
-	fd = open(rand_device, O_RDONLY);
-	if (fd >= 0) {
-		size_t rb = 0;
-		while(rb < len)	{
-			ssize_t r = read(fd, buf + rb, len - rb);
-			if(r < 0)	{
-				perror("Read random");
-				exit(EXIT_FAILURE);
-			}
-			rb += r;
-		}
-		close(fd);
-	} else {
-		perror("Random device");
-		exit(EXIT_FAILURE);
-	}
-}
+#include "shredutil.h"
 
 /* Write @len bytes from @buf out to file descriptor @fd.
  * Return 1 on success, 0 on full device, exit on failure
@@ -40,11 +32,14 @@ int write_block(int fd, unsigned char *buf, size_t len)
 
 		this_write = write(fd, buf + written, len - written);
 
-		if(errno || this_write < 0)	{
-			if(errno == ENOSPC)	{
+		/* Block devices return 0 once the end is reached */
+		if(this_write <= 0)	{
+			if(this_write == 0 || errno == ENOSPC)	{
 				fputs("\nNo space left, exiting", stderr);
 				return 0;
 			}
+			if(errno == EINTR)
+				continue;
 			perror("Writing data");
 			exit(EXIT_FAILURE);
 		}
@@ -53,3 +48,307 @@ int write_block(int fd, unsigned char *buf, size_t len)
 	}
 	return 1;
 }
+
+/* Like write_block() but positional, for writers sharing @fd: write @len
+ * bytes from @buf at offset @off.  Return 1 on success, 0 on full device.
+ */
+int pwrite_block(int fd, unsigned char *buf, size_t len, off_t off)
+{
+	size_t written = 0;
+	ssize_t this_write = 0;
+
+	while(written < len)	{
+
+		this_write = pwrite(fd, buf + written, len - written, off + written);
+
+		if(this_write <= 0)	{
+			if(this_write == 0 || errno == ENOSPC)	{
+				fputs("\nNo space left, exiting", stderr);
+				return 0;
+			}
+			if(errno == EINTR)
+				continue;
+			perror("Writing data");
+			exit(EXIT_FAILURE);
+		}
+
+		written += this_write;
+	}
+	return 1;
+}
+
+/* Hand @len bytes at @buf to the pipe @fd with vmsplice(), gifting the
+ * pages so the reader gets them without a copy.  The buffer must not be
+ * touched again until the reader has consumed it.  Returns 0 when the
+ * pipe has no reader left, like write_block() at the end of a device.
+ */
+int gift_block(int fd, unsigned char *buf, size_t len)
+{
+	size_t gifted = 0;
+	ssize_t this_gift = 0;
+
+	while(gifted < len)	{
+		struct iovec iov = { buf + gifted, len - gifted };
+
+		this_gift = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+
+		if(this_gift <= 0)	{
+			if(this_gift == 0 || errno == EPIPE)	{
+				fputs("\nReader went away, exiting", stderr);
+				return 0;
+			}
+			if(errno == EINTR)
+				continue;
+			perror("Splicing data");
+			exit(EXIT_FAILURE);
+		}
+
+		gifted += this_gift;
+	}
+	return 1;
+}
+
+/* Move @len bytes waiting in the pipe @pipe_fd to @fd at *@off with
+ * splice().  Returns 1 when done, 0 when the device is full and -1 with
+ * errno set if @fd can't be spliced to at all.
+ */
+int splice_block(int pipe_fd, int fd, loff_t *off, size_t len)
+{
+	size_t moved = 0;
+	ssize_t this_move = 0;
+
+	while(moved < len)	{
+
+		this_move = splice(pipe_fd, NULL, fd, off, len - moved, SPLICE_F_MOVE);
+
+		if(this_move <= 0)	{
+			if(this_move == 0 || errno == ENOSPC)	{
+				fputs("\nNo space left, exiting", stderr);
+				return 0;
+			}
+			if(errno == EINTR)
+				continue;
+			if(errno == EINVAL && moved == 0)
+				return -1;
+			perror("Splicing data");
+			exit(EXIT_FAILURE);
+		}
+
+		moved += this_move;
+	}
+	return 1;
+}
+
+/* Read @len bytes at @off, returns how many were read before end of file */
+size_t pread_block(int fd, unsigned char *buf, size_t len, off_t off)
+{
+	size_t got = 0;
+	ssize_t this_read = 0;
+
+	while(got < len)	{
+
+		this_read = pread(fd, buf + got, len - got, off + got);
+
+		if(this_read <= 0)	{
+			if(this_read == 0)
+				break;
+			if(errno == EINTR)
+				continue;
+			perror("Reading data");
+			exit(EXIT_FAILURE);
+		}
+
+		got += this_read;
+	}
+	return got;
+}
+
+/* Size in bytes of the file or block device behind @fd, -1 if it has none
+ * (pipes, character devices), the file offset is left where it was
+ */
+off_t device_size(int fd)
+{
+	struct stat st;
+	off_t cur, end;
+
+	if(fstat(fd, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+		return -1;
+	if((cur = lseek(fd, 0, SEEK_CUR)) < 0)
+		return -1;
+	end = lseek(fd, 0, SEEK_END);
+	lseek(fd, cur, SEEK_SET);
+	return end;
+}
+
+/* Smallest unit O_DIRECT I/O to @fd has to be aligned to: the logical
+ * sector size of a block device, the filesystem block size of a file
+ */
+size_t device_block_size(int fd)
+{
+	struct stat st;
+
+	if(fstat(fd, &st) != 0)
+		return 512;
+#ifdef BLKSSZGET
+	if(S_ISBLK(st.st_mode))	{
+		int ssz;
+
+		if(ioctl(fd, BLKSSZGET, &ssz) == 0 && ssz > 0)
+			return ssz;
+		return 512;
+	}
+#endif
+	if(S_ISREG(st.st_mode) && st.st_blksize > 0)
+		return st.st_blksize;
+	return 512;
+}
+
+/* Put this process in I/O scheduling @class (1 realtime, 2 best-effort,
+ * 3 idle) at @level 0-7, -1 with errno set where that isn't supported
+ */
+int set_io_priority(int class, int level)
+{
+#ifdef SYS_ioprio_set
+	/* IOPRIO_WHO_PROCESS, this process */
+	return syscall(SYS_ioprio_set, 1, 0, (class << 13) | level);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Have the device drop [@off, @off + @len) of @fd with BLKDISCARD,
+ * BLKSECDISCARD or BLKZEROOUT.  Returns -1 with errno set when the device
+ * won't, EOPNOTSUPP for anything but a block device: a hole punched in a
+ * file only frees its blocks, the old data stays on the disk.
+ */
+int discard_range(int fd, enum discard_kind how, off_t off, off_t len)
+{
+	struct stat st;
+
+	if(fstat(fd, &st) != 0)
+		return -1;
+#ifdef BLKDISCARD
+	if(S_ISBLK(st.st_mode))	{
+		uint64_t range[2] = { off, len };
+		unsigned long req = (how == DISCARD_SECURE) ? BLKSECDISCARD :
+							(how == DISCARD_ZERO) ? BLKZEROOUT : BLKDISCARD;
+
+		return ioctl(fd, req, range);
+	}
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+/* Append [@off, @off + @len) to the growing @list of @n, merging it into
+ * the last extent when they touch
+ */
+static int add_extent(struct extent **list, size_t *n, size_t *cap,
+					  off_t off, off_t len)
+{
+	struct extent *l;
+
+	if(*n > 0 && (*list)[*n - 1].off + (*list)[*n - 1].len == off)	{
+		(*list)[*n - 1].len += len;
+		return 0;
+	}
+	if(*n == *cap)	{
+		*cap = (*cap) ? *cap * 2 : 64;
+		if((l = realloc(*list, *cap * sizeof(struct extent))) == NULL)
+			return -1;
+		*list = l;
+	}
+	(*list)[*n].off = off;
+	(*list)[*n].len = len;
+	(*n)++;
+	return 0;
+}
+
+#ifdef FS_IOC_FIEMAP
+#define FIEMAP_BATCH	256
+
+/* Extents from FIEMAP, for kernels without SEEK_DATA */
+static ssize_t fiemap_extents(int fd, off_t start, off_t end,
+							  struct extent **list)
+{
+	struct fiemap *fm;
+	size_t n = 0, cap = 0;
+	off_t pos = start;
+	bool last = false;
+
+	fm = malloc(sizeof(*fm) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if(fm == NULL)
+		return -1;
+
+	while(pos < end && !last)	{
+		memset(fm, 0, sizeof(*fm));
+		fm->fm_start = pos;
+		fm->fm_length = end - pos;
+		fm->fm_extent_count = FIEMAP_BATCH;
+		if(ioctl(fd, FS_IOC_FIEMAP, fm) != 0)	{
+			free(fm);
+			free(*list);
+			return -1;
+		}
+		if(fm->fm_mapped_extents == 0)
+			break;
+
+		for(unsigned int i = 0; i < fm->fm_mapped_extents; i++)	{
+			struct fiemap_extent *e = &fm->fm_extents[i];
+			off_t lo = (e->fe_logical > (uint64_t)start) ? (off_t)e->fe_logical : start;
+			off_t hi = e->fe_logical + e->fe_length;
+
+			if(hi > end)
+				hi = end;
+			if(hi > lo && add_extent(list, &n, &cap, lo, hi - lo) != 0)	{
+				free(fm);
+				free(*list);
+				return -1;
+			}
+			pos = e->fe_logical + e->fe_length;
+			if(e->fe_flags & FIEMAP_EXTENT_LAST)
+				last = true;
+		}
+	}
+	free(fm);
+	return n;
+}
+#endif
+
+/* List the parts of [@start, @end) of file @fd that hold data, holes left
+ * out, in *@list (to be freed) in file order.  Uses SEEK_DATA/SEEK_HOLE and
+ * falls back on FIEMAP.  Returns how many, or -1 with errno set.
+ */
+ssize_t data_extents(int fd, off_t start, off_t end, struct extent **list)
+{
+	size_t n = 0, cap = 0;
+	off_t data, hole = start;
+
+	*list = NULL;
+	while(hole < end)	{
+		if((data = lseek(fd, hole, SEEK_DATA)) < 0)	{
+			if(errno == ENXIO)		/* only a hole from here on */
+				break;
+#ifdef FS_IOC_FIEMAP
+			if(errno == EINVAL && n == 0)
+				return fiemap_extents(fd, start, end, list);
+#endif
+			free(*list);
+			return -1;
+		}
+		if(data >= end)
+			break;
+		if((hole = lseek(fd, data, SEEK_HOLE)) < 0)	{
+			free(*list);
+			return -1;
+		}
+		if(hole > end)
+			hole = end;
+		if(add_extent(list, &n, &cap, data, hole - data) != 0)	{
+			free(*list);
+			return -1;
+		}
+	}
+	return n;
+}
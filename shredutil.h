@@ -0,0 +1,26 @@
+#ifndef SHREDUTIL_H_
+#define SHREDUTIL_H_
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+int write_block(int fd, unsigned char *buf, size_t len);
+int pwrite_block(int fd, unsigned char *buf, size_t len, off_t off);
+size_t pread_block(int fd, unsigned char *buf, size_t len, off_t off);
+int gift_block(int fd, unsigned char *buf, size_t len);
+int splice_block(int pipe_fd, int fd, loff_t *off, size_t len);
+off_t device_size(int fd);
+size_t device_block_size(int fd);
+int set_io_priority(int class, int level);
+
+enum discard_kind	{ DISCARD_NONE, DISCARD_PLAIN, DISCARD_SECURE, DISCARD_ZERO };
+int discard_range(int fd, enum discard_kind how, off_t off, off_t len);
+
+struct extent	{
+	off_t off;
+	off_t len;
+};
+ssize_t data_extents(int fd, off_t start, off_t end, struct extent **list);
+
+#endif
@@ -19,13 +19,18 @@
 #include <math.h>
 #include <sys/time.h>
 
-#include "rc4.h"
+#include "gen.h"
 #include "cmdlineparse.h"
+#include "mem.h"
 
 double total_time = -1.0;
 size_t total_ram = (1 << 24);
 bool keep_going = true;
 int chunks = 0;
+int lanes = 1;
+enum gen_type gen_type = GEN_RC4;
+int gen_rounds = 20;
+int cpu = -1;
 
 int stop_count = 0;
 
@@ -69,7 +74,7 @@ static void initialize_options(int argc, char *argv[])
 {
 	int c;
 
-	while((c=getopt(argc, argv, "+hn:t:c:")) != -1)	{
+	while((c=getopt(argc, argv, "+hn:t:c:l:g:A:H:")) != -1)	{
 		switch(c)	{
 			case 'n':
 				total_ram = parse_num(c);
@@ -80,6 +85,33 @@ static void initialize_options(int argc, char *argv[])
 			case 't':
 				total_time = parse_dbl(c);
 				break;
+			case 'g':
+				if(gen_parse(optarg, &gen_type, &gen_rounds) != 0)	{
+					fprintf(stderr, "Unknown generator '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'l':
+				lanes = parse_num(c);
+				if(lanes < 1 || lanes > RC4_MAX_LANES)	{
+					fprintf(stderr, "Error, lanes must be 1 to %d\n",
+							RC4_MAX_LANES);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'A':
+				cpu = parse_num(c);
+				break;
+			case 'H':	{
+				enum mem_pages pages;
+
+				if(mem_parse_pages(optarg, &pages) != 0)	{
+					fprintf(stderr, "Unknown page size '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				mem_set_pages(pages);
+				break;
+			}
 			case 'h':
 				fprintf(stderr,
 "Usage: %s [OPTION] [DESTINATION]\n\
@@ -87,6 +119,10 @@ static void initialize_options(int argc, char *argv[])
     -n  amount of RAM to allocate (defaults to 16Mb)\n\
     -c  number of chunks to make up total RAM (ram < 2^20 : 1, else ~log(ram))\n\
     -t  how long to run in seconds, decimals accepted (forever if not given)\n\
+    -l  number of interleaved RC4 lanes (4, 8 or 16 are fastest), default 1\n\
+    -g  generator: rc4 (default), chacha8, chacha12, chacha20 or xoshiro\n\
+    -A  run on this CPU only, with the chunks on its NUMA node\n\
+    -H  chunk pages: normal (default), thp or hugetlb\n\
   Notes:\n\
     Integer values can be postfixed with a multiplier, one of the\n\
     following letters:\n\
@@ -97,7 +133,7 @@ static void initialize_options(int argc, char *argv[])
 ", argv[0]);
 				exit(EXIT_SUCCESS);
 			case '?':
-				if(strchr("nt", optopt) == NULL)
+				if(strchr("ntclgAH", optopt) == NULL)
 					fprintf(stderr,
 						"Unknown option -%c encountered\n", optopt);
 				else
@@ -127,7 +163,7 @@ static void set_timer(double secs)
 
 int main(int argc, char *argv[])
 {
-	struct rc4_ctx ctx;
+	struct gen *g;
 	unsigned char **buf = NULL;
 	unsigned char **bufs = NULL;
 	size_t each_chunk, ctr;
@@ -135,7 +171,17 @@ int main(int argc, char *argv[])
 
 	initialize_options(argc, argv);
 
-	rc4_init_key(&ctx, (unsigned char *)"Ks#gh(a@jks!01GJ;b", 16);
+	if(cpu >= 0 && pin_thread(cpu) != 0)	{
+		perror("Pinning to the CPU");
+		return EXIT_FAILURE;
+	}
+
+	g = gen_new(gen_type, (gen_type == GEN_CHACHA) ? gen_rounds : lanes,
+				(unsigned char *)"Ks#gh(a@jks!01GJ;b", 16);
+	if(g == NULL)	{
+		fprintf(stderr, "Error allocating the generator\n");
+		return EXIT_FAILURE;
+	}
 
 	if(total_time > 0.0)	{
 		set_timer(total_time);
@@ -160,19 +206,19 @@ int main(int argc, char *argv[])
 	each_chunk = total_ram / chunks;
 
 	for(i = 0; i < chunks; i++)	{
-		bufs[i] = malloc(each_chunk + 1);
-		memset(bufs[i], 0x7f, each_chunk + 1);
+		bufs[i] = alloc_buffer(each_chunk + 1, 0);
 		if(bufs[i] == NULL)	{
 			fprintf(stderr, "Error allocating chunk %d/%d (%ld each)\n",
 							i, chunks, each_chunk);
 			return EXIT_FAILURE;
 		}
+		memset(bufs[i], 0x7f, each_chunk + 1);
 	}
 	ctr = 0;
 	while(keep_going)	{
 		buf = bufs;
 		while(*buf && keep_going)
-			rc4_xor_stream(&ctx, *buf++, each_chunk);
+			gen_xor(g, *buf++, each_chunk);
 		ctr++;
 	}
 
@@ -180,9 +226,10 @@ int main(int argc, char *argv[])
 
 	/* why not */
 	for(buf = bufs; *buf; buf++)	{
-		free(*buf);
+		free_buffer(*buf);
 	}
 	free(bufs);
+	gen_free(g);
 
 
 	return EXIT_SUCCESS;
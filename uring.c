@@ -0,0 +1,216 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define rd_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define wr_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Set up a ring with room for @entries requests, returns 0 or -1 w/ errno */
+int uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+	int e;
+
+	memset(u, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(u->fd < 0)
+		return -1;
+	u->entries = p.sq_entries;
+
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)	{
+		if(u->cq_sz > u->sq_sz)
+			u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if(u->sq_ptr == MAP_FAILED)
+		goto fail;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)	{
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if(u->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED)
+		goto fail;
+
+	u->sq_head = (unsigned int *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (char *)u->cq_ptr + p.cq_off.cqes;
+
+	return 0;
+
+fail:
+	e = errno;
+	uring_exit(u);
+	errno = e;
+	return -1;
+}
+
+void uring_exit(struct uring *u)
+{
+	if(u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_sz);
+	if(u->cq_ptr != NULL && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_sz);
+	if(u->sq_ptr != NULL && u->sq_ptr != MAP_FAILED)
+		munmap(u->sq_ptr, u->sq_sz);
+	if(u->fd >= 0)
+		close(u->fd);
+	memset(u, 0, sizeof(struct uring));
+	u->fd = -1;
+}
+
+/* Pin the @n buffers in @iov so writes can use them by index */
+int uring_register_buffers(struct uring *u, struct iovec *iov, unsigned int n)
+{
+	return syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+				   iov, n);
+}
+
+/* Queue a write of @len bytes of registered buffer @buf_index to @fd at
+ * @off, returns -1 if the submission queue is full
+ */
+int uring_write_fixed(struct uring *u, int fd, void *buf, size_t len,
+					  off_t off, int buf_index, uint64_t user_data)
+{
+	unsigned int tail = *u->sq_tail;
+	unsigned int idx;
+	struct io_uring_sqe *sqe;
+
+	if(tail - rd_acquire(u->sq_head) >= u->entries)
+		return -1;
+
+	idx = tail & *u->sq_mask;
+	sqe = (struct io_uring_sqe *)u->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->buf_index = buf_index;
+	sqe->user_data = user_data;
+
+	u->sq_array[idx] = idx;
+	wr_release(u->sq_tail, tail + 1);
+	u->pending++;
+	return 0;
+}
+
+/* Submit what is queued and wait for at least @wait_nr completions */
+int uring_submit(struct uring *u, unsigned int wait_nr)
+{
+	int r;
+
+	do {
+		r = syscall(__NR_io_uring_enter, u->fd, u->pending, wait_nr,
+					wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while(r < 0 && errno == EINTR);
+
+	if(r < 0)
+		return -1;
+	u->pending -= r;
+	return r;
+}
+
+/* Take one completion if there is one: returns 1 and fills @user_data and
+ * @res (bytes written or -errno), 0 if the completion queue is empty
+ */
+int uring_reap(struct uring *u, uint64_t *user_data, int *res)
+{
+	unsigned int head = *u->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if(head == rd_acquire(u->cq_tail))
+		return 0;
+
+	cqe = (struct io_uring_cqe *)u->cqes + (head & *u->cq_mask);
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	wr_release(u->cq_head, head + 1);
+	return 1;
+}
+
+#else /* !HAVE_IO_URING */
+
+int uring_init(struct uring *u, unsigned int entries)
+{
+	(void)entries;
+	memset(u, 0, sizeof(struct uring));
+	u->fd = -1;
+	errno = ENOSYS;
+	return -1;
+}
+
+void uring_exit(struct uring *u)
+{
+	(void)u;
+}
+
+int uring_register_buffers(struct uring *u, struct iovec *iov, unsigned int n)
+{
+	(void)u; (void)iov; (void)n;
+	errno = ENOSYS;
+	return -1;
+}
+
+int uring_write_fixed(struct uring *u, int fd, void *buf, size_t len,
+					  off_t off, int buf_index, uint64_t user_data)
+{
+	(void)u; (void)fd; (void)buf; (void)len;
+	(void)off; (void)buf_index; (void)user_data;
+	return -1;
+}
+
+int uring_submit(struct uring *u, unsigned int wait_nr)
+{
+	(void)u; (void)wait_nr;
+	errno = ENOSYS;
+	return -1;
+}
+
+int uring_reap(struct uring *u, uint64_t *user_data, int *res)
+{
+	(void)u; (void)user_data; (void)res;
+	return 0;
+}
+
+#endif
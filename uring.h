@@ -0,0 +1,35 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Bare-bones io_uring wrapper straight on the syscalls, just enough to keep
+ * a queue of fixed-buffer writes in flight.  Where io_uring isn't available
+ * uring_init() fails with ENOSYS and callers fall back to write().
+ */
+
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int pending;           /* prepared but not yet submitted */
+
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    void *sqes;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+};
+
+int uring_init(struct uring *u, unsigned int entries);
+void uring_exit(struct uring *u);
+int uring_register_buffers(struct uring *u, struct iovec *iov, unsigned int n);
+int uring_write_fixed(struct uring *u, int fd, void *buf, size_t len,
+                      off_t off, int buf_index, uint64_t user_data);
+int uring_submit(struct uring *u, unsigned int wait_nr);
+int uring_reap(struct uring *u, uint64_t *user_data, int *res);
+
+#endif
@@ -0,0 +1,222 @@
+/* vim: set ts=4 sw=4 noexpandtab: */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "xoshiro.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#endif
+
+/* Produce @nbatch batches (one word from every lane) into @out */
+typedef void (*xoshiro_fn)(uint64_t s[4][XOSHIRO_LANES], unsigned char *out,
+						   size_t nbatch);
+
+#define ROTL64(v, n)	(((v) << (n)) | ((v) >> (64 - (n))))
+
+#define XOSHIRO_STEP(s0, s1, s2, s3, res)	do {		\
+		__typeof__(s0) _t = (s1) << 17;					\
+		(res) = ROTL64((s0) + (s3), 23) + (s0);			\
+		(s2) ^= (s0);									\
+		(s3) ^= (s1);									\
+		(s1) ^= (s2);									\
+		(s0) ^= (s3);									\
+		(s2) ^= _t;										\
+		(s3) = ROTL64((s3), 45);						\
+	} while(0)
+
+static void store_le64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for(i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void steps_generic(uint64_t s[4][XOSHIRO_LANES], unsigned char *out,
+						  size_t nbatch)
+{
+	uint64_t r;
+	int l;
+
+	for(; nbatch > 0; nbatch--, out += XOSHIRO_BATCH)	{
+		for(l = 0; l < XOSHIRO_LANES; l++)	{
+			XOSHIRO_STEP(s[0][l], s[1][l], s[2][l], s[3][l], r);
+			store_le64(out + 8 * l, r);
+		}
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+/* W lanes per vector, XOSHIRO_LANES / W vectors per batch */
+#define XOSHIRO_VEC(NAME, W, TARGET)									\
+typedef uint64_t NAME##_v __attribute__((vector_size(8 * (W))));		\
+__attribute__((target(TARGET)))											\
+static void NAME(uint64_t s[4][XOSHIRO_LANES], unsigned char *out,		\
+				 size_t nbatch)											\
+{																		\
+	NAME##_v s0, s1, s2, s3, r;											\
+	size_t b;															\
+	int g;																\
+																		\
+	for(g = 0; g < XOSHIRO_LANES; g += (W))	{							\
+		memcpy(&s0, &s[0][g], sizeof(s0));								\
+		memcpy(&s1, &s[1][g], sizeof(s1));								\
+		memcpy(&s2, &s[2][g], sizeof(s2));								\
+		memcpy(&s3, &s[3][g], sizeof(s3));								\
+		for(b = 0; b < nbatch; b++)	{									\
+			XOSHIRO_STEP(s0, s1, s2, s3, r);							\
+			memcpy(out + b * XOSHIRO_BATCH + 8 * g, &r, sizeof(r));		\
+		}																\
+		memcpy(&s[0][g], &s0, sizeof(s0));								\
+		memcpy(&s[1][g], &s1, sizeof(s1));								\
+		memcpy(&s[2][g], &s2, sizeof(s2));								\
+		memcpy(&s[3][g], &s3, sizeof(s3));								\
+	}																	\
+}
+
+XOSHIRO_VEC(steps_sse2, 2, "sse2")
+XOSHIRO_VEC(steps_avx2, 4, "avx2")
+XOSHIRO_VEC(steps_avx512, 8, "avx512f")
+#endif
+
+static const struct xoshiro_impl	{
+	const char *name;
+	xoshiro_fn fn;
+} impls[] = {
+#ifdef HAVE_X86_SIMD
+	{ "avx512", steps_avx512 },
+	{ "avx2", steps_avx2 },
+	{ "sse2", steps_sse2 },
+#endif
+	{ "generic", steps_generic },
+};
+
+static const struct xoshiro_impl *impl = NULL;
+
+static int cpu_has(const char *name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if(!strcmp(name, "avx512"))
+		return __builtin_cpu_supports("avx512f");
+	if(!strcmp(name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	if(!strcmp(name, "sse2"))
+		return __builtin_cpu_supports("sse2");
+#endif
+	return !strcmp(name, "generic");
+}
+
+static const struct xoshiro_impl *pick_impl(void)
+{
+	size_t i;
+
+	if(impl == NULL)	{
+		for(i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)	{
+			if(cpu_has(impls[i].name))	{
+				impl = &impls[i];
+				break;
+			}
+		}
+	}
+	return impl;
+}
+
+const char *xoshiro_impl(void)
+{
+	return pick_impl()->name;
+}
+
+/* Use kernel @name if the CPU has it (for testing and benchmarks) */
+void xoshiro_force_impl(const char *name)
+{
+	size_t i;
+
+	for(i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+		if(!strcmp(impls[i].name, name) && cpu_has(name))
+			impl = &impls[i];
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* XOR splitmix64 output seeded from all of @k into the state of every lane,
+ * the key absorbed a 64 bit word at a time into the hash of what came before
+ */
+static void mix_key(struct xoshiro_ctx *ctx, const unsigned char *k, size_t l)
+{
+	uint64_t x = l, word = 0;
+	size_t i;
+	int w, lane;
+
+	for(i = 0; i < l; i++)	{
+		word |= (uint64_t)k[i] << (8 * (i % 8));
+		if(i % 8 == 7 || i == l - 1)	{
+			x = splitmix64(&x) ^ word;
+			word = 0;
+		}
+	}
+
+	for(lane = 0; lane < XOSHIRO_LANES; lane++)	{
+		for(w = 0; w < 4; w++)
+			ctx->s[w][lane] ^= splitmix64(&x);
+		/* The all-zero state is the one xoshiro never leaves */
+		if((ctx->s[0][lane] | ctx->s[1][lane] |
+			ctx->s[2][lane] | ctx->s[3][lane]) == 0)
+			ctx->s[0][lane] = 1;
+	}
+}
+
+void xoshiro_init(struct xoshiro_ctx *ctx, const unsigned char *key,
+				  size_t klen)
+{
+	memset(ctx, 0, sizeof(struct xoshiro_ctx));
+	ctx->ks_pos = XOSHIRO_BATCH;
+	mix_key(ctx, key, klen);
+}
+
+/* Mix @l bytes of @k into the state */
+void xoshiro_rekey(struct xoshiro_ctx *ctx, const unsigned char *k, size_t l)
+{
+	mix_key(ctx, k, l);
+}
+
+/* Write @n bytes of the interleaved stream to @buf, carrying on from the
+ * last call
+ */
+void xoshiro_fill_buf(struct xoshiro_ctx *ctx, unsigned char *buf, size_t n)
+{
+	const struct xoshiro_impl *k = pick_impl();
+	size_t take, nbatch;
+
+	if(ctx->ks_pos < XOSHIRO_BATCH)	{
+		take = XOSHIRO_BATCH - ctx->ks_pos;
+		if(take > n)
+			take = n;
+		memcpy(buf, ctx->ks + ctx->ks_pos, take);
+		ctx->ks_pos += take;
+		buf += take;
+		n -= take;
+	}
+
+	if((nbatch = n / XOSHIRO_BATCH) > 0)	{
+		k->fn(ctx->s, buf, nbatch);
+		buf += nbatch * XOSHIRO_BATCH;
+		n -= nbatch * XOSHIRO_BATCH;
+	}
+
+	if(n > 0)	{
+		k->fn(ctx->s, ctx->ks, 1);
+		memcpy(buf, ctx->ks, n);
+		ctx->ks_pos = n;
+	}
+}
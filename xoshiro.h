@@ -0,0 +1,28 @@
+#ifndef XOSHIRO_H_
+#define XOSHIRO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* XOSHIRO_LANES independent xoshiro256++ generators stepped in lock-step,
+ * output is their 64-bit words interleaved (word k from lane k % LANES).
+ * The state is stored lane-minor so SSE2/AVX2/AVX-512 can step 2/4/8 lanes
+ * per instruction; the stream doesn't depend on which path runs.
+ */
+#define XOSHIRO_LANES   8
+#define XOSHIRO_BATCH   (8 * XOSHIRO_LANES)
+
+struct xoshiro_ctx {
+    uint64_t s[4][XOSHIRO_LANES];
+    size_t ks_pos;                  /* unused bytes left in ks */
+    unsigned char ks[XOSHIRO_BATCH];
+};
+
+void xoshiro_init(struct xoshiro_ctx *ctx, const unsigned char *key,
+                  size_t klen);
+void xoshiro_rekey(struct xoshiro_ctx *ctx, const unsigned char *k, size_t l);
+void xoshiro_fill_buf(struct xoshiro_ctx *ctx, unsigned char *buf, size_t n);
+const char *xoshiro_impl(void);
+void xoshiro_force_impl(const char *name);
+
+#endif